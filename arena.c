@@ -0,0 +1,218 @@
+#include "arena.h"
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0 // pages are touched by hand instead
+#endif
+
+static int mode = ARENA_PAGES;
+static size_t prefault;
+static int ready;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; // everything below
+static char *bump, *end; // unused part of the newest chunk
+static Node *pool; // nodes freed by gc()
+static int64_t npool;
+static size_t mapped, tables, prefaulted;
+static size_t smapshuge; // AnonHugePages when last read
+static int64_t smapsms = -1;
+
+static __thread Node *cache; // this thread's free nodes, linked through next
+static __thread int ncache;
+
+
+/*** Mapping ***/
+static size_t round_up(size_t bytes, size_t to){
+	return (bytes + to - 1) / to * to;
+}
+
+static void touch(char *p, size_t bytes){
+	// Fault every page in now rather than on first use
+	long page = sysconf(_SC_PAGE_SIZE);
+	for (size_t i = 0; i < bytes; i += page > 0 ? (size_t)page : 4096)
+		((volatile char *)p)[i] = 0;
+}
+
+static void *map(size_t bytes, int populate){
+	// bytes of zeroed memory backed as mode says, NULL if there is none.
+	// Caller holds the lock, bytes is a multiple of ARENA_HUGE_PAGE
+	void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	if (mode == ARENA_HUGETLB){
+		p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB
+				| (populate ? MAP_POPULATE : 0), -1, 0);
+		if (p != MAP_FAILED)
+			return p;
+		log_warn("No reserved huge pages for %zu MB, using transparent ones", bytes >> 20);
+		mode = ARENA_THP;
+	}
+#else
+	if (mode == ARENA_HUGETLB)
+		mode = ARENA_THP;
+#endif
+	if (mode == ARENA_PAGES){
+		p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS
+				| (populate ? MAP_POPULATE : 0), -1, 0);
+		if (p == MAP_FAILED)
+			return NULL;
+		if (populate && MAP_POPULATE == 0)
+			touch(p, bytes);
+		return p;
+	}
+
+	// ARENA_THP. Over-map by a huge page to start on a huge page boundary, so every
+	// 2 MB of the chunk can be one page, and advise before faulting anything in
+	size_t len = bytes + ARENA_HUGE_PAGE;
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	uintptr_t start = round_up((uintptr_t)p, ARENA_HUGE_PAGE);
+	if (start > (uintptr_t)p)
+		munmap(p, start - (uintptr_t)p);
+	if ((uintptr_t)p + len > start + bytes)
+		munmap((char *)start + bytes, (uintptr_t)p + len - (start + bytes));
+	p = (void *)start;
+#ifdef MADV_HUGEPAGE
+	madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+	if (populate)
+		touch(p, bytes);
+	return p;
+}
+
+static int map_chunk(size_t bytes, int populate){
+	// Start carving from a new chunk. The rest of the old one is dropped, less than a batch
+	char *p = map(bytes, populate);
+	if (p == NULL)
+		return -1;
+	bump = p;
+	end = p + bytes;
+	mapped += bytes;
+	if (populate)
+		prefaulted += bytes;
+	return 0;
+}
+
+
+/*** Arena ***/
+void arena_configure(int m, size_t bytes){
+	// Pick the backing and how much to pre-fault, before init_hashtab()
+	mode = m;
+	prefault = round_up(bytes, ARENA_HUGE_PAGE);
+}
+
+void arena_init(void){
+	pthread_mutex_lock(&lock);
+	if (!ready){
+		ready = 1;
+		if (prefault > 0 && map_chunk(prefault, 1) < 0)
+			log_warn("Unable to pre-fault %zu MB of nodes", prefault >> 20);
+		log_info("Node arena on %s, %zu MB pre-faulted", arena_mode_name(mode), prefaulted >> 20);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+static void refill(void){
+	// Up to ARENA_BATCH nodes into this thread's cache, reused ones first
+	pthread_mutex_lock(&lock);
+	while (ncache < ARENA_BATCH && pool != NULL){
+		Node *p = pool;
+		pool = p->next;
+		p->next = cache;
+		cache = p;
+		ncache++;
+		npool--;
+	}
+	while (ncache < ARENA_BATCH){
+		if ((size_t)(end - bump) < sizeof(Node) && map_chunk(ARENA_CHUNK, 0) < 0)
+			break;
+		Node *p = (Node *)bump;
+		bump += sizeof(Node);
+		p->next = cache;
+		cache = p;
+		ncache++;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+Node *arena_alloc(void){
+	// Room for one node, NULL if no more memory can be mapped
+	if (cache == NULL)
+		refill();
+	Node *p = cache;
+	if (p != NULL){
+		cache = p->next;
+		ncache--;
+	}
+	return p;
+}
+
+void arena_release(Node *first, Node *last, int64_t n){
+	// Give back n nodes linked through next from first to last
+	if (n == 0)
+		return;
+	pthread_mutex_lock(&lock);
+	last->next = pool;
+	pool = first;
+	npool += n;
+	pthread_mutex_unlock(&lock);
+}
+
+void *arena_table(size_t bytes){
+	// Zeroed memory for a hash table, backed like the nodes. NULL if there is none
+	pthread_mutex_lock(&lock);
+	bytes = round_up(bytes, mode == ARENA_PAGES ? (size_t)sysconf(_SC_PAGE_SIZE) : ARENA_HUGE_PAGE);
+	void *p = map(bytes, 0);
+	if (p != NULL)
+		tables += bytes;
+	pthread_mutex_unlock(&lock);
+	return p;
+}
+
+void arena_table_free(void *p, size_t bytes){
+	// bytes as given to arena_table()
+	if (p == NULL)
+		return;
+	pthread_mutex_lock(&lock);
+	bytes = round_up(bytes, mode == ARENA_PAGES ? (size_t)sysconf(_SC_PAGE_SIZE) : ARENA_HUGE_PAGE);
+	munmap(p, bytes);
+	tables -= bytes;
+	pthread_mutex_unlock(&lock);
+}
+
+
+/*** Stats ***/
+static size_t smaps_huge(void){
+	// AnonHugePages of the whole process, reread at most every ARENA_SMAPS_MS
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	int64_t now = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	if (smapsms >= 0 && now - smapsms < ARENA_SMAPS_MS)
+		return smapshuge;
+	smapsms = now;
+	FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+	if (fp == NULL)
+		return smapshuge = 0;
+	char line[128];
+	unsigned long long kb;
+	while (fgets(line, sizeof(line), fp))
+		if (sscanf(line, "AnonHugePages: %llu kB", &kb) == 1){
+			smapshuge = kb << 10;
+			break;
+		}
+	fclose(fp);
+	return smapshuge;
+}
+
+void arena_stats(ArenaStats *s){
+	pthread_mutex_lock(&lock);
+	*s = (ArenaStats){.mode = mode, .mapped = mapped, .tables = tables, .prefaulted = prefaulted, .free = npool};
+	s->huge = mode == ARENA_HUGETLB ? mapped + tables : smaps_huge();
+	pthread_mutex_unlock(&lock);
+}
+
+const char *arena_mode_name(int m){
+	static const char *names[] = {"regular pages", "transparent huge pages", "reserved huge pages"};
+	return m >= ARENA_PAGES && m <= ARENA_HUGETLB ? names[m] : "?";
+}
@@ -0,0 +1,45 @@
+#ifndef ARENA_H
+#define ARENA_H
+#include "hashlife.h"
+
+/*
+ * Node store. Nodes are carved out of large mmap'd chunks rather than malloc'd one by
+ * one, so they sit 64 to a 4 KB page with no allocator header, and the chunks and the
+ * hash table can be backed by 2 MB pages: transparent ones (ARENA_THP) or reserved
+ * ones (ARENA_HUGETLB, see /proc/sys/vm/nr_hugepages, falls back to transparent).
+ * A pre-fault size maps and touches that much up front, so a large run doesn't take
+ * its page faults in the middle of successor().
+ * Memory freed by gc() goes back to the arena, not to the system.
+ */
+
+/*** Defines ***/
+#define ARENA_PAGES   0 // regular pages
+#define ARENA_THP     1 // madvise(MADV_HUGEPAGE)
+#define ARENA_HUGETLB 2 // MAP_HUGETLB
+
+#define ARENA_CHUNK (32 << 20) // bytes mapped at a time once the pre-faulted part is used up
+#define ARENA_HUGE_PAGE (2 << 20)
+#define ARENA_BATCH 256 // nodes a thread takes from the shared pool at once
+#define ARENA_SMAPS_MS 1000 // how often arena_stats() rereads /proc/self/smaps_rollup
+
+/*** Structs ***/
+typedef struct {
+	int mode; // ARENA_*, after any fallback
+	size_t mapped; // bytes of chunks mapped for nodes
+	size_t tables; // bytes mapped for hash tables
+	size_t huge; // of those, bytes on huge pages as far as the kernel reports
+	size_t prefaulted;
+	int64_t free; // nodes in the shared pool, ready for reuse
+} ArenaStats;
+
+/*** Arena ***/
+void arena_configure(int mode, size_t prefault);
+void arena_init(void);
+Node *arena_alloc(void);
+void arena_release(Node *first, Node *last, int64_t n);
+void *arena_table(size_t bytes);
+void arena_table_free(void *p, size_t bytes);
+void arena_stats(ArenaStats *s);
+const char *arena_mode_name(int mode);
+
+#endif
@@ -0,0 +1,135 @@
+#include "cycle.h"
+
+// Generations are recorded by their content hash, equal hashes mean equal cells, so
+// detecting a repeat is a lookup and the table keeps no node alive. Once it is full,
+// older generations are thinned out like the history's snapshots
+
+void cycle_init(Cycle *c, int spaceships){
+	c->cap = CYCLE_INIT_CAP;
+	c->tab = calloc(c->cap, sizeof(CycleEntry));
+	c->spaceships = spaceships;
+	cycle_reset(c);
+}
+
+void cycle_reset(Cycle *c){
+	// Forget every generation, e.g. after the universe was edited
+	memset(c->tab, 0, c->cap * sizeof(CycleEntry));
+	c->len = 0;
+	c->found = 0;
+	c->start = c->period = c->dx = c->dy = 0;
+}
+
+void cycle_free(Cycle *c){
+	free(c->tab);
+	c->tab = NULL;
+	c->cap = c->len = 0;
+}
+
+static CycleEntry *cycle_slot(CycleEntry *tab, int cap, Hash128 h, int kind){
+	// cap is a power of 2, returns the entry for (h, kind) or the empty slot it would take
+	uint64_t i = (h.lo ^ (uint64_t)kind) & (cap - 1);
+	while (tab[i].used && (!hash_equal(tab[i].h, h) || tab[i].kind != kind))
+		i = (i + 1) & (cap - 1);
+	return &tab[i];
+}
+
+static int compare_gens(const void *a, const void *b){
+	const CycleEntry *p = a, *q = b;
+	return p->gen < q->gen ? -1 : p->gen > q->gen;
+}
+
+static CycleEntry *cycle_entries(Cycle *c){
+	// The recorded entries, oldest first
+	CycleEntry *all = malloc(c->len * sizeof(CycleEntry));
+	int n = 0;
+	for (int i = 0; i < c->cap; i++)
+		if (c->tab[i].used)
+			all[n++] = c->tab[i];
+	qsort(all, n, sizeof(CycleEntry), compare_gens);
+	return all;
+}
+
+static void cycle_rehash(Cycle *c, int cap, int thin){
+	// Move the entries to a table of cap slots. Thinning keeps the newest CYCLE_RECENT
+	// and every other older one, so the spacing of what is left grows with age and a
+	// long run that never repeats stays within CYCLE_MAX entries
+	CycleEntry *all = cycle_entries(c), *tab = calloc(cap, sizeof(CycleEntry));
+	int n = 0;
+	for (int i = 0; i < c->len; i++)
+		if (!thin || i >= c->len - CYCLE_RECENT || i % 2 == 1){
+			*cycle_slot(tab, cap, all[i].h, all[i].kind) = all[i];
+			n++;
+		}
+	free(all);
+	free(c->tab);
+	c->tab = tab;
+	c->cap = cap;
+	c->len = n;
+}
+
+static int cycle_lookup(Cycle *c, CycleEntry e){
+	// Record e, or report the cycle if its pattern was seen before. Returns 1 on a repeat
+	if (c->len + 1 > CYCLE_MAX)
+		cycle_rehash(c, c->cap, 1);
+	else if (2 * (c->len + 1) > c->cap)
+		cycle_rehash(c, 2 * c->cap, 0);
+
+	CycleEntry *slot = cycle_slot(c->tab, c->cap, e.h, e.kind);
+	if (!slot->used){
+		e.used = 1;
+		*slot = e;
+		c->len++;
+		return 0;
+	}
+	if (slot->gen == e.gen)
+		return 0; // same generation recorded twice
+
+	c->found = 1;
+	c->start = slot->gen;
+	c->period = e.gen - slot->gen;
+	c->dx = e.x - slot->x;
+	c->dy = e.y - slot->y;
+	return 1;
+}
+
+Node *normalize(Node *p, BBox *box){
+	// p's live cells moved to the upper left corner of the smallest node that holds them.
+	// Any two translations of the same shape give the same node
+	if (!bbox(p, box))
+		return get_zero(0);
+
+	int64_t side = max(box->x1 - box->x0, box->y1 - box->y0);
+	int k = 0;
+	while (((int64_t)1 << k) < side)
+		k++;
+	return subnode(p, box->x0, box->y0, k);
+}
+
+int cycle_record(Cycle *c, Node *root, int64_t gen){
+	// root must be centred on the universe origin, as advance() and crop() keep it.
+	// It is shrunk first, so the same cells under more border, as after an edit, repeat
+	if (c->found)
+		return 1;
+	root = shrink(root);
+	if (cycle_lookup(c, (CycleEntry){.h = root->hash, .kind = CYCLE_ROOT, .gen = gen}))
+		return 1;
+	if (!c->spaceships)
+		return 0;
+
+	BBox box;
+	Node *shape = normalize(root, &box);
+	int64_t half = root->k > 0 ? (int64_t)1 << (root->k - 1) : 0;
+	return cycle_lookup(c, (CycleEntry){
+			.h = shape->hash, .kind = CYCLE_SHAPE, .gen = gen,
+			.x = box.x0 - half, .y = box.y0 - half});
+}
+
+Node *cycle_jump(Cycle *c, Node *root, int64_t gen, int64_t target, unsigned rule){
+	// Generation target of a pattern whose cycle was found, without simulating the
+	// whole periods in between: step the remainder, then move by the displacement
+	assert(c->found && target >= gen && gen >= c->start);
+	int64_t q = (target - gen) / c->period;
+	int64_t r = (target - gen) % c->period;
+	root = advance(root, r, rule);
+	return translate(root, q * c->dx, q * c->dy);
+}
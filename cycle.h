@@ -0,0 +1,42 @@
+#ifndef CYCLE_H
+#define CYCLE_H
+#include "hashlife.h"
+
+/*** Structs ***/
+typedef struct {
+	Hash128 h; // content hash of the cropped root, or of the pattern moved to its bounding box corner
+	int kind;
+	int used;
+	int64_t gen;
+	int64_t x, y; // where the bounding box sits in the universe, for CYCLE_SHAPE entries
+} CycleEntry;
+
+typedef struct {
+	CycleEntry *tab; // open addressing on (h, kind)
+	int cap;
+	int len;
+	int spaceships; // also look for moving patterns, costs one normalize() per record
+
+	// Filled once a generation repeats an earlier one
+	int found;
+	int64_t start; // generation the cycle was first seen
+	int64_t period; // a multiple of the true period when recording every 2^j generations
+	int64_t dx, dy; // displacement over one period
+} Cycle;
+
+/*** Cycle detection ***/
+void cycle_init(Cycle *c, int spaceships);
+void cycle_reset(Cycle *c);
+void cycle_free(Cycle *c);
+int cycle_record(Cycle *c, Node *root, int64_t gen);
+Node *cycle_jump(Cycle *c, Node *root, int64_t gen, int64_t target, unsigned rule);
+Node *normalize(Node *p, BBox *box);
+
+/*** Defines ***/
+#define CYCLE_ROOT  0
+#define CYCLE_SHAPE 1
+#define CYCLE_INIT_CAP 1024
+#define CYCLE_MAX 4096 // generations recorded before older ones are thinned out
+#define CYCLE_RECENT 1024 // newest generations thinning leaves alone
+
+#endif
@@ -0,0 +1,382 @@
+#include "export.h"
+#include <unistd.h>
+
+/*** Structs ***/
+typedef struct {
+	unsigned char *data; // the stripe encoded for the file
+	size_t len;
+	unsigned char *raw; // PNG only: the filtered rows data was compressed from
+	size_t rawlen;
+	int64_t stripe; // stripe held, -1 while being rendered
+} Slot;
+
+typedef struct {
+	// Shared by the render threads and the writer, see export_image()
+	Node *root;
+	int scale, format;
+	int64_t px, py; // pixel of the root's corner
+	int64_t w, h, stripes;
+	size_t rowbytes;
+
+	Slot *slots;
+	int nslots;
+	pthread_mutex_t lock;
+	pthread_cond_t cond; // a slot was filled or written
+	int64_t next; // next stripe to render
+	int64_t written; // stripes written to the file
+	int failed;
+} Export;
+
+typedef struct {
+	unsigned char *out;
+	size_t len;
+	uint64_t bits; // not yet written, lowest first
+	int nbits;
+} BitWriter;
+
+static uint32_t crctab[256];
+static pthread_once_t crconce = PTHREAD_ONCE_INIT;
+
+
+/*** Deflate ***/
+/*
+ * Just enough zlib for PNG: every stripe is one fixed Huffman block where runs
+ * of a repeated byte, most of any overview, become matches at distance 1. The
+ * block is closed with an empty stored block like a zlib sync flush, which ends
+ * it on a byte boundary, so stripes compressed by different threads concatenate
+ */
+static const int lengthbase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const int lengthextra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+
+static void put_bits(BitWriter *bw, uint32_t v, int n){
+	bw->bits |= (uint64_t)v << bw->nbits;
+	bw->nbits += n;
+	while (bw->nbits >= 8){
+		bw->out[bw->len++] = (unsigned char)bw->bits;
+		bw->bits >>= 8;
+		bw->nbits -= 8;
+	}
+}
+
+static void put_code(BitWriter *bw, uint32_t code, int n){
+	// Huffman codes go most significant bit first
+	uint32_t rev = 0;
+	for (int i = 0; i < n; i++)
+		rev |= (code >> i & 1) << (n - 1 - i);
+	put_bits(bw, rev, n);
+}
+
+static void put_symbol(BitWriter *bw, int sym){
+	// A literal/length symbol in the fixed code
+	if (sym < 144)
+		put_code(bw, 0x30 + sym, 8);
+	else if (sym < 256)
+		put_code(bw, 0x190 + sym - 144, 9);
+	else if (sym < 280)
+		put_code(bw, sym - 256, 7);
+	else
+		put_code(bw, 0xc0 + sym - 280, 8);
+}
+
+static size_t deflate_stripe(const unsigned char *in, size_t n, unsigned char *out){
+	// Returns the compressed length, at most deflate_bound(n)
+	BitWriter bw = {.out = out};
+	put_bits(&bw, 2, 3); // not final, fixed Huffman
+	for (size_t i = 0; i < n;){
+		size_t run = 0;
+		while (i > 0 && i + run < n && run < 258 && in[i + run] == in[i - 1])
+			run++;
+		if (run < 3){
+			put_symbol(&bw, in[i++]);
+			continue;
+		}
+		int c = 28;
+		while (lengthbase[c] > (int)run)
+			c--;
+		put_symbol(&bw, 257 + c);
+		put_bits(&bw, run - lengthbase[c], lengthextra[c]);
+		put_code(&bw, 0, 5); // distance 1
+		i += run;
+	}
+	put_symbol(&bw, 256); // end of block
+	put_bits(&bw, 0, 3); // empty stored block, not final
+	if (bw.nbits)
+		put_bits(&bw, 0, 8 - bw.nbits);
+	memcpy(bw.out + bw.len, "\x00\x00\xff\xff", 4);
+	return bw.len + 4;
+}
+
+static size_t deflate_bound(size_t n){
+	return n + n / 8 + 16; // 9 bits for the worst literal
+}
+
+static uint32_t adler32(uint32_t adler, const unsigned char *p, size_t n){
+	uint32_t a = adler & 0xffff, b = adler >> 16;
+	while (n > 0){
+		size_t chunk = n < 5552 ? n : 5552; // the most bytes before b can overflow
+		n -= chunk;
+		while (chunk--){
+			a += *p++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return b << 16 | a;
+}
+
+static void crc_init(void){
+	for (uint32_t i = 0; i < 256; i++){
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++)
+			c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		crctab[i] = c;
+	}
+}
+
+static uint32_t crc32(uint32_t crc, const unsigned char *p, size_t n){
+	crc = ~crc;
+	while (n--)
+		crc = crctab[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+
+/*** PNG ***/
+static void put32be(unsigned char *p, uint32_t v){
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static int png_chunk(FILE *fp, const char *type, const unsigned char *data, size_t len){
+	unsigned char head[8], tail[4];
+	put32be(head, (uint32_t)len);
+	memcpy(head + 4, type, 4);
+	put32be(tail, crc32(crc32(0, head + 4, 4), data, len));
+	if (fwrite(head, 1, 8, fp) != 8 || (len && fwrite(data, 1, len, fp) != len) || fwrite(tail, 1, 4, fp) != 4)
+		return -1;
+	return 0;
+}
+
+
+/*** Rendering ***/
+static void render(Node *p, int scale, int64_t px, int64_t py, int64_t w, int64_t y0, int64_t y1, unsigned *counts){
+	// Store the population of every level `scale` node of p into the pixel it covers,
+	// for the pixel rows [y0, y1). p's corner is at pixel (px, py)
+	if (p->n == 0)
+		return;
+	int64_t size = (int64_t)1 << (p->k - scale);
+	if (px >= w || py >= y1 || px + size <= 0 || py + size <= y0)
+		return;
+	if (p->k == scale){
+		counts[(py - y0) * w + px] = p->n;
+		return;
+	}
+	if (p->packed){
+		// a pixel per 2^scale square of its rows
+		int side = 1 << scale;
+		uint64_t cols = ((uint64_t)1 << side) - 1;
+		for (int64_t y = max(py, y0); y < min(py + size, y1); y++)
+			for (int64_t x = max(px, 0); x < min(px + size, w); x++){
+				unsigned n = 0;
+				for (int r = 0; r < side; r++)
+					n += __builtin_popcountll(leaf_bits(p)[(y - py) * side + r] >> ((x - px) * side) & cols);
+				counts[(y - y0) * w + x] = n;
+			}
+		return;
+	}
+	int64_t half = size >> 1;
+	render(p->a, scale, px, py, w, y0, y1, counts);
+	render(p->b, scale, px + half, py, w, y0, y1, counts);
+	render(p->c, scale, px, py + half, w, y0, y1, counts);
+	render(p->d, scale, px + half, py + half, w, y0, y1, counts);
+}
+
+static unsigned char gray(unsigned n, int scale){
+	if (n == 0)
+		return 255;
+	if (scale == 0)
+		return 0;
+	double full = log2((double)n) / (2 * scale); // 1 when every cell lives
+	return (unsigned char)(255 - EXPORT_FLOOR - (255 - EXPORT_FLOOR) * full + 0.5);
+}
+
+static void encode(Export *ex, Slot *slot, int64_t y0, int64_t y1, const unsigned *counts){
+	// The rows of one stripe in the file's format
+	unsigned char *out = ex->format == EXPORT_PNG ? slot->raw : slot->data;
+	size_t len = 0;
+	for (int64_t y = y0; y < y1; y++){
+		const unsigned *row = counts + (y - y0) * ex->w;
+		unsigned char *o = out + len;
+		if (ex->format == EXPORT_PBM){
+			memset(o, 0, ex->rowbytes);
+			for (int64_t x = 0; x < ex->w; x++)
+				if (row[x])
+					o[x / 8] |= 0x80 >> (x % 8);
+		} else {
+			if (ex->format == EXPORT_PNG)
+				*o++ = 0; // no filter
+			for (int64_t x = 0; x < ex->w; x++)
+				o[x] = gray(row[x], ex->scale);
+		}
+		len += ex->rowbytes;
+	}
+	if (ex->format == EXPORT_PNG){
+		slot->rawlen = len;
+		len = deflate_stripe(slot->raw, len, slot->data);
+	}
+	slot->len = len;
+}
+
+static void *render_thread(void *arg){
+	// Take stripes in order until none are left, each waits for a free slot
+	Export *ex = arg;
+	unsigned *counts = malloc(EXPORT_STRIPE_ROWS * ex->w * sizeof(unsigned));
+	pthread_mutex_lock(&ex->lock);
+	if (counts == NULL){
+		ex->failed = 1;
+		pthread_cond_broadcast(&ex->cond);
+	}
+	for (;;){
+		while (!ex->failed && ex->next < ex->stripes && ex->next - ex->written >= ex->nslots)
+			pthread_cond_wait(&ex->cond, &ex->lock);
+		if (ex->failed || ex->next >= ex->stripes)
+			break;
+		int64_t i = ex->next++;
+		pthread_mutex_unlock(&ex->lock);
+
+		Slot *slot = &ex->slots[i % ex->nslots];
+		int64_t y0 = i * EXPORT_STRIPE_ROWS, y1 = min(y0 + EXPORT_STRIPE_ROWS, ex->h);
+		memset(counts, 0, (y1 - y0) * ex->w * sizeof(unsigned));
+		render(ex->root, ex->scale, ex->px, ex->py, ex->w, y0, y1, counts);
+		encode(ex, slot, y0, y1, counts);
+
+		pthread_mutex_lock(&ex->lock);
+		slot->stripe = i;
+		pthread_cond_broadcast(&ex->cond);
+	}
+	pthread_mutex_unlock(&ex->lock);
+	free(counts);
+	return NULL;
+}
+
+
+/*** Export ***/
+int export_size(const ExportOptions *opt, int64_t *w, int64_t *h){
+	// Image size in pixels, -1 if the options are out of range
+	if (opt->scale < 0 || opt->scale >= MAX_LEVEL || opt->w <= 0 || opt->h <= 0 ||
+			opt->format < EXPORT_PBM || opt->format > EXPORT_PNG)
+		return -1;
+	int64_t x1, y1;
+	if (__builtin_add_overflow(opt->x, opt->w - 1, &x1) || __builtin_add_overflow(opt->y, opt->h - 1, &y1))
+		return -1;
+	*w = (x1 >> opt->scale) - (opt->x >> opt->scale) + 1;
+	*h = (y1 >> opt->scale) - (opt->y >> opt->scale) + 1;
+	return *w > EXPORT_MAX_SIDE || *h > EXPORT_MAX_SIDE ? -1 : 0;
+}
+
+int export_image(Node *root, const ExportOptions *opt, const char *path){
+	// Write the region to path. Pixels start on a multiple of 2^scale cells, so the
+	// image can take in up to 2^scale - 1 cells more than asked on each side.
+	// Returns -1 on bad options or when the file can't be written
+	Export ex = {.scale = opt->scale, .format = opt->format};
+	if (export_size(opt, &ex.w, &ex.h) != 0)
+		return -1;
+	FILE *fp = fopen(path, "wb");
+	if (fp == NULL)
+		return -1;
+	pthread_once(&crconce, crc_init);
+
+	engine_enter();
+	while (root->k <= opt->scale) // so the root's corner is on the pixel grid
+		root = centre(root);
+	ex.root = root;
+	ex.px = -((int64_t)1 << (root->k - 1 - opt->scale)) - (opt->x >> opt->scale);
+	ex.py = -((int64_t)1 << (root->k - 1 - opt->scale)) - (opt->y >> opt->scale);
+	ex.stripes = (ex.h + EXPORT_STRIPE_ROWS - 1) / EXPORT_STRIPE_ROWS;
+	ex.rowbytes = opt->format == EXPORT_PBM ? (size_t)(ex.w + 7) / 8 :
+		(size_t)ex.w + (opt->format == EXPORT_PNG);
+
+	int threads = opt->threads > 0 ? opt->threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+	threads = max(1, min(threads, EXPORT_MAX_THREADS));
+	ex.nslots = 2 * threads;
+	ex.slots = calloc(ex.nslots, sizeof(Slot));
+	size_t stripebytes = ex.rowbytes * EXPORT_STRIPE_ROWS;
+	for (int i = 0; ex.slots && i < ex.nslots; i++){
+		ex.slots[i].stripe = -1;
+		ex.slots[i].data = malloc(opt->format == EXPORT_PNG ? deflate_bound(stripebytes) : stripebytes);
+		ex.slots[i].raw = opt->format == EXPORT_PNG ? malloc(stripebytes) : NULL;
+		if (ex.slots[i].data == NULL || (opt->format == EXPORT_PNG && ex.slots[i].raw == NULL))
+			ex.failed = 1;
+	}
+	if (ex.slots == NULL)
+		ex.failed = 1;
+
+	// Header
+	if (opt->format == EXPORT_PNG){
+		unsigned char ihdr[13] = {0, 0, 0, 0, 0, 0, 0, 0, 8, 0, 0, 0, 0}; // 8-bit gray
+		put32be(ihdr, (uint32_t)ex.w);
+		put32be(ihdr + 4, (uint32_t)ex.h);
+		if (fwrite("\x89PNG\r\n\x1a\n", 1, 8, fp) != 8 || png_chunk(fp, "IHDR", ihdr, 13) != 0 ||
+				png_chunk(fp, "IDAT", (const unsigned char *)"\x78\x01", 2) != 0) // zlib header
+			ex.failed = 1;
+	} else if (fprintf(fp, opt->format == EXPORT_PBM ? "P4\n%lld %lld\n" : "P5\n%lld %lld\n255\n",
+				(long long)ex.w, (long long)ex.h) < 0)
+		ex.failed = 1;
+
+	pthread_mutex_init(&ex.lock, NULL);
+	pthread_cond_init(&ex.cond, NULL);
+	pthread_t tids[EXPORT_MAX_THREADS];
+	int started = 0;
+	while (!ex.failed && started < threads && pthread_create(&tids[started], NULL, render_thread, &ex) == 0)
+		started++;
+	if (started == 0)
+		ex.failed = 1;
+
+	// Write the stripes in order as they come in
+	uint32_t adler = 1;
+	pthread_mutex_lock(&ex.lock);
+	for (int64_t i = 0; i < ex.stripes && !ex.failed; i++){
+		Slot *slot = &ex.slots[i % ex.nslots];
+		while (slot->stripe != i && !ex.failed)
+			pthread_cond_wait(&ex.cond, &ex.lock);
+		if (ex.failed)
+			break;
+		pthread_mutex_unlock(&ex.lock);
+		int err;
+		if (opt->format == EXPORT_PNG){
+			adler = adler32(adler, slot->raw, slot->rawlen);
+			err = png_chunk(fp, "IDAT", slot->data, slot->len);
+		} else
+			err = fwrite(slot->data, 1, slot->len, fp) != slot->len;
+		pthread_mutex_lock(&ex.lock);
+		slot->stripe = -1;
+		ex.written = i + 1;
+		ex.failed |= err != 0;
+		pthread_cond_broadcast(&ex.cond);
+	}
+	pthread_mutex_unlock(&ex.lock);
+	for (int i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+	engine_leave();
+
+	if (opt->format == EXPORT_PNG && !ex.failed){
+		unsigned char end[6] = {0x03, 0x00}; // empty final fixed block
+		put32be(end + 2, adler);
+		if (png_chunk(fp, "IDAT", end, 6) != 0 || png_chunk(fp, "IEND", NULL, 0) != 0)
+			ex.failed = 1;
+	}
+	ex.failed |= fclose(fp) != 0;
+	for (int i = 0; ex.slots && i < ex.nslots; i++){
+		free(ex.slots[i].data);
+		free(ex.slots[i].raw);
+	}
+	free(ex.slots);
+	pthread_mutex_destroy(&ex.lock);
+	pthread_cond_destroy(&ex.cond);
+	return ex.failed ? -1 : 0;
+}
@@ -0,0 +1,37 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+#include "hashlife.h"
+
+/*
+ * Image export of a region at 2^scale cells per pixel side. Each pixel shows the
+ * population of the level `scale` node under it, so a pixel costs the same
+ * whatever the zoom and empty space costs nothing. The image is rendered in
+ * stripes of EXPORT_STRIPE_ROWS rows by several threads and written in order as
+ * they finish, memory stays bounded whatever the image size.
+ * PBM is black where anything lives. PGM and PNG are 8-bit gray, darker on a
+ * log scale of the population so lone cells stay visible on an overview.
+ */
+
+/*** Defines ***/
+#define EXPORT_PBM 0
+#define EXPORT_PGM 1
+#define EXPORT_PNG 2
+
+#define EXPORT_STRIPE_ROWS 32
+#define EXPORT_MAX_THREADS 16
+#define EXPORT_MAX_SIDE (1 << 20) // pixels on either side
+#define EXPORT_FLOOR 64 // how dark a pixel with a single live cell gets, out of 255
+
+/*** Structs ***/
+typedef struct {
+	int64_t x, y, w, h; // region in cells, relative to the centre like every root
+	int scale; // log2 of cells per pixel side, below MAX_LEVEL
+	int format; // EXPORT_*
+	int threads; // 0 for one per core
+} ExportOptions;
+
+/*** Export ***/
+int export_size(const ExportOptions *opt, int64_t *w, int64_t *h);
+int export_image(Node *root, const ExportOptions *opt, const char *path);
+
+#endif
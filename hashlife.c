@@ -1,77 +1,662 @@
 #include "hashlife.h"
+#include "arena.h"
+#include "tile.h"
+#include "profile.h"
 #include <time.h>
+#include <unistd.h>
 
-Node on  = {1, 0, NULL, NULL, NULL, NULL};
-Node off = {0, 0, NULL, NULL, NULL, NULL};
+Node on  = {.n = 1, .k = 0, .hash = {.lo = 0x2545f4914f6cdd1dULL, .hi = 0x9e3779b97f4a7c15ULL}};
+Node off = {.n = 0, .k = 0, .hash = {.lo = 0, .hi = 0}};
 Node **hashtab;
+int hashsize = 0; // number of buckets, a prime
+int nodecount = 0; // nodes currently in hashtab
+MemoEntry **memotab;
+int memosize = 0;
+int memocount = 0;
+
+static struct {
+	GCRootFn fn;
+	void *udata;
+} gcroots[MAX_GC_ROOTS];
+static int gclimit = GC_MIN_NODES; // collect once nodecount goes past this
+static size_t gcbudget; // bytes of nodes, memo and tables to stay under, see gc_set_budget()
+static size_t gcnext = SIZE_MAX; // collect once gc_usage() reaches this, gcbudget or more
+static int64_t gcmarked; // nodes gc_mark() marked in this collection
+static int64_t gcpacked; // of those, packed ones
+static int packedcount; // packed nodes in hashtab, each with PACK_SIZE rows malloc'd
+static Hash128 hash4x4[1 << 16]; // content hash of every level 2 node, by its rows as 4 bit nibbles
+static unsigned memoepoch; // advance() calls so far, entries keep the low 16 bits
+static unsigned memoaged; // memoepoch at the last memo_age()
+static Universe *universes; // every live universe is a GC root
+static __thread uint64_t memoprobes, memohits; // this thread's, for ENGINE_AUTO
+#ifdef HASH_TRACE
+JoinTraceFn join_trace = NULL; // sees every join() key, for test_hash.c
+#endif
+
+/*
+ * Locking. Node and memo buckets are guarded by striped mutexes picked from the
+ * bucket, so joins on different buckets rarely wait on each other. resize() takes every
+ * stripe of its table. The world lock is held shared by engine sections and
+ * exclusively by gc(), which is the only thing that frees nodes
+ */
+static pthread_mutex_t nodelocks[LOCK_STRIPES];
+static pthread_mutex_t memolocks[LOCK_STRIPES];
+static pthread_mutex_t shiftlocks[LOCK_STRIPES];
+static pthread_mutex_t unilock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t worldlock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Recent shift() results. Shifting repetitive content asks for the same windows over and over
+static struct {
+	Node *a, *b, *c, *d;
+	int64_t x, y;
+	Node *result;
+} shiftcache[SHIFT_CACHE_SIZE];
+
+
+static void init_hash4x4();
+static Node *join_dense(Node *a, Node *b, Node *c, Node *d, uintptr_t h);
 
 
 /*** Node operations ***/
-Node *join(const Node *a, const Node *b, const Node *c, const Node *d){
-	assert((a->k ^ b->k ^ c->k ^ d->k) == 0); // make sure all nodes are the same level
+static pthread_mutex_t *lock_bucket(pthread_mutex_t *locks, int *size, uintptr_t h, int *bucket){
+	// Lock the stripe of the bucket of h and return it. The stripe follows the bucket,
+	// so when a resize got in between picking it and locking it, pick again
+	for (;;){
+		int s = __atomic_load_n(size, __ATOMIC_ACQUIRE);
+		pthread_mutex_t *lock = &locks[(h % s) % LOCK_STRIPES];
+		pthread_mutex_lock(lock);
+		if (*size == s){
+			*bucket = (int)(h % s);
+			return lock;
+		}
+		pthread_mutex_unlock(lock);
+	}
+}
+
+static void lock_all(pthread_mutex_t *locks){
+	for (int i = 0; i < LOCK_STRIPES; i++)
+		pthread_mutex_lock(&locks[i]);
+}
+
+static void unlock_all(pthread_mutex_t *locks){
+	for (int i = LOCK_STRIPES - 1; i >= 0; i--)
+		pthread_mutex_unlock(&locks[i]);
+}
+
+static Node *lookup(Node *a, Node *b, Node *c, Node *d, int bucket){
+	// Caller holds the bucket's stripe
 	Node *p;
-	p = find_node(a, b, c, d);
+	for (p = hashtab[bucket]; p; p = p->next) /* make sure to compare a first */
+		if (p->a == a && p->b == b && p->c == c && p->d == d) // In case hash collision compare its value
+			return p;
+	return NULL;
+}
+
+static Node *insert(Node *a, Node *b, Node *c, Node *d, int bucket){
+	// Caller holds the bucket's stripe
+	assert(a->k < MAX_LEVEL);
+	Node *node = arena_alloc();
+	if (node == NULL){
+		fprintf(stderr, "Out of memory for nodes\n");
+		exit(1);
+	}
+
+	// init value of node
+	node->k = a->k+1;
+	node->n = a->n + b->n + c->n + d->n;
+	node->a = a;
+	node->b = b;
+	node->c = c;
+	node->d = d;
+	node->mark = 0;
+	node->packed = 0;
+	node->hash = content_hash(a, b, c, d);
+
+	node->next = hashtab[bucket]; // chain in front on collision
+	hashtab[bucket] = node;
+	__atomic_fetch_add(&nodecount, 1, __ATOMIC_RELAXED);
+	//log_info("Create new node: Node k=%d, %d x %d, population %d at hash:%d", node->k, 1 << node->k, 1 << node->k, node->n, bucket); 
+	return node;
+}
+
+static Node *join_plain(Node *a, Node *b, Node *c, Node *d, uintptr_t h){
+	// The unique unpacked node with these children. Look up and insert under one lock,
+	// so two threads joining the same children get the same node
+	int bucket;
+	pthread_mutex_t *lock = lock_bucket(nodelocks, &hashsize, h, &bucket);
+	Node *p = lookup(a, b, c, d, bucket);
+	PROFILE_JOIN(a->k + 1, p != NULL);
 	if (!p)
-		p = newnode(a, b, c, d);
+		p = insert(a, b, c, d, bucket);
+	pthread_mutex_unlock(lock);
+
+	if (__atomic_load_n(&nodecount, __ATOMIC_RELAXED) >= __atomic_load_n(&hashsize, __ATOMIC_RELAXED))
+		resize();
 	return p;
 }
 
+static Node *join_hashed(Node *a, Node *b, Node *c, Node *d, uintptr_t h){
+	// The unique node with these children. A PACK_LEVEL node that may be dense is
+	// looked up by its children first, and only read into rows if that misses
+	assert((a->k ^ b->k ^ c->k ^ d->k) == 0); // make sure all nodes are the same level
+#ifdef HASH_TRACE
+	if (join_trace)
+		join_trace(a, b, c, d);
+#endif
+	if (a->k + 1 != PACK_LEVEL || a->n + b->n + c->n + d->n < PACK_MIN_BLOCKS)
+		return join_plain(a, b, c, d, h);
+	int bucket;
+	pthread_mutex_t *lock = lock_bucket(nodelocks, &hashsize, h, &bucket);
+	Node *p = lookup(a, b, c, d, bucket);
+	pthread_mutex_unlock(lock);
+	return p ? p : join_dense(a, b, c, d, h);
+}
+
+Node *join(const Node *a, const Node *b, const Node *c, const Node *d){
+	Node *na = (Node *)a, *nb = (Node *)b, *nc = (Node *)c, *nd = (Node *)d;
+	return join_hashed(na, nb, nc, nd, node_hash(na, nb, nc, nd));
+}
+
+static void prefetch_bucket(void *tab, int *size, uintptr_t h){
+	// Start loading the bucket of h. Unlocked, so a resize may make this the wrong
+	// address, which only costs the prefetch: prefetches never fault
+	int s = __atomic_load_n(size, __ATOMIC_RELAXED);
+	__builtin_prefetch((void **)tab + h % s);
+}
+
+static void join_batch(Node *key[][4], Node **out, int n){
+	// out[i] = join() of key[i]. Every bucket is prefetched before the first one is
+	// searched, so their cache misses overlap instead of following one another
+	uintptr_t h[BATCH_MAX];
+	assert(n <= BATCH_MAX);
+	Node **tab = __atomic_load_n(&hashtab, __ATOMIC_RELAXED);
+	for (int i = 0; i < n; i++){
+		h[i] = node_hash(key[i][0], key[i][1], key[i][2], key[i][3]);
+		prefetch_bucket(tab, &hashsize, h[i]);
+	}
+	for (int i = 0; i < n; i++)
+		out[i] = join_hashed(key[i][0], key[i][1], key[i][2], key[i][3], h[i]);
+}
 
 void init_hashtab(){ 
-	hashtab = (Node **)calloc(MAX_NODES, sizeof(Node *)); 
+	if (gc_budget() == 0)
+		gc_set_budget(0);
+	__atomic_store_n(&gcnext, gc_budget(), __ATOMIC_RELAXED);
+	hashsize = next_prime(HASH_INIT_SIZE);
+	init_hash4x4();
+	arena_init();
+	hashtab = arena_table(hashsize * sizeof(Node *));
+	memosize = next_prime(MEMO_INIT_SIZE);
+	memotab = (MemoEntry **)calloc(memosize, sizeof(MemoEntry *));
+	if (hashtab == NULL || memotab == NULL){
+		fprintf(stderr, "Unable to allocate the hash table\n");
+		exit(1);
+	}
+	for (int i = 0; i < LOCK_STRIPES; i++){
+		pthread_mutex_init(&nodelocks[i], NULL);
+		pthread_mutex_init(&memolocks[i], NULL);
+		pthread_mutex_init(&shiftlocks[i], NULL);
+	}
+}
+
+void resize(){
+	// Double the buckets once chains average more than one node.
+	// Nodes stay where they are, only the chains are rebuilt, so this is safe mid-successor()
+	lock_all(nodelocks);
+	if (__atomic_load_n(&nodecount, __ATOMIC_RELAXED) < hashsize || hashsize > INT_MAX / 2){ // another thread got here first
+		unlock_all(nodelocks);
+		return;
+	}
+	int newsize = next_prime(hashsize * 2);
+	Node **newtab = arena_table(newsize * sizeof(Node *));
+	if (newtab == NULL){
+		unlock_all(nodelocks);
+		return; // keep going with longer chains
+	}
+
+	for (int i = 0; i < hashsize; i++){
+		Node *p = hashtab[i];
+		while (p){
+			Node *next = p->next;
+			uintptr_t h = (p->packed ? p->hash.lo : node_hash(p->a, p->b, p->c, p->d)) % newsize;
+			p->next = newtab[h];
+			newtab[h] = p;
+			p = next;
+		}
+	}
+	arena_table_free(hashtab, hashsize * sizeof(Node *)); // join_batch() only prefetches from it unlocked
+	__atomic_store_n(&hashtab, newtab, __ATOMIC_RELAXED);
+	__atomic_store_n(&hashsize, newsize, __ATOMIC_RELEASE);
+	unlock_all(nodelocks);
+	log_info("Resized hash table to %d buckets for %d nodes", newsize, __atomic_load_n(&nodecount, __ATOMIC_RELAXED));
 }
 
 uintptr_t node_hash(Node *a, Node *b, Node *c, Node *d) {
-	// Refer to test_hash.c for different hash methods
+	// Refer to test_hash.c for different hash methods. Callers reduce it modulo hashsize
 	uintptr_t h = 65537*(uintptr_t)(d)+257*(uintptr_t)(c)+17*(uintptr_t)(b)+5*(uintptr_t)(a);
-	return h % MAX_NODES;
+	return h;
+}
+
+static uint64_t mix64(uint64_t x){
+	// murmur3's finalizer, every input bit reaches every output bit
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
 }
 
-// Create a node from 4 child node
+static Hash128 hash_combine(int k, const Hash128 child[4]){
+	// content_hash() of level k children with these hashes
+	uint64_t lo = 0x243f6a8885a308d3ULL + k, hi = 0x13198a2e03707344ULL + k;
+	for (int i = 0; i < 4; i++){
+		lo = mix64(lo ^ child[i].lo) + child[i].hi;
+		hi = mix64(hi + child[i].hi) ^ child[i].lo;
+	}
+	return (Hash128){.lo = mix64(lo + hi), .hi = mix64(hi ^ lo)};
+}
+
+Hash128 content_hash(const Node *a, const Node *b, const Node *c, const Node *d){
+	// Hash of the cells of the node with these children, made from their content
+	// hashes only. Unlike node_hash() it is the same in every process and every run
+	Hash128 child[4] = {a->hash, b->hash, c->hash, d->hash};
+	return hash_combine(a->k, child);
+}
+
+static void init_hash4x4(){
+	// Every 4x4 square, row r in bits 4r to 4r + 3, with the hash its node would have
+	Hash128 level1[16];
+	for (int i = 0; i < 16; i++){
+		Hash128 cells[4];
+		for (int c = 0; c < 4; c++)
+			cells[c] = (i >> c & 1 ? ON : OFF)->hash;
+		level1[i] = hash_combine(0, cells);
+	}
+	for (int i = 0; i < 1 << 16; i++){
+		int r0 = i & 15, r1 = i >> 4 & 15, r2 = i >> 8 & 15, r3 = i >> 12;
+		Hash128 quads[4] = {
+			level1[(r0 & 3) | (r1 & 3) << 2], level1[(r0 >> 2) | (r1 >> 2) << 2],
+			level1[(r2 & 3) | (r3 & 3) << 2], level1[(r2 >> 2) | (r3 >> 2) << 2],
+		};
+		hash4x4[i] = hash_combine(1, quads);
+	}
+}
+
+static Hash128 rows_hash(const uint64_t *rows, int x, int y, int k){
+	// content_hash() of the level k node of the cells at (x, y) of rows, without making it
+	if (k == 2)
+		return hash4x4[(rows[y] >> x & 15) | (rows[y + 1] >> x & 15) << 4
+			| (rows[y + 2] >> x & 15) << 8 | (rows[y + 3] >> x & 15) << 12];
+	int half = 1 << (k - 1);
+	Hash128 quads[4] = {
+		rows_hash(rows, x, y, k - 1), rows_hash(rows, x + half, y, k - 1),
+		rows_hash(rows, x, y + half, k - 1), rows_hash(rows, x + half, y + half, k - 1),
+	};
+	return hash_combine(k - 1, quads);
+}
+
+int hash_equal(Hash128 x, Hash128 y){
+	return x.lo == y.lo && x.hi == y.hi;
+}
+
+void hash_format(Hash128 h, char *buf, size_t len){
+	snprintf(buf, len, "%016llx%016llx", (unsigned long long)h.hi, (unsigned long long)h.lo);
+}
+
+// Create a node from 4 child node, even if one with the same children exists. Use join()
 Node *newnode(Node *a, Node *b, Node *c, Node *d){
 	assert((a->k ^ b->k ^ c->k ^ d->k) == 0); // make sure all nodes are the same level
-	assert(a->k < 30); // At development stage we want to make sure everything is in our control
-	Node *node = malloc(sizeof(Node));
+	int bucket;
+	pthread_mutex_t *lock = lock_bucket(nodelocks, &hashsize, node_hash(a, b, c, d), &bucket);
+	Node *node = insert(a, b, c, d, bucket);
+	pthread_mutex_unlock(lock);
+	return node;
+}
+
+Node *find_node(Node *a, Node *b, Node *c, Node *d){
+	int bucket;
+	pthread_mutex_t *lock = lock_bucket(nodelocks, &hashsize, node_hash(a, b, c, d), &bucket);
+	Node *p = lookup(a, b, c, d, bucket);
+	pthread_mutex_unlock(lock);
+	return p;
+}
 
-	// init value of node
-	int n = a->n + b->n + c->n + d->n; 
-	node->k = a->k+1;
-	node->n = n;
-	node->a = a;
-	node->b = b;
-	node->c = c;
-	node->d = d;
-	node->next = NULL;
 
-	uintptr_t h = node_hash(a, b, c, d);
-	if (hashtab[h] != NULL){ // hash collided
-		node->next = hashtab[h];
+/*** Memo ***/
+static uintptr_t memo_hash(Node *p, int j, unsigned rule){
+	return (uintptr_t)p * 31 + (uintptr_t)j * 1009 + (uintptr_t)rule * 65537;
+}
+
+static Node *memo_find(Node *p, int j, unsigned rule, uintptr_t h){
+	int bucket;
+	pthread_mutex_t *lock = lock_bucket(memolocks, &memosize, h, &bucket);
+	Node *result = NULL;
+	for (MemoEntry *e = memotab[bucket]; e; e = e->next)
+		if (e->p == p && e->j == j && e->rule == rule){
+			result = e->result;
+			e->epoch = __atomic_load_n(&memoepoch, __ATOMIC_RELAXED);
+			break;
+		}
+	pthread_mutex_unlock(lock);
+	memoprobes++;
+	memohits += result != NULL;
+	return result;
+}
+
+void memo_counters(uint64_t *probes, uint64_t *hits){
+	// Memo lookups this thread made so far and how many found a result
+	*probes = memoprobes;
+	*hits = memohits;
+}
+
+Node *memo_get(Node *p, int j, unsigned rule){
+	// successor(p, j) under rule if it was computed before, NULL otherwise
+	return memo_find(p, j, rule, memo_hash(p, j, rule));
+}
+
+static void memo_get_batch(Node **p, int n, int j, unsigned rule, Node **out){
+	// out[i] = memo_get(p[i], j, rule), with every bucket prefetched up front like
+	// join_batch(). NULL entries of p are skipped
+	uintptr_t h[BATCH_MAX];
+	assert(n <= BATCH_MAX);
+	MemoEntry **tab = __atomic_load_n(&memotab, __ATOMIC_RELAXED);
+	for (int i = 0; i < n; i++)
+		if (p[i]){
+			h[i] = memo_hash(p[i], j, rule);
+			prefetch_bucket(tab, &memosize, h[i]);
+		}
+	for (int i = 0; i < n; i++)
+		out[i] = p[i] ? memo_find(p[i], j, rule, h[i]) : NULL;
+}
+
+static void memo_resize(){
+	lock_all(memolocks);
+	if (__atomic_load_n(&memocount, __ATOMIC_RELAXED) < memosize || memosize > INT_MAX / 2){
+		unlock_all(memolocks);
+		return;
 	}
+	int newsize = next_prime(memosize * 2);
+	MemoEntry **newtab = (MemoEntry **)calloc(newsize, sizeof(MemoEntry *));
+	if (newtab == NULL){
+		unlock_all(memolocks);
+		return;
+	}
+	for (int i = 0; i < memosize; i++){
+		MemoEntry *e = memotab[i];
+		while (e){
+			MemoEntry *next = e->next;
+			uintptr_t h = memo_hash(e->p, e->j, e->rule) % newsize;
+			e->next = newtab[h];
+			newtab[h] = e;
+			e = next;
+		}
+	}
+	free(memotab);
+	__atomic_store_n(&memotab, newtab, __ATOMIC_RELAXED); // so does memo_get_batch()
+	__atomic_store_n(&memosize, newsize, __ATOMIC_RELEASE);
+	unlock_all(memolocks);
+	log_info("Resized memo to %d buckets for %d results", newsize, __atomic_load_n(&memocount, __ATOMIC_RELAXED));
+}
 
-  hashtab[h] = node; // push in to hashtable
-  //log_info("Create new node: Node k=%d, %d x %d, population %d at hash:%d", node->k, 1 << node->k, 1 << node->k, node->n, h); 
-  return node;
+void memo_put(Node *p, int j, unsigned rule, Node *result){
+	// Two threads may race to compute the same result, both get the same node so
+	// keeping either entry is fine
+	MemoEntry *e = malloc(sizeof(MemoEntry));
+	if (e == NULL)
+		return; // only costs recomputation
+	*e = (MemoEntry){.p = p, .result = result, .rule = rule, .j = j,
+		.epoch = __atomic_load_n(&memoepoch, __ATOMIC_RELAXED)};
+
+	int bucket;
+	pthread_mutex_t *lock = lock_bucket(memolocks, &memosize, memo_hash(p, j, rule), &bucket);
+	e->next = memotab[bucket];
+	memotab[bucket] = e;
+	pthread_mutex_unlock(lock);
+
+	if (__atomic_add_fetch(&memocount, 1, __ATOMIC_RELAXED) >= __atomic_load_n(&memosize, __ATOMIC_RELAXED))
+		memo_resize();
 }
 
-Node *find_node(Node *a, Node *b, Node *c, Node *d){
-  uintptr_t h = node_hash(a, b, c, d);
-  Node *p;
-  for (p=hashtab[h]; p; p = p->next)  /* make sure to compare a first */
-    if (p->a == a && p->b == b && p->c == c && p->d == d) {// In case hash collision compare its value
-      return p;
-    }
-  return p; // NULL
+static unsigned short memo_age_of(MemoEntry *e){
+	return (unsigned short)__atomic_load_n(&memoepoch, __ATOMIC_RELAXED) - e->epoch;
+}
+
+static void memo_age(){
+	// Saturate the age of stale entries at MEMO_RECENT_STEPS, so one left alone for 2^16
+	// advances doesn't wrap around to recent. Needs the world lock, see memo_age_due()
+	unsigned short stale = (unsigned short)(memoepoch - MEMO_RECENT_STEPS);
+	for (int i = 0; i < memosize; i++)
+		for (MemoEntry *e = memotab[i]; e; e = e->next)
+			if (memo_age_of(e) >= MEMO_RECENT_STEPS)
+				e->epoch = stale;
+	memoaged = memoepoch;
+}
+
+static int memo_age_due(){
+	return __atomic_load_n(&memoepoch, __ATOMIC_RELAXED) - __atomic_load_n(&memoaged, __ATOMIC_RELAXED) >= MEMO_AGE_EVERY;
+}
+
+static int memo_worth(MemoEntry *e){
+	// Retention order: the level, as recomputing a result costs about twice the one
+	// below, plus MEMO_RECENT_BONUS if it was used in the last MEMO_RECENT_STEPS advances
+	return e->p->k + (memo_age_of(e) < MEMO_RECENT_STEPS ? MEMO_RECENT_BONUS : 0);
+}
+
+static void memo_retain(size_t keep){
+	// Mark the nodes of the worthiest memo entries so memo_sweep() keeps them, as long as
+	// the marked nodes and the entries kept fit in keep bytes. The roots are marked
+	// already. Without memory for the ordering the sweep only keeps what they reach
+	enum {WORTH = MAX_LEVEL + MEMO_RECENT_BONUS + 1};
+	int64_t counts[WORTH] = {0}, start[WORTH] = {0}, total = 0;
+	for (int i = 0; i < memosize; i++)
+		for (MemoEntry *e = memotab[i]; e; e = e->next){
+			counts[memo_worth(e)]++;
+			total++;
+		}
+	MemoEntry **order = malloc(total * sizeof(MemoEntry *) + 1);
+	if (order == NULL)
+		return;
+	for (int w = WORTH - 2; w >= 0; w--) // counting sort, worthiest first
+		start[w] = start[w + 1] + counts[w + 1];
+	for (int i = 0; i < memosize; i++)
+		for (MemoEntry *e = memotab[i]; e; e = e->next)
+			order[start[memo_worth(e)]++] = e;
+
+	size_t tables = ((size_t)hashsize + memosize) * sizeof(void *);
+	int64_t kept = 0;
+	while (kept < total && tables + (size_t)gcmarked * sizeof(Node) + (size_t)gcpacked * PACKED_BYTES
+			+ (size_t)kept * (sizeof(MemoEntry) + GC_ALLOC_OVERHEAD) < keep){
+		gc_mark(order[kept]->p);
+		gc_mark(order[kept]->result);
+		kept++;
+	}
+	free(order);
+	log_info("GC kept %lld of %lld memo entries", (long long)kept, (long long)total);
+}
+
+static int memo_sweep(){
+	// Drop results whose node or result is about to be freed. Runs inside gc()
+	int freed = 0;
+	for (int i = 0; i < memosize; i++){
+		MemoEntry **link = &memotab[i];
+		while (*link){
+			MemoEntry *e = *link;
+			if (e->p->mark && e->result->mark){
+				link = &e->next;
+			} else {
+				*link = e->next;
+				free(e);
+				freed++;
+			}
+		}
+	}
+	__atomic_sub_fetch(&memocount, freed, __ATOMIC_RELAXED); // gc_maybe() peeks at it unlocked
+	return freed;
+}
+
+/*** Garbage collection ***/
+int gc_add_root(GCRootFn fn, void *udata){
+	// fn is called on every collection and must gc_mark() each node it holds
+	int ret = -1;
+	pthread_rwlock_wrlock(&worldlock);
+	for (int i = 0; i < MAX_GC_ROOTS; i++) {
+		if (!gcroots[i].fn) {
+			gcroots[i].fn = fn;
+			gcroots[i].udata = udata;
+			ret = 0;
+			break;
+		}
+	}
+	pthread_rwlock_unlock(&worldlock);
+	return ret;
+}
+
+void gc_remove_root(GCRootFn fn, void *udata){
+	pthread_rwlock_wrlock(&worldlock);
+	for (int i = 0; i < MAX_GC_ROOTS; i++)
+		if (gcroots[i].fn == fn && gcroots[i].udata == udata)
+			gcroots[i].fn = NULL;
+	pthread_rwlock_unlock(&worldlock);
+}
+
+void gc_mark(Node *p){
+	// Nodes are shared, so stop at anything already marked
+	while (p != NULL && p->k > 0 && !p->mark){
+		p->mark = 1;
+		gcmarked++;
+		if (p->packed){
+			gcpacked++;
+			return;
+		}
+		gc_mark(p->a);
+		gc_mark(p->b);
+		gc_mark(p->c);
+		p = p->d;
+	}
+}
+
+static int gc_locked(){
+	PROFILE_START(start);
+	gcmarked = gcpacked = 0;
+	for (int i = 0; i < MAX_GC_ROOTS; i++)
+		if (gcroots[i].fn)
+			gcroots[i].fn(gcroots[i].udata);
+	pthread_mutex_lock(&unilock);
+	for (Universe *u = universes; u; u = u->next)
+		gc_mark(u->root);
+	pthread_mutex_unlock(&unilock);
+	memo_age();
+	memo_retain(gcbudget / GC_KEEP);
+
+	memset(shiftcache, 0, sizeof(shiftcache)); // may point at nodes about to be freed
+	int dropped = memo_sweep();
+
+	int freed = 0, unpacked = 0;
+	Node *first = NULL, *last = NULL; // freed nodes, handed back to the arena at once
+	for (int i = 0; i < hashsize; i++){
+		Node **link = &hashtab[i];
+		while (*link){
+			Node *p = *link;
+			if (p->mark){
+				p->mark = 0;
+				link = &p->next;
+			} else {
+				*link = p->next;
+				if (p->packed){
+					free((void *)leaf_bits(p));
+					unpacked++;
+				}
+				p->next = first;
+				first = p;
+				if (last == NULL)
+					last = p;
+				freed++;
+			}
+		}
+	}
+	arena_release(first, last, freed);
+	__atomic_sub_fetch(&nodecount, freed, __ATOMIC_RELAXED); // gc_maybe() peeks at it unlocked
+	__atomic_sub_fetch(&packedcount, unpacked, __ATOMIC_RELAXED);
+	log_info("GC freed %d nodes, %d left, dropped %d memo entries", freed, nodecount, dropped);
+	PROFILE_SPAN("gc", -1, start);
+	return freed;
+}
+
+int gc(){
+	// Mark from the registered roots and the universes and free every other node.
+	// Waits until no thread is inside engine_enter()/engine_leave(): a Node * held
+	// in a local variable outside of such a section and not in a root would be freed.
+	// Returns the number of nodes freed
+	pthread_rwlock_wrlock(&worldlock);
+	int freed = gc_locked();
+	pthread_rwlock_unlock(&worldlock);
+	return freed;
+}
+
+void gc_set_budget(size_t bytes){
+	// Memory gc_maybe() keeps nodes, memo and tables under, 0 for a quarter of the physical memory.
+	// Collections keep the most valuable memo results in part of it, see memo_retain(),
+	// so a full budget costs recomputation rather than running out of memory
+	if (bytes == 0){
+		long pages = sysconf(_SC_PHYS_PAGES), size = sysconf(_SC_PAGE_SIZE);
+		bytes = pages > 0 && size > 0 ? (size_t)pages * size / 4 : (size_t)1 << 30;
+	}
+	__atomic_store_n(&gcbudget, bytes, __ATOMIC_RELAXED);
+}
+
+size_t gc_budget(){
+	return __atomic_load_n(&gcbudget, __ATOMIC_RELAXED);
+}
+
+size_t gc_usage(){
+	// Estimated bytes of nodes, packed rows, memo entries and both tables
+	return (size_t)__atomic_load_n(&nodecount, __ATOMIC_RELAXED) * sizeof(Node)
+		+ (size_t)__atomic_load_n(&packedcount, __ATOMIC_RELAXED) * PACKED_BYTES
+		+ (size_t)__atomic_load_n(&memocount, __ATOMIC_RELAXED) * (sizeof(MemoEntry) + GC_ALLOC_OVERHEAD)
+		+ ((size_t)__atomic_load_n(&hashsize, __ATOMIC_RELAXED) + __atomic_load_n(&memosize, __ATOMIC_RELAXED)) * sizeof(void *);
+}
+
+static int gc_due(){
+	// The node count doubled since the last collection, or the budget is reached
+	return __atomic_load_n(&nodecount, __ATOMIC_RELAXED) >= __atomic_load_n(&gclimit, __ATOMIC_RELAXED)
+		|| gc_usage() >= __atomic_load_n(&gcnext, __ATOMIC_RELAXED);
+}
+
+void gc_maybe(){
+	// Collect if gc_due(), or just age the memo if that is due. Must not be called from
+	// inside an engine section
+	if (!gc_due() && !memo_age_due())
+		return;
+	pthread_rwlock_wrlock(&worldlock);
+	if (gc_due()){ // nobody collected while we waited
+		gc_locked();
+		__atomic_store_n(&gclimit, max(GC_MIN_NODES, 2 * nodecount), __ATOMIC_RELAXED);
+		// Roots alone may not fit, then wait for some growth rather than collect every step
+		size_t usage = gc_usage();
+		if (usage >= gcbudget)
+			log_warn("Live nodes take %zu MB, over the %zu MB budget", usage >> 20, gcbudget >> 20);
+		__atomic_store_n(&gcnext, usage < gcbudget ? gcbudget : usage + usage / 2, __ATOMIC_RELAXED);
+	} else if (memo_age_due()){
+		memo_age();
+	}
+	pthread_rwlock_unlock(&worldlock);
+}
+
+void engine_enter(){
+	// Nodes held by this thread stay alive until engine_leave()
+	pthread_rwlock_rdlock(&worldlock);
+}
+
+void engine_leave(){
+	pthread_rwlock_unlock(&worldlock);
 }
 
 Node *get_zero(int k){
   int c = 0;
   Node *p = OFF;
   while (c!=k){
-    Node *np = find_node(p, p, p, p);
-    if(np==NULL)
-      p = newnode(p, p, p, p);
-    else
-      p = np;
+    p = join(p, p, p, p);
     c++;
   }
 	return p;
@@ -83,7 +668,7 @@ Node *construct(int points[][2], int n){
 	 for (int i=0; i < n; i++){
 		int x = points[i][0];
 		int y = points[i][1];
-		log_info("construct x:%d, y:%d", x, y);
+		log_trace("construct x:%d, y:%d", x, y);
 		pattern[i] = (MapNode){.p = ON, .x = x, .y = y}; 
 	}
 
@@ -119,7 +704,7 @@ Node *construct(int points[][2], int n){
 				}
 			}
 
-			Node *nodek = newnode(a, b, c, d);
+			Node *nodek = join(a, b, c, d);
 			next_level[m] = (MapNode){.x = x >> 1, .y = y >> 1, .p = nodek}; // store a list of all pattern in this level
 			m++;
 		}
@@ -135,40 +720,27 @@ Node *construct(int points[][2], int n){
 }
 
 
-void expand(Node *node, int x, int y){
-  // if node->k == 0 : (x, y) is the position on the grid
-  // else (x, y) is the position of the node's upper left tile
-	int offset = 1 << (node->k - 1);
-	if (node->n == 0)
-		return;
-
-	// clip only points in view
-	int size = 1 << node->k;
-	if (x + size <= 0 || x >= E.gridcols|| y + size <= 0 || y >= E.gridrows)
-		return;
-
-	// base case
-	if (node->k == 0){
-		E.grid[y][x] = 1;
-		return;
-	}
-
-	expand(node->a, x, y);
-	expand(node->b, x + offset, y);
-	expand(node->c, x, y + offset);
-	expand(node->d, x + offset, y + offset);
+void expand(Node *node, int x, int y, int **grid, int rows, int cols){
+  // Set the live cells of node into grid, with the node's upper left corner at (x, y).
+  // Only cells in view are visited, by a CellIter rather than recursion
+	CellIter it;
+	int64_t cx, cy;
+	cell_iter_init(&it, node, -(int64_t)x, -(int64_t)y, cols, rows);
+	while (cell_iter_next(&it, &cx, &cy))
+		grid[cy + y][cx + x] = 1;
 }
 
-void mark(Node *p, int x, int y){
+Node *mark(Node *p, int x, int y){
+  // p with the cell at (x, y) toggled
   // x, y is the position in the universe with the universe's origin at upper left corner
 
 	Node *n = p;
 	MapNode *nodetab = (MapNode *)calloc((p->k+1), sizeof (MapNode)); 
 
 	int size;
-	int x_1, y_1; // store x and y at level 1
+	int x_1 = 0, y_1 = 0; // store x and y at level 1
 	nodetab[n->k] = (MapNode){.p = p, .x = 0, .y = 0};  // store the root
-	for (int k = p->k; k >= 2; k--){
+	for (int k = p->k; k >= 2 && !n->packed; k--){
 		size = 1 << (n->k - 1);
 		if ( x < size ){
 			if ( y < size ){
@@ -197,19 +769,29 @@ void mark(Node *p, int x, int y){
 		}
 	}
 
-	n = nodetab[1].p;
-	size = 1 << (n->k - 1);
-	Node *node2x2 = join(
-			x_1 == 0 && y_1 == 0 ? (n->a->n ==0 ? ON : OFF) : n->a,
-			x_1 == 1 && y_1 == 0 ? (n->b->n ==0 ? ON : OFF) : n->b,
-			x_1 == 0 && y_1 == 1 ? (n->c->n ==0 ? ON : OFF) : n->c,
-			x_1 == 1 && y_1 == 1 ? (n->d->n ==0 ? ON : OFF) : n->d
-			);
+	int from = 1; // lowest level rebuilt
+	if (n->packed){
+		// toggle the cell in a copy of the rows
+		uint64_t rows[PACK_SIZE];
+		memcpy(rows, leaf_bits(n), sizeof(rows));
+		rows[y] ^= (uint64_t)1 << x;
+		nodetab[PACK_LEVEL].p = leaf_pack(rows);
+		from = PACK_LEVEL;
+	} else {
+		n = nodetab[1].p;
+		size = 1 << (n->k - 1);
+		Node *node2x2 = join(
+				x_1 == 0 && y_1 == 0 ? (n->a->n ==0 ? ON : OFF) : n->a,
+				x_1 == 1 && y_1 == 0 ? (n->b->n ==0 ? ON : OFF) : n->b,
+				x_1 == 0 && y_1 == 1 ? (n->c->n ==0 ? ON : OFF) : n->c,
+				x_1 == 1 && y_1 == 1 ? (n->d->n ==0 ? ON : OFF) : n->d
+				);
 
-	nodetab[1].p = node2x2;
+		nodetab[1].p = node2x2;
+	}
 
 	// Recreate the tree from bottom up. reuse the node that is not-modified
-	for (int k = 1; k < p->k; k++){
+	for (int k = from; k < p->k; k++){
 		MapNode *cur = &nodetab[k];
 		MapNode *next= &nodetab[k+1];
 		next->p = join(
@@ -220,11 +802,316 @@ void mark(Node *p, int x, int y){
 				);
 	}
 
-	E.root = nodetab[p->k].p;
+	Node *root = nodetab[p->k].p;
 	free(nodetab);
+	return root;
+}
+
+/*** Successor ***/
+typedef struct {
+	// What one successor() call hands down to every level
+	unsigned rule;
+	RulePlan plan;
+	Node *zero[PACK_LEVEL]; // empty nodes of the levels leaf results are made of, filled on demand
+	Node *level1[16]; // level 1 nodes by their cells, a in bit 0 to d in bit 3, filled on demand
+} StepContext;
+
+typedef struct {
+	// One level of successor_run(), what a recursive call would keep on the C stack
+	Node *p;
+	int j; // clamped to p->k - 2
+	Node **out; // where the result goes once known
+	int phase; // PHASE_NINE, then PHASE_FOUR when stepping the full 2^(k-2)
+	int n; // children in this phase
+	Node *in[BATCH_MAX]; // the children being stepped
+	Node *res[BATCH_MAX]; // their successors, NULL until known
+#ifdef PROFILE
+	uint64_t start;
+#endif
+} Frame;
+
+static void leaf_read(Node *p, uint64_t *rows, int x, int y){
+	// Set the cells of p into rows, with p's corner at (x, y)
+	if (p->n == 0)
+		return;
+	if (p->packed){
+		for (int i = 0; i < PACK_SIZE; i++)
+			rows[y + i] |= leaf_bits(p)[i] << x;
+		return;
+	}
+	if (p->k == 1){
+		rows[y] |= (uint64_t)(p->a->n | p->b->n << 1) << x;
+		rows[y + 1] |= (uint64_t)(p->c->n | p->d->n << 1) << x;
+		return;
+	}
+	int half = 1 << (p->k - 1);
+	leaf_read(p->a, rows, x, y);
+	leaf_read(p->b, rows, x + half, y);
+	leaf_read(p->c, rows, x, y + half);
+	leaf_read(p->d, rows, x + half, y + half);
+}
+
+static Node *leaf_node(StepContext *ctx, const uint64_t *rows, int x, int y, int k){
+	// The level k node of the cells of rows with its corner at (x, y)
+	uint64_t cols = (((uint64_t)1 << (1 << k)) - 1) << x, any = 0;
+	for (int i = y; i < y + (1 << k); i++)
+		any |= rows[i] & cols;
+	if (!any)
+		return ctx->zero[k] ? ctx->zero[k] : (ctx->zero[k] = get_zero(k));
+	if (k == 1){
+		int cells = (rows[y] >> x & 3) | (rows[y + 1] >> x & 3) << 2;
+		if (ctx->level1[cells] == NULL)
+			ctx->level1[cells] = join(cells & 1 ? ON : OFF, cells & 2 ? ON : OFF,
+					cells & 4 ? ON : OFF, cells & 8 ? ON : OFF);
+		return ctx->level1[cells];
+	}
+	int half = 1 << (k - 1);
+	return join(
+			leaf_node(ctx, rows, x, y, k - 1),
+			leaf_node(ctx, rows, x + half, y, k - 1),
+			leaf_node(ctx, rows, x, y + half, k - 1),
+			leaf_node(ctx, rows, x + half, y + half, k - 1));
+}
+
+
+/*** Packed leaves ***/
+/*
+ * A dense PACK_LEVEL node is stored as its rows instead of four children: one node
+ * and 512 bytes where the quadtree takes a node for each of its up to 85 distinct
+ * subtrees, which in a random soup are shared with nothing. Whether a node is packed
+ * only depends on its cells, so nodes stay unique and compare by pointer.
+ * Walks that need the children get them from node_quads()
+ */
+static int compare_rows(const void *x, const void *y){
+	uint64_t a = *(const uint64_t *)x, b = *(const uint64_t *)y;
+	return (a > b) - (a < b);
+}
+
+static int leaf_dense(const uint64_t *rows){
+	// Whether the PACK_LEVEL node of rows is packed: PACK_MIN_BLOCKS or more of its
+	// 8x8 blocks are alive and nearly all of them differ
+	uint64_t blocks[PACK_SIZE];
+	int n = 0;
+	for (int by = 0; by < PACK_SIZE; by += 8)
+		for (int bx = 0; bx < PACK_SIZE; bx += 8){
+			uint64_t b = 0;
+			for (int r = 0; r < 8; r++)
+				b |= (rows[by + r] >> bx & 0xff) << 8 * r;
+			if (b)
+				blocks[n++] = b;
+		}
+	if (n < PACK_MIN_BLOCKS)
+		return 0;
+	qsort(blocks, n, sizeof(uint64_t), compare_rows);
+	int distinct = 1;
+	for (int i = 1; i < n; i++)
+		distinct += blocks[i] != blocks[i - 1];
+	return distinct * PACK_DISTINCT >= n * (PACK_DISTINCT - 1);
+}
+
+static Node *join_packed(const uint64_t *rows){
+	// The unique packed node of rows. Packed nodes share hashtab with the others,
+	// in the bucket of their content hash
+	Hash128 h = rows_hash(rows, 0, 0, PACK_LEVEL);
+	int bucket;
+	pthread_mutex_t *lock = lock_bucket(nodelocks, &hashsize, h.lo, &bucket);
+	Node *p = hashtab[bucket];
+	while (p && !(p->packed && hash_equal(p->hash, h) && memcmp(leaf_bits(p), rows, PACK_SIZE * sizeof(uint64_t)) == 0))
+		p = p->next;
+	PROFILE_JOIN(PACK_LEVEL, p != NULL);
+	if (!p){
+		uint64_t *bits = malloc(PACK_SIZE * sizeof(uint64_t));
+		p = arena_alloc();
+		if (bits == NULL || p == NULL){
+			fprintf(stderr, "Out of memory for nodes\n");
+			exit(1);
+		}
+		memcpy(bits, rows, PACK_SIZE * sizeof(uint64_t));
+		unsigned n = 0;
+		for (int i = 0; i < PACK_SIZE; i++)
+			n += __builtin_popcountll(rows[i]);
+		*p = (Node){.n = n, .k = PACK_LEVEL, .packed = 1, .a = (Node *)(void *)bits, .hash = h, .next = hashtab[bucket]};
+		hashtab[bucket] = p;
+		__atomic_fetch_add(&nodecount, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&packedcount, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(lock);
+
+	if (__atomic_load_n(&nodecount, __ATOMIC_RELAXED) >= __atomic_load_n(&hashsize, __ATOMIC_RELAXED))
+		resize();
+	return p;
+}
+
+static Node *pack_rows(StepContext *ctx, const uint64_t *rows){
+	// The PACK_LEVEL node of rows, packed or joined from its quadrants
+	if (leaf_dense(rows))
+		return join_packed(rows);
+	int half = PACK_SIZE / 2;
+	Node *a = leaf_node(ctx, rows, 0, 0, PACK_LEVEL - 1), *b = leaf_node(ctx, rows, half, 0, PACK_LEVEL - 1);
+	Node *c = leaf_node(ctx, rows, 0, half, PACK_LEVEL - 1), *d = leaf_node(ctx, rows, half, half, PACK_LEVEL - 1);
+	return join_plain(a, b, c, d, node_hash(a, b, c, d));
+}
+
+Node *leaf_pack(const uint64_t *rows){
+	// The PACK_LEVEL node of PACK_SIZE rows, bit x of row y being the cell (x, y)
+	StepContext ctx = {.rule = 0};
+	return pack_rows(&ctx, rows);
+}
+
+static Node *join_dense(Node *a, Node *b, Node *c, Node *d, uintptr_t h){
+	// join() of children that may make a packed node and aren't joined unpacked yet
+	uint64_t rows[PACK_SIZE] = {0};
+	int half = PACK_SIZE / 2;
+	leaf_read(a, rows, 0, 0);
+	leaf_read(b, rows, half, 0);
+	leaf_read(c, rows, 0, half);
+	leaf_read(d, rows, half, half);
+	return leaf_dense(rows) ? join_packed(rows) : join_plain(a, b, c, d, h);
+}
+
+void node_quads(Node *p, Node *q[4]){
+	// The children of p, made from the rows of a packed node. Those are ordinary
+	// nodes, so they go away at the next gc() unless something keeps them
+	if (!p->packed){
+		q[0] = p->a;
+		q[1] = p->b;
+		q[2] = p->c;
+		q[3] = p->d;
+		return;
+	}
+	StepContext ctx = {.rule = 0};
+	int half = PACK_SIZE / 2;
+	for (int i = 0; i < 4; i++)
+		q[i] = leaf_node(&ctx, leaf_bits(p), (i & 1) * half, (i >> 1) * half, PACK_LEVEL - 1);
+}
+
+static Node *leaf_window(StepContext *ctx, Node *a, Node *b, Node *c, Node *d, int x, int y){
+	// The PACK_LEVEL node at (x, y) of the square of four PACK_LEVEL nodes, see shift()
+	Node *q[4] = {a, b, c, d};
+	uint64_t in[4][PACK_SIZE] = {{0}}, rows[PACK_SIZE];
+	for (int i = 0; i < 4; i++)
+		leaf_read(q[i], in[i], 0, 0);
+	for (int r = 0; r < PACK_SIZE; r++){
+		int top = y + r < PACK_SIZE ? 0 : 2, sy = (y + r) & (PACK_SIZE - 1);
+		rows[r] = x == 0 ? in[top][sy] : in[top][sy] >> x | in[top + 1][sy] << (PACK_SIZE - x);
+	}
+	return pack_rows(ctx, rows);
+}
+
+static int steps_packed(Node *p){
+	// successor() of p goes through packed_successor()
+	return p->packed || (p->k == PACK_LEVEL + 1
+			&& (p->a->packed || p->b->packed || p->c->packed || p->d->packed));
+}
+
+/*
+ * successor() of a level K node as a 2^K by 2^K bitboard: the cells are read into
+ * one word per row, stepped 2^j generations with step_row() and the centre is
+ * joined back into a node. The band of rows that can still be exact shrinks by
+ * one at both ends each generation, only those are computed
+ */
+#define LEAF_SUCCESSOR(K) \
+static Node *leaf_successor##K(StepContext *ctx, Node *p, int j){ \
+	enum { SIZE = 1 << K }; \
+	const uint64_t mask = ((uint64_t)1 << SIZE) - 1; \
+	uint64_t rows[SIZE + 2] = {0}; /* with a dead row above and below */ \
+	leaf_read(p, rows + 1, 0, 0); \
+	for (int g = 0; g < 1 << j; g++){ \
+		uint64_t next[SIZE]; \
+		for (int y = g + 1; y < SIZE - 1 - g; y++){ \
+			uint64_t w[3] = {rows[y] << 1, rows[y + 1] << 1, rows[y + 2] << 1}; \
+			uint64_t e[3] = {rows[y] >> 1, rows[y + 1] >> 1, rows[y + 2] >> 1}; \
+			next[y] = step_row(w, rows + y, e, &ctx->plan) & mask; \
+		} \
+		memcpy(rows + 2 + g, next + g + 1, (SIZE - 2 - 2 * g) * sizeof(uint64_t)); \
+	} \
+	return leaf_node(ctx, rows + 1, SIZE / 4, SIZE / 4, K - 1); \
+}
+
+LEAF_SUCCESSOR(3)
+LEAF_SUCCESSOR(4)
+LEAF_SUCCESSOR(5)
+
+static Node *leaf_successor(StepContext *ctx, Node *p, int j){
+	// Levels 3 to LEAF_LEVEL
+	PROFILE_START(start);
+	Node *result;
+	switch (p->k){
+		case 3: result = leaf_successor3(ctx, p, j); break;
+		case 4: result = leaf_successor4(ctx, p, j); break;
+		default: result = leaf_successor5(ctx, p, j);
+	}
+	PROFILE_SUCCESSOR(p->k, start);
+	return result;
+}
+
+static Node *packed_successor(StepContext *ctx, Node *p, int j){
+	// successor() of a node steps_packed() picks, as a bitboard like LEAF_SUCCESSOR()
+	// with one or two words per row, without making the nodes below PACK_LEVEL
+	PROFILE_START(start);
+	enum { WIDE = 2 * PACK_SIZE };
+	int size = 1 << p->k, words = size / PACK_SIZE;
+	uint64_t rows[WIDE + 2][2] = {{0}}; // with a dead row above and below
+	Node *q[4] = {p, NULL, NULL, NULL};
+	if (words == 2)
+		node_quads(p, q);
+	for (int i = 0; i < words * words; i++){
+		uint64_t in[PACK_SIZE] = {0};
+		leaf_read(q[i], in, 0, 0);
+		for (int y = 0; y < PACK_SIZE; y++)
+			rows[1 + (i >> 1) * PACK_SIZE + y][i & 1] = in[y];
+	}
+	for (int g = 0; g < 1 << j; g++){
+		uint64_t next[WIDE][2] = {{0}};
+		for (int y = g + 1; y < size - 1 - g; y++)
+			for (int i = 0; i < words; i++){
+				// bit x of w and e holds the cell left and right of x, carried across words
+				uint64_t w[3], e[3], m[3];
+				for (int r = 0; r < 3; r++){
+					m[r] = rows[y + r][i];
+					w[r] = m[r] << 1 | (i > 0 ? rows[y + r][i - 1] >> 63 : 0);
+					e[r] = m[r] >> 1 | (i + 1 < words ? rows[y + r][i + 1] << 63 : 0);
+				}
+				next[y][i] = step_row(w, m, e, &ctx->plan);
+			}
+		memcpy(rows + 2 + g, next + g + 1, (size - 2 - 2 * g) * sizeof(next[0]));
+	}
+
+	uint64_t out[PACK_SIZE];
+	Node *result;
+	if (words == 1){
+		for (int y = 0; y < PACK_SIZE; y++)
+			out[y] = rows[y + 1][0];
+		result = leaf_node(ctx, out, PACK_SIZE / 4, PACK_SIZE / 4, PACK_LEVEL - 1);
+	} else {
+		int half = PACK_SIZE / 2;
+		for (int y = 0; y < PACK_SIZE; y++)
+			out[y] = rows[half + 1 + y][0] >> half | rows[half + 1 + y][1] << half;
+		result = pack_rows(ctx, out);
+	}
+	PROFILE_SUCCESSOR(p->k, start);
+	return result;
 }
 
-Node *successor(Node *p, int j){
+static void phase_start(StepContext *ctx, Frame *f, int phase, Node *keys[][4], int n){
+	// Join the children of a phase and take every successor known without work:
+	// those of empty children, and the memo's, probed as one batch
+	int k = f->p->k - 1, j = min(f->j, k - 2);
+	Node *probe[BATCH_MAX], *found[BATCH_MAX];
+	f->phase = phase;
+	f->n = n;
+	join_batch(keys, f->in, n);
+	for (int i = 0; i < n; i++){
+		f->res[i] = f->in[i]->n == 0 ? f->in[i]->a : NULL;
+		probe[i] = f->res[i] == NULL && k >= MEMO_MIN_LEVEL ? f->in[i] : NULL;
+	}
+	memo_get_batch(probe, n, j, ctx->rule, found);
+	for (int i = 0; i < n; i++)
+		if (found[i])
+			f->res[i] = found[i];
+}
+
+static void frame_push(StepContext *ctx, Frame *f, Node *p, int j, Node **out){
 	/*
 	 *  +--+--+--+--+
 	 *  |aa|ab|ba|bb|
@@ -235,71 +1122,217 @@ Node *successor(Node *p, int j){
 	 *  +--+--+--+--+
 	 *  |cc|cd|dc|dd|
 	 *  +--+--+--+--+
+	 *
+	 * The first phase steps the nine overlapping subnodes
 	 */
+	Node *nine[9][4] = {
+		{p->a->a, p->a->b, p->a->c, p->a->d},
+		{p->a->b, p->b->a, p->a->d, p->b->c},
+		{p->b->a, p->b->b, p->b->c, p->b->d},
+		{p->a->c, p->a->d, p->c->a, p->c->b},
+		{p->a->d, p->b->c, p->c->b, p->d->a},
+		{p->b->c, p->b->d, p->d->a, p->d->b},
+		{p->c->a, p->c->b, p->c->c, p->c->d},
+		{p->c->b, p->d->a, p->c->d, p->d->c},
+		{p->d->a, p->d->b, p->d->c, p->d->d},
+	};
+	f->p = p;
+	f->j = j;
+	f->out = out;
+#ifdef PROFILE
+	f->start = profile_now();
+#endif
+	phase_start(ctx, f, PHASE_NINE, nine, 9);
+}
 
-	assert(p->k >= 2);
-	Node *result;
-	if (p->n == 0)
-		result = p->a;
-	else if (p->k == 2)
-		result = life4x4(p);
-	else {
-		j = j <= 0 ? p->k - 2 : min(j, p->k - 2);
-
-		Node *c1 = successor(join(p->a->a, p->a->b, p->a->c, p->a->d), j);
-		Node *c2 = successor(join(p->a->b, p->b->a, p->a->d, p->b->c), j);
-		Node *c3 = successor(join(p->b->a, p->b->b, p->b->c, p->b->d), j);
-		Node *c4 = successor(join(p->a->c, p->a->d, p->c->a, p->c->b), j);
-		Node *c5 = successor(join(p->a->d, p->b->c, p->c->b, p->d->a), j);
-		Node *c6 = successor(join(p->b->c, p->b->d, p->d->a, p->d->b), j);
-		Node *c7 = successor(join(p->c->a, p->c->b, p->c->c, p->c->d), j);
-		Node *c8 = successor(join(p->c->b, p->d->a, p->c->d, p->d->c), j);
-		Node *c9 = successor(join(p->d->a, p->d->b, p->d->c, p->d->d), j);
-		if (j < p->k - 2){
-			result = join(
-					join(c1->d, c2->c, c4->b, c5->a),
-					join(c2->d, c3->c, c5->b, c6->a),
-					join(c4->d, c5->c, c7->b, c8->a),
-					join(c5->d, c6->c, c8->b, c9->a));
-		} else {
-			result = join(
-					successor(join(c1, c2, c4, c5), j),
-					successor(join(c2, c3, c5, c6), j),
-					successor(join(c4, c5, c7, c8), j),
-					successor(join(c5, c6, c8, c9), j));
+static Node *frame_finish(StepContext *ctx, Frame *f){
+	// The result of a frame whose children all have successors, or NULL when it
+	// moves on to its second phase instead
+	Node **c = f->res, *q[4];
+	if (f->phase == PHASE_NINE && f->j == f->p->k - 2){
+		// half the generations done, the four overlapping quarters take the rest
+		Node *four[4][4] = {
+			{c[0], c[1], c[3], c[4]},
+			{c[1], c[2], c[4], c[5]},
+			{c[3], c[4], c[6], c[7]},
+			{c[4], c[5], c[7], c[8]},
+		};
+		phase_start(ctx, f, PHASE_FOUR, four, 4);
+		return NULL;
+	}
+	if (f->phase == PHASE_NINE && f->p->k == PACK_LEVEL + 2){
+		// the results may be packed, take the centres from their rows
+		int half = PACK_SIZE / 2;
+		q[0] = leaf_window(ctx, c[0], c[1], c[3], c[4], half, half);
+		q[1] = leaf_window(ctx, c[1], c[2], c[4], c[5], half, half);
+		q[2] = leaf_window(ctx, c[3], c[4], c[6], c[7], half, half);
+		q[3] = leaf_window(ctx, c[4], c[5], c[7], c[8], half, half);
+		c = q;
+	} else if (f->phase == PHASE_NINE){
+		Node *four[4][4] = {
+			{c[0]->d, c[1]->c, c[3]->b, c[4]->a},
+			{c[1]->d, c[2]->c, c[4]->b, c[5]->a},
+			{c[3]->d, c[4]->c, c[6]->b, c[7]->a},
+			{c[4]->d, c[5]->c, c[7]->b, c[8]->a},
+		};
+		join_batch(four, q, 4);
+		c = q;
+	}
+	return join(c[0], c[1], c[2], c[3]);
+}
 
+static Node *successor_run(StepContext *ctx, Node *p, int j){
+	// successor() of a node above LEAF_LEVEL that missed the memo. Each level is a
+	// Frame on an explicit stack instead of a recursive call, at most one per level
+	Frame *stack = malloc((p->k - LEAF_LEVEL) * sizeof(Frame));
+	if (stack == NULL){
+		fprintf(stderr, "Out of memory for successor()\n");
+		exit(1);
+	}
+	Node *result;
+	int depth = 0;
+	frame_push(ctx, &stack[depth++], p, j, &result);
+	while (depth > 0){
+		Frame *f = &stack[depth - 1];
+		int i = 0;
+		while (i < f->n && f->res[i])
+			i++;
+		if (i < f->n){
+			Node *c = f->in[i];
+			int cj = min(f->j, c->k - 2);
+			for (int m = 0; m < i && f->res[i] == NULL; m++)
+				if (f->in[m] == c) // the same node twice in one batch, step it once
+					f->res[i] = f->res[m];
+			if (f->res[i])
+				continue;
+			if (steps_packed(c)){
+				f->res[i] = packed_successor(ctx, c, cj);
+				memo_put(c, cj, ctx->rule, f->res[i]);
+				continue;
+			}
+			if (c->k > LEAF_LEVEL){
+				frame_push(ctx, &stack[depth++], c, cj, &f->res[i]);
+				continue;
+			}
+			f->res[i] = leaf_successor(ctx, c, cj);
+			if (c->k >= MEMO_MIN_LEVEL)
+				memo_put(c, cj, ctx->rule, f->res[i]);
+			continue;
 		}
+
+		Node *r = frame_finish(ctx, f);
+		if (r == NULL)
+			continue;
+		memo_put(f->p, f->j, ctx->rule, r);
+		PROFILE_SUCCESSOR(f->p->k, f->start); // children included
+		*f->out = r;
+		depth--;
 	}
+	free(stack);
 	return result;
 }
 
+Node *successor(Node *p, int j, unsigned rule){
+	// The centre half of p, 2^j generations later (2^(k-2) for negative j)
+	assert(p->k >= 2);
+	if (p->n == 0)
+		return p->a;
+	if (p->k == 2)
+		return life4x4(p, rule);
+
+	j = j < 0 ? p->k - 2 : min(j, p->k - 2); // negative means the biggest step this level allows
+	Node *result = p->k >= MEMO_MIN_LEVEL ? memo_get(p, j, rule) : NULL;
+	if (result)
+		return result;
+
+	StepContext ctx = {.rule = rule};
+	rule_plan(&ctx.plan, rule);
+	if (steps_packed(p))
+		result = packed_successor(&ctx, p, j);
+	else if (p->k > LEAF_LEVEL)
+		return successor_run(&ctx, p, j);
+	else
+		result = leaf_successor(&ctx, p, j);
+	if (p->k >= MEMO_MIN_LEVEL)
+		memo_put(p, j, rule, result);
+	return result;
+}
 
-Node *advance(Node *p, int n){
-	if (n==0)
+Node *advance(Node *p, int64_t n, unsigned rule){
+	// Move p forward n generations with one successor() per set bit of n, biggest jump first.
+	// successor() of a level k node only keeps its centre 2^(k-1) square, so a 2^j jump
+	// is exact as long as every live cell is at least 2^(k-2) + 2^j away from the edges.
+	// Pad only until that holds, patterns far from the edges are stepped without padding
+	assert(n >= 0 && n <= ADVANCE_MAX);
+	if (n == 0 || p->n == 0)
 		return p;
-
-	int nbits = 0;
-	int bits[n];
-	while (n>0){
-		bits[nbits] = n &1;
-		n = n >> 1;
-		p = centre(p);
-		nbits++;
+	__atomic_add_fetch(&memoepoch, 1, __ATOMIC_RELAXED); // memo entries used from here on are recent
+
+	for (int j = MAX_LEVEL - 3; j >= 0; j--){
+		if (!((n >> j) & 1))
+			continue;
+		while (p->k < j + 2 || margin(p) < ((int64_t)1 << (p->k - 2)) + ((int64_t)1 << j))
+			p = centre(p);
+		p = successor(p, j, rule);
 	}
-	p = centre(p); // Another extra at last. Don't know why but it works
+	return crop(p);
+}
 
-	
-	for (int i = 0; i < nbits; i++){
-		int j = nbits - i;
-		if (bits[nbits - i - 1]){
-			p = successor(p, j);
+Node *advance_until(Node *p, int64_t limit, unsigned rule, UntilFn cond, void *udata, int monotone, int64_t *n){
+	// p advanced to the first generation where cond holds, at most limit generations
+	// ahead, with the generations it took in *n. NULL if cond doesn't hold by then.
+	// Steps double from 1 until cond holds, then halve back towards the last generation
+	// where it didn't, so this costs O(log n) advance() calls of a single successor()
+	// each. That finds the first generation when cond stays true once it holds
+	// (monotone: a size reached, a stable pattern). Other conditions, like population
+	// thresholds, are checked every generation over the first UNTIL_SCAN and once
+	// halving is down to UNTIL_SCAN. Past those, a crossing that ends again before the
+	// next doubling probe is still missed
+	if (cond(p, rule, udata)){
+		*n = 0;
+		return p;
+	}
+	int64_t done = 0, step = 1; // cond is false at done
+	Node *q;
+	for (;;){
+		if (step > limit - done)
+			step = limit - done;
+		if (step == 0)
+			return NULL;
+		q = advance(p, step, rule);
+		if (cond(q, rule, udata))
+			break;
+		p = q;
+		done += step;
+		if (step < ((int64_t)1 << (MAX_LEVEL - 3)) && (monotone || done >= UNTIL_SCAN))
+			step *= 2;
+	}
+	// false at done, true at done + step
+	while (step > (monotone ? 1 : UNTIL_SCAN)){
+		int64_t half = step / 2;
+		Node *mid = advance(p, half, rule);
+		if (cond(mid, rule, udata)){
+			q = mid;
+			step = half;
+		} else {
+			p = mid;
+			done += half;
+			step -= half;
 		}
 	}
-	return crop(p);
+	for (int64_t i = 1; i < step; i++){
+		p = advance(p, 1, rule);
+		if (cond(p, rule, udata)){
+			*n = done + i;
+			return p;
+		}
+	}
+	*n = done + step;
+	return q;
 }
 
 
-Node *life(Node *n1, Node *n2, Node *n3, Node *n4, Node *c, Node *n6, Node *n7, Node *n8, Node *n9){
+Node *life(Node *n1, Node *n2, Node *n3, Node *n4, Node *c, Node *n6, Node *n7, Node *n8, Node *n9, unsigned rule){
 	/*
 	 *  +--+--+--+
 	 *  |n1|n2|n3|
@@ -313,15 +1346,17 @@ Node *life(Node *n1, Node *n2, Node *n3, Node *n4, Node *c, Node *n6, Node *n7,
 	 * 2. Any live cell with two or three live neighbours lives on to the next generation.
 	 * 3. Any live cell with more than three live neighbours dies, as if by overpopulation.
 	 * 4. Any dead cell with exactly three live neighbours becomes a live cell, as if by reproduction.
+	 *
+	 * That is RULE_LIFE, other rules pick their own neighbour counts
 	 */
 
 	// assert all node are level 0;
 	assert(n1->k ^ n2->k ^ n3->k ^ n4->k ^ c->k ^ n6->k ^ n7->k ^ n8->k ^ n9 ->k == 0 && n1->k == 0);
 	int nb = n1->n + n2->n + n3->n + n4->n + n6->n + n7->n + n8->n + n9->n;
-	return ((c->n == 1 && nb == 2) || nb == 3) ? ON : OFF;
+	return (rule >> (c->n ? RULE_SURVIVE + nb : nb)) & 1 ? ON : OFF;
 }
 
-Node *life4x4(Node *p){
+Node *life4x4(Node *p, unsigned rule){
 	/*
 	 *  +--+--+--+--+
 	 *  |aa|ab|ba|bb|
@@ -335,28 +1370,777 @@ Node *life4x4(Node *p){
 	 */
 
 	assert(p->k == 2);
-	Node *ad = life(p->a->a, p->a->b, p->b->a, p->a->c, p->a->d, p->b->c, p->c->a, p->c->b, p->d->a);
-	Node *bc = life(p->a->b, p->b->a, p->b->b, p->a->d, p->b->c, p->b->d, p->c->b, p->d->a, p->d->b);
-	Node *cb = life(p->a->c, p->a->d, p->b->c, p->c->a, p->c->b, p->d->a, p->c->c, p->c->d, p->d->c);
-	Node *da = life(p->a->d, p->b->c, p->b->d, p->c->b, p->d->a, p->d->b, p->c->d, p->d->c, p->d->d);
+	Node *ad = life(p->a->a, p->a->b, p->b->a, p->a->c, p->a->d, p->b->c, p->c->a, p->c->b, p->d->a, rule);
+	Node *bc = life(p->a->b, p->b->a, p->b->b, p->a->d, p->b->c, p->b->d, p->c->b, p->d->a, p->d->b, rule);
+	Node *cb = life(p->a->c, p->a->d, p->b->c, p->c->a, p->c->b, p->d->a, p->c->c, p->c->d, p->d->c, rule);
+	Node *da = life(p->a->d, p->b->c, p->b->d, p->c->b, p->d->a, p->d->b, p->c->d, p->d->c, p->d->d, rule);
 	return join(ad, bc, cb, da);
 }
 
 
+/*** Subtree operations ***/
+static int64_t floor_shift(int64_t x, int k){
+	// x / 2^k rounded towards minus infinity
+	return x >= 0 ? x >> k : -((-x - 1) >> k) - 1;
+}
+
+Node *block(Node *p, int64_t bx, int64_t by, int k){
+	// The level k node at block coordinates (bx, by) inside p, empty if it lies outside p
+	int64_t nblocks = (int64_t)1 << (p->k - k);
+	if (bx < 0 || by < 0 || bx >= nblocks || by >= nblocks)
+		return get_zero(k);
+
+	while (p->k > k && p->n > 0){
+		if (p->packed){
+			StepContext ctx = {.rule = 0};
+			int x = (int)bx << k, y = (int)by << k;
+			return k == 0 ? (leaf_bits(p)[y] >> x & 1 ? ON : OFF) : leaf_node(&ctx, leaf_bits(p), x, y, k);
+		}
+		int64_t half = (int64_t)1 << (p->k - k - 1); // half of p, counted in blocks
+		if (by < half)
+			p = bx < half ? p->a : p->b;
+		else
+			p = bx < half ? p->c : p->d;
+		if (bx >= half) bx -= half;
+		if (by >= half) by -= half;
+	}
+	return p->k == k ? p : get_zero(k);
+}
+
+Node *shift(Node *a, Node *b, Node *c, Node *d, int64_t x, int64_t y){
+	/*
+	 * The level k window with upper left at (x, y), 0 <= x, y < 2^k,
+	 * over the 2^(k+1) square made of four level k nodes:
+	 *  +--+--+
+	 *  |a |b |
+	 *  +--+--+
+	 *  |c |d |
+	 *  +--+--+
+	 * Built from whole subtrees of the 4x4 grandchildren, so the cost depends on the
+	 * live nodes along the way, never on the area
+	 */
+	if ((x == 0 && y == 0) || a->n + b->n + c->n + d->n == 0)
+		return a;
+
+	uintptr_t h = (node_hash(a, b, c, d) + (uintptr_t)x * 31 + (uintptr_t)y * 1009) % SHIFT_CACHE_SIZE;
+	pthread_mutex_t *lock = &shiftlocks[h % LOCK_STRIPES];
+	Node *hit = NULL;
+	pthread_mutex_lock(lock);
+	if (shiftcache[h].a == a && shiftcache[h].b == b && shiftcache[h].c == c && shiftcache[h].d == d
+			&& shiftcache[h].x == x && shiftcache[h].y == y)
+		hit = shiftcache[h].result;
+	pthread_mutex_unlock(lock);
+	if (hit)
+		return hit;
+
+	int k = a->k;
+	Node *result;
+	if (k == PACK_LEVEL && (a->packed || b->packed || c->packed || d->packed)){
+		StepContext ctx = {.rule = 0};
+		result = leaf_window(&ctx, a, b, c, d, (int)x, (int)y);
+	} else {
+		int64_t half = (int64_t)1 << (k - 1);
+		Node *g[4][4] = {
+			{a->a, a->b, b->a, b->b},
+			{a->c, a->d, b->c, b->d},
+			{c->a, c->b, d->a, d->b},
+			{c->c, c->d, d->c, d->d},
+		};
+		int gx = (int)(x >> (k - 1)), gy = (int)(y >> (k - 1));
+		int64_t rx = x & (half - 1), ry = y & (half - 1);
+		Node *q[2][2];
+		for (int i = 0; i < 2; i++)
+			for (int j = 0; j < 2; j++)
+				q[i][j] = shift(g[gy+i][gx+j], g[gy+i][gx+j+1], g[gy+i+1][gx+j], g[gy+i+1][gx+j+1], rx, ry);
+		result = join(q[0][0], q[0][1], q[1][0], q[1][1]);
+	}
+
+	pthread_mutex_lock(lock);
+	shiftcache[h].a = a; shiftcache[h].b = b; shiftcache[h].c = c; shiftcache[h].d = d;
+	shiftcache[h].x = x; shiftcache[h].y = y;
+	shiftcache[h].result = result;
+	pthread_mutex_unlock(lock);
+	return result;
+}
+
+Node *subnode(Node *p, int64_t x, int64_t y, int k){
+	// The level k node whose upper left is (x, y) in p's coordinates. Cells outside p are dead
+	while (p->k < k){
+		Node *z = get_zero(p->k);
+		p = join(p, z, z, z);
+	}
+
+	int64_t size = (int64_t)1 << k;
+	int64_t bx = floor_shift(x, k), by = floor_shift(y, k);
+	return shift(
+			block(p, bx, by, k), block(p, bx + 1, by, k),
+			block(p, bx, by + 1, k), block(p, bx + 1, by + 1, k),
+			x - bx * size, y - by * size);
+}
+
+Node *union_centred(Node *a, Node *b){
+	// node_or() of two universes centred on the same point but maybe of different levels
+	while (a->k < b->k)
+		a = centre(a);
+	while (b->k < a->k)
+		b = centre(b);
+	return node_or(a, b);
+}
+
+Node *translate(Node *p, int64_t dx, int64_t dy){
+	// Move the content of p by (dx, dy), the universe stays centred at the same point
+	// and grows until the moved pattern fits
+	if (p->n == 0 || (dx == 0 && dy == 0))
+		return p;
+
+	int64_t reach = max(dx < 0 ? -dx : dx, dy < 0 ? -dy : dy);
+	while (margin(p) <= reach)
+		p = centre(p);
+	return crop(subnode(p, -dx, -dy, p->k));
+}
+
+
+Node *node_or(Node *a, Node *b){
+	// Cells alive in either of two nodes of the same level. Empty and identical
+	// subtrees are taken whole, so only the parts where both have cells are rebuilt
+	assert(a->k == b->k);
+	if (b->n == 0 || a == b)
+		return a;
+	if (a->n == 0)
+		return b;
+	if (a->k == 0)
+		return ON;
+	if (a->packed || b->packed){
+		uint64_t rows[PACK_SIZE] = {0};
+		leaf_read(a, rows, 0, 0);
+		leaf_read(b, rows, 0, 0);
+		return leaf_pack(rows);
+	}
+	return join(node_or(a->a, b->a), node_or(a->b, b->b), node_or(a->c, b->c), node_or(a->d, b->d));
+}
+
+Node *paste(Node *p, Node *clip, int64_t x, int64_t y){
+	// Add the live cells of clip with its upper left at (x, y) of p, the region must fit in p.
+	// When (x, y) is aligned to clip's size the whole clip node is reused as one subtree
+	return node_or(p, subnode(clip, -x, -y, p->k));
+}
+
+static uint64_t rect_cols(int64_t x, int64_t w){
+	// The bits of the columns [x, x + w) of a packed row
+	int64_t x0 = max(x, 0), x1 = min(x + w, PACK_SIZE);
+	if (x0 >= x1)
+		return 0;
+	uint64_t upto = x1 == PACK_SIZE ? ~(uint64_t)0 : ((uint64_t)1 << x1) - 1;
+	return upto & ~(((uint64_t)1 << x0) - 1);
+}
+
+static Node *rect_filter(Node *p, int64_t x, int64_t y, int64_t w, int64_t h, int inside){
+	// Keep the cells of p inside the rectangle (inside = 1) or outside of it (inside = 0)
+	int64_t size = (int64_t)1 << p->k;
+	if (p->n == 0)
+		return p;
+	if (x >= size || y >= size || x + w <= 0 || y + h <= 0 || w <= 0 || h <= 0)
+		return inside ? get_zero(p->k) : p;
+	if (x <= 0 && y <= 0 && x + w >= size && y + h >= size)
+		return inside ? p : get_zero(p->k);
+	if (p->packed){
+		uint64_t rows[PACK_SIZE];
+		uint64_t cols = rect_cols(x, w);
+		for (int i = 0; i < PACK_SIZE; i++){
+			uint64_t in = i >= y && i < y + h ? cols : 0;
+			rows[i] = leaf_bits(p)[i] & (inside ? in : ~in);
+		}
+		return leaf_pack(rows);
+	}
+
+	int64_t half = size >> 1;
+	return join(
+			rect_filter(p->a, x, y, w, h, inside),
+			rect_filter(p->b, x - half, y, w, h, inside),
+			rect_filter(p->c, x, y - half, w, h, inside),
+			rect_filter(p->d, x - half, y - half, w, h, inside));
+}
+
+Node *copy_rect(Node *p, int64_t x, int64_t y, int64_t w, int64_t h){
+	// The cells of the rectangle as a node of their own, upper left at (0, 0)
+	int k = 0;
+	while (((int64_t)1 << k) < max(w, h))
+		k++;
+	return rect_filter(subnode(p, x, y, k), 0, 0, w, h, 1);
+}
+
+Node *clear_rect(Node *p, int64_t x, int64_t y, int64_t w, int64_t h){
+	return rect_filter(p, x, y, w, h, 0);
+}
+
+static Node *tile_grid(Node *t, int l, int64_t nx, int64_t ny, Node **full){
+	// Level l node holding nx * ny copies of the level t->k tile t, packed from the upper left.
+	// full[l] caches a level l node completely covered with tiles
+	if (nx <= 0 || ny <= 0)
+		return get_zero(l);
+	int64_t span = (int64_t)1 << (l - t->k); // tiles per side at this level
+	if (nx >= span && ny >= span){
+		if (full[l] == NULL)
+			full[l] = l == t->k ? t : join(
+					tile_grid(t, l - 1, span, span, full), tile_grid(t, l - 1, span, span, full),
+					tile_grid(t, l - 1, span, span, full), tile_grid(t, l - 1, span, span, full));
+		return full[l];
+	}
+
+	int64_t half = span >> 1;
+	return join(
+			tile_grid(t, l - 1, min(nx, half), min(ny, half), full),
+			tile_grid(t, l - 1, nx - half, min(ny, half), full),
+			tile_grid(t, l - 1, min(nx, half), ny - half, full),
+			tile_grid(t, l - 1, nx - half, ny - half, full));
+}
+
+static Node *repeat(Node *p, int64_t n, int64_t dx, int64_t dy){
+	// n copies of p, each moved by (dx, dy) from the previous one, by doubling:
+	// O(log n) unions of shifted copies instead of n pastes
+	Node *result = NULL, *run = p; // run holds 2^i copies
+	int64_t done = 0, runlen = 1;
+	while (n > 0){
+		if (n & 1){
+			Node *moved = translate(run, done * dx, done * dy);
+			result = result == NULL ? moved : union_centred(result, moved);
+			done += runlen;
+		}
+		n >>= 1;
+		if (n > 0){
+			run = union_centred(run, translate(run, runlen * dx, runlen * dy));
+			runlen *= 2;
+		}
+	}
+	return result;
+}
+
+Node *stamp(Node *clip, int64_t nx, int64_t ny, int64_t sx, int64_t sy){
+	// nx * ny copies of clip, sx and sy apart, upper left copy at (0, 0).
+	// When the spacing is a power of 2 and both are equal the grid is made of whole
+	// tile subtrees in O(depth^2) joins, whatever the number of copies
+	if (nx <= 0 || ny <= 0)
+		return get_zero(clip->k);
+
+	int t = 0;
+	while (((int64_t)1 << t) < sx)
+		t++;
+	if (sx == sy && sx == ((int64_t)1 << t) && t >= clip->k){
+		int l = t;
+		while (((int64_t)1 << (l - t)) < max(nx, ny))
+			l++;
+		Node *full[MAX_ITER_LEVEL + 1] = {NULL};
+		return tile_grid(subnode(clip, 0, 0, t), l, nx, ny, full);
+	}
+
+	// centred on the first copy, so the translations below keep it where it is
+	Node *z = get_zero(clip->k);
+	Node *p = join(z, z, z, clip);
+	Node *grid = repeat(repeat(p, nx, sx, 0), ny, 0, sy);
+	int64_t half = (int64_t)1 << (grid->k - 1);
+	int k = 0;
+	while (((int64_t)1 << k) < max((nx - 1) * sx, (ny - 1) * sy) + ((int64_t)1 << clip->k))
+		k++;
+	return subnode(grid, half, half, k);
+}
+
+
+/*** Queries ***/
+static int64_t first_live(Node *p, int side, int64_t limit){
+	// Distance from one side of p to its nearest live cell, or limit if none is closer.
+	// Empty subtrees and subtrees that can't beat the best distance so far are skipped
+	if (p->n == 0 || limit <= 0)
+		return limit;
+	if (p->k == 0)
+		return 0;
+	if (p->packed){
+		const uint64_t *rows = leaf_bits(p);
+		int64_t d = PACK_SIZE;
+		for (int i = 0; i < PACK_SIZE; i++){
+			if (rows[i] == 0)
+				continue;
+			if (side == SIDE_LEFT)
+				d = min(d, __builtin_ctzll(rows[i]));
+			else if (side == SIDE_RIGHT)
+				d = min(d, __builtin_clzll(rows[i]));
+			else
+				d = min(d, side == SIDE_TOP ? i : PACK_SIZE - 1 - i);
+		}
+		return min(d, limit);
+	}
+
+	int64_t half = (int64_t)1 << (p->k - 1);
+	Node *near1, *near2, *far1, *far2;
+	switch (side){
+		case SIDE_LEFT:   near1 = p->a; near2 = p->c; far1 = p->b; far2 = p->d; break;
+		case SIDE_RIGHT:  near1 = p->b; near2 = p->d; far1 = p->a; far2 = p->c; break;
+		case SIDE_TOP:    near1 = p->a; near2 = p->b; far1 = p->c; far2 = p->d; break;
+		default:          near1 = p->c; near2 = p->d; far1 = p->a; far2 = p->b; break;
+	}
+	int64_t d = first_live(near2, side, first_live(near1, side, min(limit, half)));
+	if (d < half)
+		return d;
+	return half + first_live(far2, side, first_live(far1, side, limit - half));
+}
+
+int64_t margin(Node *p){
+	// Smallest distance between a live cell and the edges of p, INT64_MAX if p is empty
+	int64_t m = INT64_MAX;
+	for (int side = SIDE_LEFT; side <= SIDE_BOTTOM; side++)
+		m = first_live(p, side, m);
+	return m;
+}
+
+int bbox(Node *p, BBox *box){
+	// Smallest rectangle holding every live cell of p, relative to its upper left corner.
+	// Returns 0 and leaves box alone if p is empty
+	if (p->n == 0)
+		return 0;
+
+	int64_t size = (int64_t)1 << p->k;
+	box->x0 = first_live(p, SIDE_LEFT, size);
+	box->y0 = first_live(p, SIDE_TOP, size);
+	box->x1 = size - first_live(p, SIDE_RIGHT, size);
+	box->y1 = size - first_live(p, SIDE_BOTTOM, size);
+	return 1;
+}
+
+uint64_t population(Node *p, int64_t x, int64_t y, int64_t w, int64_t h){
+	// Number of live cells of p inside the rectangle (x, y, w, h).
+	// Subtrees fully inside are counted from n without descending, so only the
+	// O(depth) nodes along the rectangle's border are visited
+	if (p->n == 0 || w <= 0 || h <= 0)
+		return 0;
+
+	int64_t size = (int64_t)1 << p->k;
+	if (x >= size || y >= size || x + w <= 0 || y + h <= 0)
+		return 0;
+	if (x <= 0 && y <= 0 && x + w >= size && y + h >= size)
+		return p->n;
+	if (p->packed){
+		uint64_t cols = rect_cols(x, w), n = 0;
+		for (int64_t i = max(y, 0); i < min(y + h, PACK_SIZE); i++)
+			n += __builtin_popcountll(leaf_bits(p)[i] & cols);
+		return n;
+	}
+
+	int64_t half = size >> 1;
+	return population(p->a, x, y, w, h)
+		+ population(p->b, x - half, y, w, h)
+		+ population(p->c, x, y - half, w, h)
+		+ population(p->d, x - half, y - half, w, h);
+}
+
+void cell_iter_init(CellIter *it, Node *p, int64_t x, int64_t y, int64_t w, int64_t h){
+	it->rect = (BBox){.x0 = x, .y0 = y, .x1 = x + w, .y1 = y + h};
+	it->depth = 0;
+	it->stack[it->depth++] = (IterFrame){.p = p, .x = 0, .y = 0};
+	it->leaf = NULL;
+	it->row = it->rows = 0;
+	it->left = 0;
+}
+
+int cell_iter_next(CellIter *it, int64_t *x, int64_t *y){
+	// Stream the next live cell inside the rectangle, 0 once they are all visited.
+	// Cells come out quadrant by quadrant (a, b, c, d), and row by row inside a packed
+	// node. Nothing is expanded to a grid
+	for (;;){
+		if (it->left){
+			*x = it->lx + __builtin_ctzll(it->left);
+			*y = it->ly + it->row - 1;
+			it->left &= it->left - 1;
+			return 1;
+		}
+		if (it->row < it->rows){
+			it->left = it->leaf[it->row++] & it->cols;
+			continue;
+		}
+		if (it->depth == 0)
+			return 0;
+
+		IterFrame f = it->stack[--it->depth];
+		int64_t size = (int64_t)1 << f.p->k;
+		if (f.p->n == 0 || f.x >= it->rect.x1 || f.y >= it->rect.y1 ||
+				f.x + size <= it->rect.x0 || f.y + size <= it->rect.y0)
+			continue;
+
+		if (f.p->k == 0){
+			*x = f.x;
+			*y = f.y;
+			return 1;
+		}
+		if (f.p->packed){
+			it->leaf = leaf_bits(f.p);
+			it->lx = f.x;
+			it->ly = f.y;
+			it->row = (int)max(it->rect.y0 - f.y, 0);
+			it->rows = (int)min(it->rect.y1 - f.y, PACK_SIZE);
+			it->cols = rect_cols(it->rect.x0 - f.x, it->rect.x1 - it->rect.x0);
+			continue;
+		}
+
+		int64_t half = size >> 1;
+		it->stack[it->depth++] = (IterFrame){.p = f.p->d, .x = f.x + half, .y = f.y + half};
+		it->stack[it->depth++] = (IterFrame){.p = f.p->c, .x = f.x, .y = f.y + half};
+		it->stack[it->depth++] = (IterFrame){.p = f.p->b, .x = f.x + half, .y = f.y};
+		it->stack[it->depth++] = (IterFrame){.p = f.p->a, .x = f.x, .y = f.y};
+	}
+}
+
+static Node *inner_quad(Node *p, int i, int depth){
+	// The node depth levels below child i of p that touches p's centre
+	Node *q[4];
+	node_quads(p, q);
+	p = q[i];
+	for (; depth > 0; depth--){
+		node_quads(p, q);
+		p = q[3 - i];
+	}
+	return p;
+}
+
+static int is_centred(Node *p, int depth){
+	// Every cell of p is within the nodes depth levels below its children at its centre
+	for (int i = 0; i < 4; i++)
+		if (inner_quad(p, i, 0)->n != inner_quad(p, i, depth)->n)
+			return 0;
+	return 1;
+}
+
+Node *shrink(Node *p){
+	// The smallest node centred on the same point with the cells of p, so equal cells
+	// make the same node whatever empty border p carries. crop() keeps some border
+	while (p->k > 1 && is_centred(p, 1))
+		p = inner(p);
+	return p;
+}
+
+
+/*** Universes ***/
+Universe *universe_new(Node *root, unsigned rule){
+	// A pattern with its own generation count and rule, all universes share the node
+	// store and the memo. Each one is a GC root until universe_free()
+	Universe *u = malloc(sizeof(Universe));
+	if (u == NULL)
+		return NULL;
+	u->root = root;
+	u->gen = 0;
+	u->rule = rule;
+	u->engine = ENGINE_HASHLIFE;
+	u->tiles = NULL;
+	u->tilegens = 0;
+	u->probes = u->hits = 0;
+	u->probegens = 0;
+	u->chunk = AUTO_CHUNK;
+	pthread_mutex_lock(&unilock);
+	u->next = universes;
+	universes = u;
+	pthread_mutex_unlock(&unilock);
+	return u;
+}
+
+void universe_free(Universe *u){
+	pthread_mutex_lock(&unilock);
+	for (Universe **link = &universes; *link; link = &(*link)->next)
+		if (*link == u){
+			*link = u->next;
+			break;
+		}
+	pthread_mutex_unlock(&unilock);
+	tiles_free(u->tiles);
+	free(u);
+}
+
+void universe_set(Universe *u, Node *root){
+	engine_enter();
+	u->root = root;
+	u->gen = 0;
+	tiles_free(u->tiles);
+	u->tiles = NULL;
+	u->tilegens = 0;
+	u->probes = u->hits = 0;
+	u->probegens = 0;
+	engine_leave();
+}
+
+static Node *sync_root(Universe *u){
+	// Caller is inside an engine section
+	if (u->root == NULL)
+		u->root = tiles_to_node(u->tiles);
+	return u->root;
+}
+
+static void to_tiles(Universe *u){
+	if (u->tiles == NULL && (u->tiles = tiles_from_node(u->root)) == NULL)
+		return; // out of memory, successor() carries on
+	u->tilegens = 0;
+	log_info("Universe at generation %lld moved to tiles", (long long)u->gen);
+}
+
+static void to_nodes(Universe *u){
+	sync_root(u);
+	tiles_free(u->tiles);
+	u->tiles = NULL;
+	u->probes = u->hits = 0;
+	u->probegens = 0;
+	log_info("Universe at generation %lld moved to nodes", (long long)u->gen);
+}
+
+void universe_set_engine(Universe *u, int engine){
+	// Cells move over to the new engine on the next universe_advance()
+	engine_enter();
+	u->engine = engine;
+	if (engine == ENGINE_HASHLIFE && u->tiles)
+		to_nodes(u);
+	engine_leave();
+}
+
+int universe_engine(Universe *u){
+	// The engine stepping the cells, ENGINE_AUTO runs one of the other two
+	return u->engine == ENGINE_TILE || u->tiles ? ENGINE_TILE : ENGINE_HASHLIFE;
+}
+
+Node *universe_root(Universe *u){
+	// The cells as a root, built from the tiles if they moved on since the last one
+	engine_enter();
+	Node *root = sync_root(u);
+	engine_leave();
+	return root;
+}
+
+static void advance_auto(Universe *u, int64_t n){
+	// One chunk of ENGINE_AUTO. A memo miss costs a successor() of its own, so the
+	// memo hit rate gives the work per generation. Once that costs more than stepping
+	// every tile, tiles take over, and hand back every AUTO_RETRY generations
+	if (u->tiles){
+		tiles_step(u->tiles, n, u->rule);
+		u->root = NULL;
+		if ((u->tilegens += n) >= AUTO_RETRY)
+			to_nodes(u);
+		return;
+	}
+	uint64_t probes = memoprobes, hits = memohits;
+	u->root = advance(u->root, n, u->rule);
+	u->probes += memoprobes - probes;
+	u->hits += memohits - hits;
+	u->probegens += n;
+	if (u->probes < AUTO_MIN_PROBES)
+		return;
+	int64_t misses = (int64_t)(u->probes - u->hits) / u->probegens;
+	if (misses > AUTO_MISSES_PER_TILE * tiles_count(u->root, misses / AUTO_MISSES_PER_TILE + 1)){
+		to_tiles(u);
+		u->chunk = AUTO_CHUNK;
+	} else {
+		u->chunk = min(2 * u->chunk, AUTO_MAX_CHUNK); // big jumps are where successor() shines
+	}
+	u->probes = u->hits = 0;
+	u->probegens = 0;
+}
+
+void universe_advance(Universe *u, int64_t n){
+	// A universe belongs to one thread at a time, different universes can be
+	// advanced concurrently. ENGINE_AUTO goes a chunk at a time so it can switch
+	// engines in between, the others take up to ADVANCE_MAX generations at once
+	while (n > 0){
+		int64_t step = min(n, u->engine == ENGINE_AUTO ? u->chunk : ADVANCE_MAX);
+		engine_enter();
+		if (u->engine == ENGINE_AUTO){
+			advance_auto(u, step);
+		} else if (u->engine == ENGINE_TILE){
+			if (u->tiles == NULL)
+				to_tiles(u);
+			if (u->tiles){
+				tiles_step(u->tiles, step, u->rule);
+				u->root = NULL;
+			} else {
+				u->root = advance(u->root, step, u->rule);
+			}
+		} else {
+			u->root = advance(u->root, step, u->rule);
+		}
+		engine_leave();
+		u->gen += step;
+		n -= step;
+		gc_maybe();
+	}
+}
+
+Hash128 universe_hash(Universe *u){
+	// Content hash of the universe, whatever empty border it carries. Equal
+	// hashes mean equal cells around the same centre, in this process or another
+	engine_enter();
+	Hash128 h = shrink(sync_root(u))->hash;
+	engine_leave();
+	return h;
+}
+
+uint64_t universe_population(Universe *u){
+	return u->root ? u->root->n : tiles_population(u->tiles);
+}
+
+int universe_bbox(Universe *u, BBox *box){
+	// Bounding box relative to the centre of the universe
+	engine_enter();
+	Node *root = sync_root(u);
+	int found = bbox(root, box);
+	engine_leave();
+	if (found){
+		int64_t half = (int64_t)1 << (root->k - 1);
+		box->x0 -= half; box->x1 -= half;
+		box->y0 -= half; box->y1 -= half;
+	}
+	return found;
+}
+
+int rule_parse(const char *s, unsigned *rule){
+	// "B3/S23" style rule strings. B0 rules need the background to flip every
+	// generation, which empty subtrees can't express, so they are refused
+	unsigned r = 0;
+	int shift = -1;
+	for (; *s; s++){
+		if (*s == 'B' || *s == 'b')
+			shift = 0;
+		else if (*s == 'S' || *s == 's')
+			shift = RULE_SURVIVE;
+		else if (*s >= '0' && *s <= '8' && shift >= 0)
+			r |= 1u << (shift + *s - '0');
+		else if (*s != '/' && *s != ' ' && *s != '\n' && *s != '\r')
+			return -1;
+	}
+	if (r & 1)
+		return -1;
+	*rule = r;
+	return 0;
+}
+
+void rule_plan(RulePlan *plan, unsigned rule){
+	plan->len = 0;
+	for (int n = 0; n <= 8; n++){
+		int born = (rule >> n) & 1, stays = (rule >> (RULE_SURVIVE + n)) & 1;
+		if (!born && !stays)
+			continue;
+		plan->count[plan->len] = n;
+		plan->born[plan->len] = born ? ~(uint64_t)0 : 0;
+		plan->stays[plan->len] = stays ? ~(uint64_t)0 : 0;
+		plan->len++;
+	}
+}
+
+void rule_format(unsigned rule, char *buf, size_t len){
+	// The "B3/S23" form of rule, the one rule_parse() reads
+	char s[24];
+	int n = 0;
+	s[n++] = 'B';
+	for (int i = 0; i <= 8; i++)
+		if (rule & (1u << i))
+			s[n++] = '0' + i;
+	s[n++] = '/';
+	s[n++] = 'S';
+	for (int i = 0; i <= 8; i++)
+		if (rule & (1u << (RULE_SURVIVE + i)))
+			s[n++] = '0' + i;
+	s[n] = '\0';
+	snprintf(buf, len, "%s", s);
+}
+
+
 /*** Utilities ***/
 int is_padded(Node *p){
 	if (p->k < 3)
 		return 0;
 	else 	
-		return (
-				p->a->n == p->a->d->d->n
-				&& p->b->n == p->b->c->c->n
-				&& p->c->n == p->c->b->b->n
-				&& p->d->n == p->d->a->a->n);
+		return is_centred(p, 2);
+}
+
+static int count_unmarked(Node *p){
+	if (p == NULL || p->k == 0 || p->mark)
+		return 0;
+	p->mark = 1;
+	if (p->packed)
+		return 1;
+	return 1 + count_unmarked(p->a) + count_unmarked(p->b) + count_unmarked(p->c) + count_unmarked(p->d);
+}
+
+static void unmark(Node *p){
+	if (p == NULL || p->k == 0 || !p->mark)
+		return;
+	p->mark = 0;
+	if (p->packed)
+		return;
+	unmark(p->a);
+	unmark(p->b);
+	unmark(p->c);
+	unmark(p->d);
+}
+
+int node_count(Node *p, Node *shared){
+	// Number of distinct nodes reachable from p but not from shared (NULL to count all of p).
+	// Borrows the GC mark bits, so it excludes gc() and engine sections like gc() does
+	pthread_rwlock_wrlock(&worldlock);
+	gc_mark(shared);
+	int n = count_unmarked(p);
+	unmark(shared);
+	unmark(p);
+	pthread_rwlock_unlock(&worldlock);
+	return n;
+}
+
+typedef struct {
+	Node **tab; // open addressing, NULL for empty slots
+	size_t cap, len;
+} NodeSet;
+
+static int nodeset_add(NodeSet *set, Node *p){
+	// 1 if p wasn't in the set yet. Without memory to grow, everything counts as new
+	if (2 * (set->len + 1) > set->cap){
+		NodeSet bigger = {.cap = set->cap ? 2 * set->cap : 64, .len = set->len};
+		if ((bigger.tab = calloc(bigger.cap, sizeof(Node *))) == NULL)
+			return 1;
+		for (size_t i = 0; i < set->cap; i++)
+			if (set->tab[i])
+				nodeset_add(&bigger, set->tab[i]);
+		free(set->tab);
+		*set = bigger;
+	}
+	size_t mask = set->cap - 1, i = ((uintptr_t)p >> 4) * 0x9e3779b97f4a7c15ULL & mask;
+	while (set->tab[i] && set->tab[i] != p)
+		i = (i + 1) & mask;
+	if (set->tab[i])
+		return 0;
+	set->tab[i] = p;
+	set->len++;
+	return 1;
+}
+
+static size_t diff_bytes(Node *p, Node *q, NodeSet *seen){
+	// Bytes of the nodes of p on the paths where it differs from q, of the same level,
+	// each node once
+	if (p == q || p->n == 0 || p->k == 0 || !nodeset_add(seen, p))
+		return 0;
+	if (p->packed)
+		return sizeof(Node) + PACKED_BYTES;
+	Node *c[4];
+	node_quads(q, c);
+	return sizeof(Node) + diff_bytes(p->a, c[0], seen) + diff_bytes(p->b, c[1], seen)
+		+ diff_bytes(p->c, c[2], seen) + diff_bytes(p->d, c[3], seen);
+}
+
+size_t edit_bytes(Node *before, Node *after){
+	// Bytes only an undo entry for before keeps alive once an edit made after: the new
+	// nodes along the paths where they differ, one per level for a single cell. after
+	// may have grown around before, as the editor centres the root to make room
+	while (after->k > before->k)
+		after = inner(after);
+	if (after->k < before->k)
+		return node_count(before, after) * sizeof(Node);
+	NodeSet seen = {0};
+	size_t bytes = diff_bytes(before, after, &seen);
+	free(seen.tab);
+	return bytes;
 }
 
 Node *inner(Node *p){
-	return join(p->a->d, p->b->c, p->c->b, p->d->a);
+	return join(inner_quad(p, 0, 1), inner_quad(p, 1, 1), inner_quad(p, 2, 1), inner_quad(p, 3, 1));
 }
 
 Node *crop(Node *p){
@@ -367,12 +2151,13 @@ Node *crop(Node *p){
 }
 
 Node *centre(Node *p){
-	Node *z = get_zero(p->k - 1);
+	Node *z = get_zero(p->k - 1), *q[4];
+	node_quads(p, q);
 	return join(
-			join(z, z, z, p->a),
-			join(z, z, p->b, z),
-			join(z, p->c, z, z),
-			join(p->d, z, z, z));
+			join(z, z, z, q[0]),
+			join(z, z, q[1], z),
+			join(z, q[2], z, z),
+			join(q[3], z, z, z));
 }
 
 Node *pad(Node *p){
@@ -400,6 +2185,8 @@ int next_prime(int i) {
 }
 
 /*** Tests ***/
+static int **testgrid; // what the tests expand() into
+
 void test_get_zero(){
 	Node *p = get_zero(3);
 	print_node(p);
@@ -430,7 +2217,7 @@ void test_life(){
 	Node *p =life(
 			OFF, ON, OFF,
 			ON , OFF, ON, 
-			OFF, OFF, OFF);
+			OFF, OFF, OFF, RULE_LIFE);
 	print_node(p);
 }
 
@@ -451,10 +2238,10 @@ void test_life4x4(){
 
 	Node *p = construct(points, 4);
 	log_info("The constructed node is: "); print_node(p);
-	expand(p, 0, 0);
-	p = life4x4(p);
+	expand(p, 0, 0, testgrid, TEST_GRID_SIZE, TEST_GRID_SIZE);
+	p = life4x4(p, RULE_LIFE);
 	log_info("The out node is: "); print_node(p);
-	expand(p, 0, 0);
+	expand(p, 0, 0, testgrid, TEST_GRID_SIZE, TEST_GRID_SIZE);
 }
 
 
@@ -463,7 +2250,7 @@ void test_centre(){
 	log_info("Node before centre: "); print_node(p);
 	p = centre(p);
 	log_info("Node after centre: "); print_node(p);
-	expand(p, 0, 0);
+	expand(p, 0, 0, testgrid, TEST_GRID_SIZE, TEST_GRID_SIZE);
 }
 
 
@@ -472,7 +2259,7 @@ void test_pad(){
 	log_info("Node before centre: "); print_node(p);
 	p = pad(p);
 	log_info("Node after centre: "); print_node(p);
-	expand(p, 0, 0);
+	expand(p, 0, 0, testgrid, TEST_GRID_SIZE, TEST_GRID_SIZE);
 }
 
 
@@ -481,13 +2268,13 @@ void test_successor(){
 
 	Node *p = construct(points, 5);
 	log_info("Before update: "); print_node(p);
-	expand(p, 0, 0);
-	p = successor(p, 0);
+	expand(p, 0, 0, testgrid, TEST_GRID_SIZE, TEST_GRID_SIZE);
+	p = successor(p, -1, RULE_LIFE);
 	log_info("After update1: ");print_node(p);
-	expand(p, 0, 0);
-	p = successor(p, 0);
+	expand(p, 0, 0, testgrid, TEST_GRID_SIZE, TEST_GRID_SIZE);
+	p = successor(p, -1, RULE_LIFE);
 	log_info("After update2: ");print_node(p);
-	expand(p, 0, 0);
+	expand(p, 0, 0, testgrid, TEST_GRID_SIZE, TEST_GRID_SIZE);
 
 }
 
@@ -500,19 +2287,11 @@ void test_new_collided(){
 	printf("Popullation needs to be 0: "); print_node(hashtab[2]); // n2
 	printf("Popullation needs to be 4: "); print_node(hashtab[2]->next); // n1
 	//print_node(hashtab[2]->next->next); // NULL
-	expand(n2, 0, 0);
+	expand(n2, 0, 0, testgrid, TEST_GRID_SIZE, TEST_GRID_SIZE);
 }
 
-void init_e(){
-	E.cx = 0;
-	E.cy = 0;
-	E.gridrows=58;
-	E.gridcols=238;
-	E.screenrows=58;
-	E.screencols=238;
-
-	E.grid = calloc( E.gridcols, sizeof(int *) );
-	for ( int i = 0; i < E.gridcols; i++ )
-		E.grid[i] = calloc( E.gridrows, sizeof(int) );
+void init_testgrid(){
+	testgrid = calloc(TEST_GRID_SIZE, sizeof(int *));
+	for (int i = 0; i < TEST_GRID_SIZE; i++)
+		testgrid[i] = calloc(TEST_GRID_SIZE, sizeof(int));
 }
-
@@ -5,22 +5,71 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <string.h>
+#include <stdint.h>
 #include <math.h>
 #include <termios.h>
-#include "lifeterm.h"
+#include <pthread.h>
 #include "log.h"
 #include <limits.h>
 
+#define MAX_ITER_LEVEL 64 // deepest node a CellIter can walk
+#define MAX_LEVEL 62 // highest node level, so sides and offsets fit an int64_t
+
 /*** Structs ***/
+typedef struct {
+	uint64_t lo, hi;
+} Hash128;
+
 typedef struct Node Node;
 typedef struct Node {
 	unsigned int n; // number of live cells. Max 4,294,967,295
 	unsigned short k; // level. Max 65,535
+	unsigned char mark; // reachable from a GC root, only set during gc()
+	unsigned char packed; // a dense PACK_LEVEL node stored as a bitmap, see leaf_bits()
 	Node *next; // Chaining to handle hash collision
-	Node *a; // top left
+	Node *a; // top left, or the rows of a packed node
 	Node *b; // top right
 	Node *c; // bottom left
 	Node *d; // bottom right
+	Hash128 hash; // content hash, see content_hash()
+};
+
+typedef void (*GCRootFn)(void *udata);
+typedef void (*JoinTraceFn)(Node *a, Node *b, Node *c, Node *d);
+typedef int (*UntilFn)(Node *p, unsigned rule, void *udata);
+
+typedef struct MemoEntry MemoEntry;
+struct MemoEntry {
+	Node *p;
+	Node *result; // successor(p, j) under rule
+	unsigned rule;
+	unsigned short j;
+	unsigned short epoch; // low bits of memoepoch when last stored or found, see memo_age()
+	MemoEntry *next;
+};
+
+typedef struct {
+	// The neighbour counts a rule does something for. born/stays are all ones where
+	// the count brings a dead cell to life/keeps a live one alive, see rule_plan()
+	int len;
+	int count[9];
+	uint64_t born[9], stays[9];
+} RulePlan;
+
+typedef struct Tiles Tiles; // see tile.h
+
+typedef struct Universe Universe;
+struct Universe {
+	Node *root; // centred on the origin like every root, NULL while tiles are ahead of it
+	int64_t gen;
+	unsigned rule; // birth counts in bits 0-8, survival counts from RULE_SURVIVE
+	int engine; // ENGINE_HASHLIFE, ENGINE_TILE or ENGINE_AUTO
+	Tiles *tiles; // the cells while the tile engine runs them, NULL otherwise
+	int64_t tilegens; // generations on tiles since ENGINE_AUTO last tried successor()
+	uint64_t probes, hits; // memo probes of successor() since ENGINE_AUTO last decided
+	int64_t probegens; // generations those probes stepped
+	int64_t chunk; // generations ENGINE_AUTO steps before deciding again
+	Universe *next;
 };
 
 typedef struct{
@@ -29,21 +78,96 @@ typedef struct{
 	Node *p;
 } MapNode;
 
+typedef struct {
+	int64_t x0, y0; // upper left, inclusive
+	int64_t x1, y1; // lower right, exclusive
+} BBox;
+
+typedef struct {
+	Node *p;
+	int64_t x, y; // upper left of p
+} IterFrame;
+
+typedef struct {
+	BBox rect;
+	int depth;
+	IterFrame stack[3 * MAX_ITER_LEVEL + 1]; // each level leaves at most 3 siblings behind
+	const uint64_t *leaf; // rows of the packed node being streamed
+	int64_t lx, ly; // its upper left
+	int row, rows; // next row to stream and the end of the rectangle's rows in it
+	uint64_t cols; // the rectangle's columns in it
+	uint64_t left; // cells of the row before row still to stream
+} CellIter;
+
 /*** Node operations ***/
 Node *get_zero(int k);
 Node *newnode(Node *a, Node *b, Node *c, Node *d);
 uintptr_t node_hash(Node *a, Node *b, Node *c, Node *d);
+Hash128 content_hash(const Node *a, const Node *b, const Node *c, const Node *d);
+int hash_equal(Hash128 x, Hash128 y);
+void hash_format(Hash128 h, char *buf, size_t len);
 Node *find_node(Node *a, Node *b, Node *c, Node *d);
 Node *join(const Node *a, const Node *b, const Node *c, const Node *d);
 Node *construct(int points[][2], int n);
-void mark(Node *node, int x, int y);
-void expand(Node *node, int x, int y);
+Node *mark(Node *node, int x, int y);
+void expand(Node *node, int x, int y, int **grid, int rows, int cols);
+void node_quads(Node *p, Node *q[4]);
+Node *leaf_pack(const uint64_t *rows);
 
 // For Update
-Node *successor(Node *p, int j);
-Node *advance(Node *p, int n);
-Node *life(Node *n1, Node *n2, Node *n3, Node *n4, Node *c, Node *n6, Node *n7, Node *n8, Node *n9);
-Node *life4x4(Node *p);
+Node *successor(Node *p, int j, unsigned rule);
+Node *advance(Node *p, int64_t n, unsigned rule);
+Node *advance_until(Node *p, int64_t limit, unsigned rule, UntilFn cond, void *udata, int monotone, int64_t *n);
+Node *life(Node *n1, Node *n2, Node *n3, Node *n4, Node *c, Node *n6, Node *n7, Node *n8, Node *n9, unsigned rule);
+Node *life4x4(Node *p, unsigned rule);
+Node *memo_get(Node *p, int j, unsigned rule);
+void memo_put(Node *p, int j, unsigned rule, Node *result);
+void memo_counters(uint64_t *probes, uint64_t *hits);
+
+/*** Garbage collection ***/
+int gc_add_root(GCRootFn fn, void *udata);
+void gc_remove_root(GCRootFn fn, void *udata);
+void gc_mark(Node *p);
+void gc_set_budget(size_t bytes);
+size_t gc_budget();
+size_t gc_usage();
+int gc();
+void gc_maybe();
+void engine_enter();
+void engine_leave();
+
+/*** Subtree operations ***/
+Node *block(Node *p, int64_t bx, int64_t by, int k);
+Node *shift(Node *a, Node *b, Node *c, Node *d, int64_t x, int64_t y);
+Node *subnode(Node *p, int64_t x, int64_t y, int k);
+Node *union_centred(Node *a, Node *b);
+Node *translate(Node *p, int64_t dx, int64_t dy);
+Node *node_or(Node *a, Node *b);
+Node *paste(Node *p, Node *clip, int64_t x, int64_t y);
+Node *copy_rect(Node *p, int64_t x, int64_t y, int64_t w, int64_t h);
+Node *clear_rect(Node *p, int64_t x, int64_t y, int64_t w, int64_t h);
+Node *stamp(Node *clip, int64_t nx, int64_t ny, int64_t sx, int64_t sy);
+
+/*** Queries ***/
+int bbox(Node *p, BBox *box);
+uint64_t population(Node *p, int64_t x, int64_t y, int64_t w, int64_t h);
+void cell_iter_init(CellIter *it, Node *p, int64_t x, int64_t y, int64_t w, int64_t h);
+int cell_iter_next(CellIter *it, int64_t *x, int64_t *y);
+
+/*** Universes ***/
+Universe *universe_new(Node *root, unsigned rule);
+void universe_free(Universe *u);
+void universe_set(Universe *u, Node *root);
+void universe_advance(Universe *u, int64_t n);
+void universe_set_engine(Universe *u, int engine);
+int universe_engine(Universe *u);
+Node *universe_root(Universe *u);
+Hash128 universe_hash(Universe *u);
+uint64_t universe_population(Universe *u);
+int universe_bbox(Universe *u, BBox *box);
+int rule_parse(const char *s, unsigned *rule);
+void rule_plan(RulePlan *plan, unsigned rule);
+void rule_format(unsigned rule, char *buf, size_t len);
 
 /*** View helpers ***/
 void init_hashtab();
@@ -51,23 +175,108 @@ void resize();
 
 /*** Utilities ***/
 int is_padded(Node *p);
+int64_t margin(Node *p);
+int node_count(Node *p, Node *shared);
+size_t edit_bytes(Node *before, Node *after);
 Node *inner(Node *p);
 Node *crop(Node *p);
+Node *shrink(Node *p);
 Node *centre(Node *p);
 Node *pad(Node *p);
 void print_node(const Node *p);
 int next_prime(int i);
 
 
+/*** Bitboards ***/
+static inline uint64_t step_row(const uint64_t w[3], const uint64_t m[3], const uint64_t e[3], const RulePlan *plan){
+	// One generation of the row m[1] of a bitboard. m holds the rows above, at and below,
+	// w and e the same rows shifted so bit i holds the cell left/right of cell i.
+	// The 8 neighbour planes are summed bit sliced into s0 + 2 s1 + 4 s2 + 8 s3
+	uint64_t a0 = w[0] ^ m[0] ^ e[0], a1 = (w[0] & m[0]) | (e[0] & (w[0] ^ m[0]));
+	uint64_t b0 = w[1] ^ e[1] ^ w[2], b1 = (w[1] & e[1]) | (w[2] & (w[1] ^ e[1]));
+	uint64_t c0 = m[2] ^ e[2], c1 = m[2] & e[2];
+	uint64_t s0 = a0 ^ b0 ^ c0, d1 = (a0 & b0) | (c0 & (a0 ^ b0));
+	uint64_t t1 = a1 ^ b1 ^ c1, t2 = (a1 & b1) | (c1 & (a1 ^ b1));
+	uint64_t s1 = t1 ^ d1, u2 = t1 & d1;
+	uint64_t s2 = t2 ^ u2, s3 = t2 & u2;
+
+	uint64_t next = 0;
+	for (int i = 0; i < plan->len; i++){
+		int n = plan->count[i];
+		uint64_t eq = (n & 1 ? s0 : ~s0) & (n & 2 ? s1 : ~s1) & (n & 4 ? s2 : ~s2) & (n & 8 ? s3 : ~s3);
+		next |= eq & ((plan->born[i] & ~m[1]) | (plan->stays[i] & m[1]));
+	}
+	return next;
+}
+
+
+/*** Packed leaves ***/
+static inline const uint64_t *leaf_bits(const Node *p){
+	// The PACK_SIZE rows of a packed node, bit x of row y is the cell (x, y).
+	// Its children aren't stored, node_quads() makes them when a walk needs them
+	return (const uint64_t *)(const void *)p->a;
+}
+
+
+/*** Globals ***/
+extern Node on, off; // the two level 0 nodes, see ON and OFF
+extern Node **hashtab;
+extern int hashsize;
+extern int nodecount;
+extern MemoEntry **memotab;
+extern int memosize;
+extern int memocount;
+#ifdef HASH_TRACE
+extern JoinTraceFn join_trace;
+#endif
+
 /*** Test ***/
 void test_new_collided();
+void init_testgrid();
 
 /*** Defines ***/
 #define MAX_DEPTH SHORT_MAX
-//#define MAX_NODES INT_MAX
-#define MAX_NODES INT_MAX
+#define HASH_INIT_SIZE (1 << 20) // buckets to start with, resize() doubles them as needed
+#define MEMO_INIT_SIZE (1 << 16)
+#define LOCK_STRIPES 1024
+#define TEST_GRID_SIZE 64
+#define RULE_SURVIVE 9 // bit of the first survival count in a rule
+#define RULE_LIFE ((1u << 3) | (1u << (RULE_SURVIVE + 2)) | (1u << (RULE_SURVIVE + 3))) // B3/S23
+#define MAX_GC_ROOTS 32
+#define SHIFT_CACHE_SIZE (1 << 16)
+#define GC_MIN_NODES (1 << 20) // don't bother collecting below this many nodes
+#define GC_KEEP 2 // a collection keeps memo results up to 1/GC_KEEP of the budget
+#define GC_ALLOC_OVERHEAD 16 // malloc's header, counted on memo entries and packed rows only, nodes come from the arena
+#define MEMO_RECENT_STEPS 64 // advance() calls a memo entry counts as recently used for
+#define MEMO_RECENT_BONUS 8 // levels a recently used entry is worth over a stale one
+#define MEMO_AGE_EVERY (1 << 14) // advance() calls between saturating memo ages, well under the 2^16 they wrap at
+#define BATCH_MAX 9 // most joins or memo probes successor() issues at once
+#define LEAF_LEVEL 4 // successor() steps nodes up to this level as bitboards, 3 to 5 work
+#define MEMO_MIN_LEVEL 4 // lowest level whose successors are memoized
+#define ADVANCE_MAX ((int64_t)1 << (MAX_LEVEL - 3)) // generations one advance() takes at most, universe_advance() goes in chunks of it
+#define UNTIL_SCAN 1024 // advance_until() steps a condition that isn't monotone one generation at a time over this many
+#define PACK_LEVEL 6 // level of packed leaves, one uint64_t per row
+#define PACK_SIZE (1 << PACK_LEVEL)
+#define PACK_MIN_BLOCKS 16 // non-empty 8x8 blocks a leaf needs to be packed
+#define PACK_DISTINCT 4 // and at most one in this many of them may repeat another
+#define PACKED_BYTES (PACK_SIZE * sizeof(uint64_t) + GC_ALLOC_OVERHEAD) // rows of a packed node, on top of the node
+#define PHASE_NINE 0
+#define PHASE_FOUR 1
+#define ENGINE_HASHLIFE 0
+#define ENGINE_TILE     1
+#define ENGINE_AUTO     2 // hashlife, or tiles while the memo misses more than tiles would cost
+#define AUTO_CHUNK 1024 // generations between ENGINE_AUTO decisions, doubling while successor() wins
+#define AUTO_MAX_CHUNK ADVANCE_MAX
+#define AUTO_MIN_PROBES 4096 // memo probes to see before deciding
+#define AUTO_MISSES_PER_TILE 1 // memo misses a generation may cost per tile before tiles take over
+#define AUTO_RETRY (16 * AUTO_CHUNK) // generations on tiles before trying successor() again
 #define ON  &on
 #define OFF &off
+#define SIDE_LEFT   0
+#define SIDE_RIGHT  1
+#define SIDE_TOP    2
+#define SIDE_BOTTOM 3
 #define min(a, b) (((a) < (b)) ? (a) : (b))
+#define max(a, b) (((a) > (b)) ? (a) : (b))
 
 #endif
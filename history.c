@@ -0,0 +1,85 @@
+#include "history.h"
+
+void history_init(History *h){
+	h->len = 0;
+	h->pos = -1;
+}
+
+static void history_remove(History *h, int i){
+	memmove(&h->entries[i], &h->entries[i + 1], (h->len - i - 1) * sizeof(Snapshot));
+	h->len--;
+	if (h->pos >= i)
+		h->pos--;
+}
+
+static void history_thin(History *h){
+	// Drop the old snapshot whose removal leaves the smallest gap relative to its age,
+	// which keeps the spacing roughly geometric: every step recently, every 2^k further back
+	int newest = h->len - 1;
+	int best = -1;
+	double bestcost = 0;
+	for (int i = 1; i < h->len - HISTORY_RECENT; i++){
+		if (i == h->pos)
+			continue;
+		double gap = (double)(h->entries[i + 1].gen - h->entries[i - 1].gen);
+		double age = (double)(h->entries[newest].gen - h->entries[i].gen) + 1;
+		if (best == -1 || gap / age < bestcost){
+			best = i;
+			bestcost = gap / age;
+		}
+	}
+	history_remove(h, best == -1 ? 0 : best);
+}
+
+static int history_find(History *h, int64_t gen){
+	// First entry at or after gen
+	int i = 0;
+	while (i < h->len && h->entries[i].gen < gen)
+		i++;
+	return i;
+}
+
+void history_push(History *h, Node *root, int64_t gen){
+	// Insert in generation order and make it the current entry. Later snapshots are kept,
+	// stepping is deterministic so they are still the future of this one
+	int i = history_find(h, gen);
+	if (i < h->len && h->entries[i].gen == gen){
+		h->entries[i].root = root;
+		h->pos = i;
+		return;
+	}
+
+	if (h->len == HISTORY_SIZE){
+		history_thin(h);
+		i = history_find(h, gen);
+	}
+	memmove(&h->entries[i + 1], &h->entries[i], (h->len - i) * sizeof(Snapshot));
+	h->entries[i] = (Snapshot){.root = root, .gen = gen};
+	h->len++;
+	h->pos = i;
+}
+
+void history_truncate(History *h, int64_t gen){
+	// The universe at gen was edited, snapshots from there on are no longer its future
+	int i = history_find(h, gen);
+	h->len = i;
+	h->pos = min(h->pos, h->len - 1);
+}
+
+Snapshot *history_step(History *h, int delta){
+	// Move the current entry by delta snapshots, clamped to the ends
+	if (h->len == 0)
+		return NULL;
+	h->pos = max(0, min(h->len - 1, h->pos + delta));
+	return &h->entries[h->pos];
+}
+
+Snapshot *history_next(History *h){
+	return h->pos + 1 < h->len ? &h->entries[h->pos + 1] : NULL;
+}
+
+void history_mark(void *udata){
+	History *h = udata;
+	for (int i = 0; i < h->len; i++)
+		gc_mark(h->entries[i].root);
+}
@@ -0,0 +1,30 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+#include "hashlife.h"
+
+/*** Defines ***/
+#define HISTORY_SIZE 256
+#define HISTORY_RECENT 64 // newest snapshots are all kept, older ones get thinned out
+
+/*** Structs ***/
+// The DAG is immutable, so a whole generation is just its root
+typedef struct {
+	Node *root;
+	int64_t gen;
+} Snapshot;
+
+typedef struct {
+	Snapshot entries[HISTORY_SIZE]; // sorted by generation
+	int len;
+	int pos; // entry currently shown
+} History;
+
+/*** History ***/
+void history_init(History *h);
+void history_push(History *h, Node *root, int64_t gen);
+void history_truncate(History *h, int64_t gen);
+Snapshot *history_step(History *h, int delta);
+Snapshot *history_next(History *h);
+void history_mark(void *h);
+
+#endif
@@ -1,5 +1,7 @@
 #include "lifeterm.h"
 
+struct editorConfig E;
+
 /*** terminal ***/
 void clearScreen() {
 	write(STDOUT_FILENO, "\x1b[2J", 4); //4 means write 4 bytes out to terminal
@@ -43,19 +45,116 @@ void enableRawMode(){
 	// ISIG : prevent Ctrl-C, -Z to send sign
 	// IEXTEN : prevent effect of Ctrl-V, -O
 	raw.c_cc[VMIN] = 0;
-	raw.c_cc[VTIME] = 1; // interval between reads
+	raw.c_cc[VTIME] = 0; // never block in read(), poll() tells us when input is ready
 
 	tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
 }
 
 
-int editorReadKey() {
-	// Wait for user input
-	int nread;
-	char c;
-	while ((nread = read(STDIN_FILENO, &c, 1)) != 1){
-		if (nread == -1 && errno != EAGAIN) die("read");
+/*** event loop ***/
+static char inbuf[INPUT_BUFSIZE]; // bytes read from stdin but not yet decoded into keys
+static int inlen = 0, inpos = 0;
+static int wakefd[2] = {-1, -1}; // self-pipe, lets signal handlers and producers wake up poll()
+static volatile sig_atomic_t winch = 0;
+
+static long long nowMs(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void editorWake(){
+	// async-signal-safe: a full pipe already means a wake up is pending
+	int saved = errno;
+	if (wakefd[1] != -1)
+		write(wakefd[1], "x", 1);
+	errno = saved;
+}
+
+static void handleSigwinch(int sig){
+	(void)sig;
+	winch = 1;
+	editorWake();
+}
+
+void initEventLoop(){
+	if (pipe(wakefd) == -1) die("pipe");
+	for (int i = 0; i < 2; i++){
+		fcntl(wakefd[i], F_SETFL, fcntl(wakefd[i], F_GETFL) | O_NONBLOCK);
+		fcntl(wakefd[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handleSigwinch;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGWINCH, &sa, NULL) == -1) die("sigaction");
+}
+
+int editorFillInput(int timeout){
+	// Read whatever stdin has into inbuf, waiting at most timeout ms (-1 forever) for it.
+	// Returns the number of bytes read
+	if (inpos > 0){
+		memmove(inbuf, inbuf + inpos, inlen - inpos);
+		inlen -= inpos;
+		inpos = 0;
+	}
+	if (inlen == INPUT_BUFSIZE)
+		return 0;
+
+	struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+	if (poll(&pfd, 1, timeout) <= 0)
+		return 0;
+
+	int nread = read(STDIN_FILENO, inbuf + inlen, INPUT_BUFSIZE - inlen);
+	if (nread == -1 && errno != EAGAIN && errno != EINTR) die("read");
+	if (nread <= 0)
+		return 0;
+	inlen += nread;
+	return nread;
+}
+
+void editorPollEvents(){
+	// Sleep until there is input, a wake up or the next frame is due. Never spins while idle
+	int timeout = -1;
+	if (E.playing){
+		long long left = E.nextframe - nowMs();
+		timeout = left > 0 ? (int)left : 0;
+	}
+
+	struct pollfd fds[2] = {
+		{.fd = STDIN_FILENO, .events = POLLIN},
+		{.fd = wakefd[0], .events = POLLIN},
+	};
+	if (poll(fds, 2, timeout) == -1){
+		if (errno == EINTR) return;
+		die("poll");
+	}
+
+	if (fds[1].revents & POLLIN){
+		char drain[64];
+		while (read(wakefd[0], drain, sizeof(drain)) > 0);
+	}
+	if (fds[0].revents & (POLLIN | POLLHUP))
+		editorFillInput(0);
+
+	if (winch){
+		winch = 0;
+		editorResize();
 	}
+	if (E.playing && nowMs() >= E.nextframe){
+		E.nextframe = nowMs() + FRAME_INTERVAL_MS;
+		gridUpdate();
+	}
+}
+
+int editorReadKey() {
+	// Decode the next key from the input buffer, -1 if there is none
+	if (inpos == inlen)
+		return -1;
+	char c = inbuf[inpos++];
+	if (E.prompting && c != '\x1b')
+		return c;
 
 	// handle upper case cursor moving
 	switch(c){
@@ -86,29 +185,58 @@ int editorReadKey() {
 
 		case 'n':
 		case 'u': return STEP;
+		case 'p': return PLAY;
+		case 'f': return FOCUS;
+		case 'e': return JUMP;
+		case ',': return BACK;
+		case '.': return FORWARD;
+		case '<': return FAST_BACK;
+		case '>': return FAST_FORWARD;
+		case 'z': return UNDO;
+		case 'v': return SELECT;
+		case 'y': return COPY;
+		case 'c': return CUT;
+		case 'P': return PASTE;
+		case 'T': return STAMP;
+		case 'Z': return REDO;
 		case 'r': return ERASE;
+		case ':': return PROMPT;
 
 		case 'Q':
 		case 'q': return QUIT;
 	}
 
 	if (c == '\x1b') {
-		char seq[3];
-		// These 2 reads are to ensure after ~ 0.1 second after user pressed a key starts with Esc
-		// The next 2 bytes are belong to arrow keys
-		// Note that arrow key is an Esc key with a char : A,B,C,D. E.g : \x1b[A
-		if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-		if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+		// Arrow key is an Esc key with a char : A,B,C,D. E.g : \x1b[A
+		// The terminal sends the whole sequence in one burst, so only wait a little
+		// when Esc is the last byte we have, to tell a lone Esc from a split sequence
+		if (inlen - inpos < 2)
+			editorFillInput(ESC_TIMEOUT_MS);
+		if (inlen - inpos < 2) return '\x1b';
 
 		// moving cursor keys
-		if (seq[0] == '[' ) {
+		if (inbuf[inpos] == '[' ) {
 			// arrow keys
-			switch (seq[1]) {
-				case 'A': return ARROW_UP; // \x1b[A -> up arrows
-				case 'B': return ARROW_DOWN; // \x1b[B -> down arrows
-				case 'C': return ARROW_RIGHT;
-				case 'D': return ARROW_LEFT;
+			int key = 0;
+			switch (inbuf[inpos + 1]) {
+				case 'A': key = ARROW_UP; break; // \x1b[A -> up arrows
+				case 'B': key = ARROW_DOWN; break; // \x1b[B -> down arrows
+				case 'C': key = ARROW_RIGHT; break;
+				case 'D': key = ARROW_LEFT; break;
+			}
+			if (key){
+				inpos += 2;
+				return key;
+			}
+			// Anything else is dropped whole, parameters and all, up to its final byte
+			int i = 1;
+			while (inpos + i < inlen || editorFillInput(ESC_TIMEOUT_MS) > 0){
+				unsigned char b = inbuf[inpos + i++];
+				if (b >= 0x40 && b <= 0x7e)
+					break;
 			}
+			inpos += i;
+			return NO_KEY;
 		}
 		return '\x1b';
 	} else {
@@ -125,6 +253,8 @@ int getCursorPosition(int *rows, int*cols){
 
 	while(i < sizeof(buf) -1 ) { // after sending command. This is how we read the response
 		// The response will have format : rows;colsR
+		struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+		if (poll(&pfd, 1, 1000) <= 0) break;
 		if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
 		if (buf[i] == 'R') break; // break until we read the R char
 		i++;
@@ -177,20 +307,224 @@ void pushRoot(){
 }
 
 void gridMark(){
+	Node *before = E.root;
 	while(E.cx/2 - E.ox - E.offx < 0 || E.cy - E.oy - E.offy < 0 ||
-		E.cx/2 - E.ox - E.offx > (1 << E.root->k) || E.cy - E.oy - E.offy > (1 << E.root->k))
+		E.cx/2 - E.ox - E.offx >= (1 << E.root->k) || E.cy - E.oy - E.offy >= (1 << E.root->k))
 		pushRoot();
 
   int x = E.cx/2 - E.ox - E.offx;
   int y = E.cy - E.oy - E.offy;
-	mark(E.root, x, y);
+	E.root = mark(E.root, x, y);
+	undoPush(before);
 
-	gridRender();
+	gridEdited();
+}
+
+void gridEdited(){
+	// The universe was changed by hand, the generations seen so far don't lead to it
+	cycle_reset(&E.cycle);
+	cycle_record(&E.cycle, E.root, E.gen);
+	history_truncate(&E.history, E.gen);
+	history_push(&E.history, E.root, E.gen);
+	stats_record(&E.stats, E.root, E.gen, 0, 0);
+	gc_maybe();
+	E.dirty |= DIRTY_GRID;
+}
+
+void undoPush(Node *before){
+	// Call once the edit is made: the entry costs the nodes of before that the new
+	// root doesn't share, about one per level for a single cell
+	undo_push(&E.undo, before, E.gen, edit_bytes(before, E.root));
+}
+
+void gridUndo(int redo){
+	Node *root = E.root;
+	int64_t gen = E.gen;
+	if (!(redo ? undo_redo : undo_undo)(&E.undo, &root, &gen))
+		return;
+	E.root = root;
+	E.gen = gen;
+	gridEdited();
+}
+
+void gridJump(){
+	// Skip JUMP_GENERATIONS ahead analytically once the pattern is known to repeat
+	if (!E.cycle.found)
+		return;
+	int last_k = E.root->k;
+	uint64_t probes, hits, probes2, hits2;
+	memo_counters(&probes, &hits);
+	E.root = cycle_jump(&E.cycle, E.root, E.gen, E.gen + JUMP_GENERATIONS, E.rule);
+	memo_counters(&probes2, &hits2);
+	E.gen += JUMP_GENERATIONS;
+	history_push(&E.history, E.root, E.gen);
+	log_info("Jumped to generation %lld", (long long)E.gen);
+	// the cycle still holds but the recorded generations are behind us now
+	Cycle c = E.cycle;
+	cycle_reset(&E.cycle);
+	E.cycle.found = 1;
+	E.cycle.start = E.gen;
+	E.cycle.period = c.period;
+	E.cycle.dx = c.dx;
+	E.cycle.dy = c.dy;
+	gridStepped(last_k, probes2 - probes, hits2 - hits);
+}
+
+void gridGoto(Node *root, int64_t gen, uint64_t probes, uint64_t hits){
+	// Show root as generation gen, reached by a jump rather than a step
+	int last_k = E.root->k;
+	E.root = root;
+	E.gen = gen;
+	history_push(&E.history, E.root, E.gen);
+	cycle_reset(&E.cycle);
+	gridStepped(last_k, probes, hits);
+}
+
+void gridGeneration(int64_t gen){
+	// Jump to generation gen, one successor() per set bit of the distance. Earlier
+	// generations start from the last snapshot before them
+	Node *from = E.root;
+	int64_t fromgen = E.gen;
+	if (gen < E.gen){
+		Snapshot *s = NULL;
+		for (int i = 0; i < E.history.len && E.history.entries[i].gen <= gen; i++)
+			s = &E.history.entries[i];
+		if (s == NULL){
+			snprintf(E.message, sizeof(E.message), "Generation %lld is before the history", (long long)gen);
+			return;
+		}
+		from = s->root;
+		fromgen = s->gen;
+	}
+	if (gen - fromgen >= UNTIL_MAX_GENERATIONS){
+		snprintf(E.message, sizeof(E.message), "Can't jump more than 2^48 generations");
+		return;
+	}
+	uint64_t probes, hits, probes2, hits2;
+	memo_counters(&probes, &hits);
+	Node *root = advance(from, gen - fromgen, E.rule);
+	memo_counters(&probes2, &hits2);
+	gridGoto(root, gen, probes2 - probes, hits2 - hits);
+	snprintf(E.message, sizeof(E.message), "Generation %lld", (long long)gen);
+	log_info("Jumped to generation %lld", (long long)gen);
+}
+
+void gridUntil(UntilFn cond, void *udata, int monotone, const char *what){
+	// Run until cond holds, see advance_until(). The universe stays put if it doesn't
+	// within UNTIL_MAX_GENERATIONS
+	uint64_t probes, hits, probes2, hits2;
+	int64_t n;
+	memo_counters(&probes, &hits);
+	Node *root = advance_until(E.root, UNTIL_MAX_GENERATIONS, E.rule, cond, udata, monotone, &n);
+	memo_counters(&probes2, &hits2);
+	if (root == NULL){
+		snprintf(E.message, sizeof(E.message), "%s not reached within 2^48 generations", what);
+		return;
+	}
+	gridGoto(root, E.gen + n, probes2 - probes, hits2 - hits);
+	snprintf(E.message, sizeof(E.message), "%s at generation %lld", what, (long long)E.gen);
+	log_info("%s at generation %lld", what, (long long)E.gen);
+}
+
+void gridFocus(){
+	// Move the view so the live cells are at the center of the screen
+	BBox box;
+	if (!bbox(E.root, &box))
+		return;
+	E.offx = (1 << (E.root->k - 1)) - (int)((box.x0 + box.x1) / 2);
+	E.offy = (1 << (E.root->k - 1)) - (int)((box.y0 + box.y1) / 2);
+	E.dirty |= DIRTY_GRID;
+}
+
+void cursorCell(int64_t *x, int64_t *y){
+	// Cell under the cursor, relative to the centre of the universe (which never moves)
+	*x = E.cx/2 - E.screencols/2/2 - E.offx;
+	*y = E.cy - E.screenrows/2 - E.offy;
+}
+
+void selectionRect(int64_t *x, int64_t *y, int64_t *w, int64_t *h){
+	// Rectangle between the selection anchor and the cursor, both included
+	int64_t cx, cy;
+	cursorCell(&cx, &cy);
+	*x = min(cx, E.selx);
+	*y = min(cy, E.sely);
+	*w = max(cx, E.selx) - *x + 1;
+	*h = max(cy, E.sely) - *y + 1;
+}
+
+void gridFit(int64_t x, int64_t y, int64_t w, int64_t h){
+	// Grow the universe until it holds the rectangle
+	while (x < -((int64_t)1 << (E.root->k - 1)) || y < -((int64_t)1 << (E.root->k - 1)) ||
+			x + w > ((int64_t)1 << (E.root->k - 1)) || y + h > ((int64_t)1 << (E.root->k - 1)))
+		pushRoot();
+}
+
+void gridSelect(){
+	// Start a selection at the cursor, or drop the current one
+	E.selecting = !E.selecting;
+	cursorCell(&E.selx, &E.sely);
+	E.dirty |= DIRTY_SCREEN;
+}
+
+void gridCopy(int cut){
+	if (!E.selecting)
+		return;
+	int64_t x, y, w, h;
+	selectionRect(&x, &y, &w, &h);
+	int64_t half = (int64_t)1 << (E.root->k - 1);
+	E.clip = copy_rect(E.root, x + half, y + half, w, h);
+	E.clipw = w;
+	E.cliph = h;
+	E.selecting = 0;
+	log_info("Copied %lld x %lld, population %u", (long long)w, (long long)h, E.clip->n);
+
+	if (cut && E.clip->n > 0){
+		Node *before = E.root;
+		E.root = clear_rect(E.root, x + half, y + half, w, h);
+		undoPush(before);
+		gridEdited();
+	}
+	E.dirty |= DIRTY_SCREEN;
+}
+
+void gridPlace(Node *p, int64_t x, int64_t y){
+	// Add the cells of p with its upper left at (x, y), relative to the centre of the universe
+	gridFit(x, y, (int64_t)1 << p->k, (int64_t)1 << p->k);
+	int64_t half = (int64_t)1 << (E.root->k - 1);
+	Node *before = E.root;
+	E.root = paste(E.root, p, x + half, y + half);
+	undoPush(before);
+	gridEdited();
+}
+
+void gridPaste(){
+	if (E.clip == NULL)
+		return;
+	int64_t x, y;
+	cursorCell(&x, &y);
+	gridPlace(E.clip, x, y);
+}
+
+void gridStamp(){
+	// Fill the selection with copies of the clipboard, one every clipboard size
+	if (E.clip == NULL || !E.selecting)
+		return;
+	int64_t x, y, w, h;
+	selectionRect(&x, &y, &w, &h);
+	int64_t nx = max(1, w / E.clipw), ny = max(1, h / E.cliph);
+	Node *tiles = stamp(E.clip, nx, ny, E.clipw, E.cliph);
+	log_info("Stamping %lld x %lld copies", (long long)nx, (long long)ny);
+
+	E.selecting = 0;
+	gridPlace(tiles, x, y);
 }
 
 void emptyRoot(){
+	// everything the old universe doesn't share with an empty one stays alive for undo
+	Node *before = E.root;
   E.root = get_zero(E.root->k);
-  gridRender();
+	undoPush(before);
+  gridEdited();
 }
 void gridErase(){
 	// TODO : use memset to set values not for loop
@@ -201,32 +535,108 @@ void gridErase(){
 	}
 }
 
+void gridAlloc(){
+	E.grid = calloc( E.gridrows, sizeof(int *) );
+	if (E.grid == NULL) die("calloc");
+	for ( int i = 0; i < E.gridrows; i++ ){
+		E.grid[i] = calloc( E.gridcols, sizeof(int) );
+		if (E.grid[i] == NULL) die("calloc");
+	}
+}
+
+void gridFree(){
+	for ( int i = 0; i < E.gridrows; i++ )
+		free(E.grid[i]);
+	free(E.grid);
+	E.grid = NULL;
+}
+
+void editorResize(){
+	// Only the render buffers depend on the terminal size, the universe is left untouched
+	int rows, cols;
+	if (getWindowSize(&rows, &cols) == -1 || rows < 2 || cols < 2)
+		return;
+	if (rows == E.screenrows && cols == E.screencols)
+		return;
+
+	gridFree();
+	E.screenrows = rows;
+	E.screencols = cols;
+	E.gridrows = E.screenrows - 1; // status bar
+	E.gridcols = E.screencols / 2;
+	gridAlloc();
+
+	// keep the cursor on screen
+	if (E.cx > E.screencols - 2) E.cx = (E.screencols - 2) & ~1;
+	if (E.cy > E.gridrows - 1) E.cy = E.gridrows - 1;
+
+	gridUpdateOrigin();
+	clearScreen(); // rows of the old size may be left over at the bottom or right
+	E.dirty |= DIRTY_GRID | DIRTY_SCREEN;
+	log_info("Resized to %d x %d", E.screenrows, E.screencols);
+}
+
 void gridUpdate(){
 	int last_k = E.root->k;
 	int step = pow(2, E.basestep);
-	E.root = advance(E.root, step);
+	uint64_t probes = 0, hits = 0, probes2 = 0, hits2 = 0;
+	Snapshot *next = history_next(&E.history);
+	if (next && next->gen == E.gen + step){
+		// computed before we scrubbed back, no need to do it again
+		history_step(&E.history, 1);
+		E.root = next->root;
+		E.gen = next->gen;
+	} else {
+		memo_counters(&probes, &hits);
+		E.root = advance(E.root, step, E.rule);
+		E.gen += step;
+		history_push(&E.history, E.root, E.gen);
+		memo_counters(&probes2, &hits2);
+	}
+	gridStepped(last_k, probes2 - probes, hits2 - hits);
+}
+
+void gridStepped(int last_k, uint64_t probes, uint64_t hits){
+	// Once the root moved to another generation, however it got there: sample it,
+	// look for a cycle and maybe collect. last_k is the level of the root before
+	stats_record(&E.stats, E.root, E.gen, probes, hits);
+	if (cycle_record(&E.cycle, E.root, E.gen) && E.cycle.period == E.gen - E.cycle.start)
+		log_warn("Pattern repeats every %lld generations, moving (%lld, %lld)",
+				(long long)E.cycle.period, (long long)E.cycle.dx, (long long)E.cycle.dy);
 	if (last_k != E.root->k)
 		log_warn("Expanding universe (%dx%d). Depth:%d", 1 << E.root->k, 1 << E.root->k, E.root->k);
-	gridRender();
+	gc_maybe();
+	E.dirty |= DIRTY_GRID;
+}
+
+void gridScrub(int delta){
+	// Show an earlier or later snapshot of the timeline, nothing is recomputed
+	Snapshot *s = history_step(&E.history, delta);
+	if (s == NULL || s->root == E.root)
+		return;
+	int last_k = E.root->k;
+	E.root = s->root;
+	E.gen = s->gen;
+	cycle_reset(&E.cycle);
+	gridStepped(last_k, 0, 0);
 }
 
 void gridPlay(){
-	while(1){
-		int c = editorReadKey();
-		if (c == PLAY){
-			gridUpdate();
-			break;
-		}
-	}
+	// Toggle auto stepping, the event loop advances one step every FRAME_INTERVAL_MS
+	E.playing = !E.playing;
+	E.nextframe = nowMs();
+	E.dirty |= DIRTY_SCREEN;
 }
 
 
 void gridRender(){
 	// By default the the upper left of the node will be (0, 0). 
 	// In order to render consistently we push the orgin to the upper left as the level of Root increase.
+	PROFILE_START(start);
 	gridErase();
   gridUpdateOrigin();
-	expand(E.root, E.ox + E.offx, E.oy + E.offy);
+	expand(E.root, E.ox + E.offx, E.oy + E.offy, E.grid, E.gridrows, E.gridcols);
+	PROFILE_SPAN("gridRender", -1, start);
 }
 
 
@@ -289,11 +699,97 @@ void editorMoveCursor(int key){
 			else E.cy+=10;
 			break;
 	}
-	gridRender();
+	// Only flag the grid, so a burst of movement keys costs a single render
+	E.dirty |= DIRTY_GRID;
 }
 
-void editorProcessKeypress(){
-	int c = editorReadKey();
+/*** commands ***/
+static int untilPopAbove(Node *p, unsigned rule, void *udata){
+	(void)rule;
+	return p->n > *(uint64_t *)udata;
+}
+
+static int untilPopBelow(Node *p, unsigned rule, void *udata){
+	(void)rule;
+	return p->n < *(uint64_t *)udata;
+}
+
+static int untilSize(Node *p, unsigned rule, void *udata){
+	(void)rule;
+	BBox box;
+	int64_t size = *(int64_t *)udata;
+	return bbox(p, &box) && (box.x1 - box.x0 >= size || box.y1 - box.y0 >= size);
+}
+
+static int untilStable(Node *p, unsigned rule, void *udata){
+	// Same population over STABLE_REPEATS periods of STABLE_PERIOD generations. Gliders
+	// flying off don't change it, so a methuselah counts as settled once they are all
+	// that moves. A coincidence in the chaotic phase can stop the search early
+	(void)udata;
+	for (int i = 0; i < STABLE_REPEATS; i++){
+		Node *q = advance(p, STABLE_PERIOD, rule);
+		if (q->n != p->n)
+			return 0;
+		p = q;
+	}
+	return 1;
+}
+
+void editorRunCommand(const char *cmd){
+	// 'N' or '+N' jumps to a generation, absolute or ahead. 'pop > N', 'pop < N',
+	// 'size N' (either side of the bounding box) and 'stable' run until that holds
+	long long n;
+	char op, what[80];
+	E.message[0] = '\0';
+	while (*cmd == ' ')
+		cmd++;
+	if (*cmd == '\0')
+		return;
+	if (sscanf(cmd, "+%lld", &n) == 1 && n >= 0){
+		gridGeneration(E.gen + n);
+	} else if (isdigit((unsigned char)cmd[0]) && sscanf(cmd, "%lld", &n) == 1){
+		gridGeneration(n);
+	} else if (sscanf(cmd, "pop %c %lld", &op, &n) == 2 && n >= 0 && (op == '>' || op == '<')){
+		uint64_t pop = n;
+		snprintf(what, sizeof(what), "Population %c %lld", op, n);
+		gridUntil(op == '>' ? untilPopAbove : untilPopBelow, &pop, 0, what);
+	} else if (sscanf(cmd, "size %lld", &n) == 1 && n > 0){
+		int64_t size = n;
+		snprintf(what, sizeof(what), "Size %lld", n);
+		gridUntil(untilSize, &size, 1, what);
+	} else if (strcmp(cmd, "stable") == 0){
+		gridUntil(untilStable, NULL, 1, "Stable");
+	} else {
+		snprintf(E.message, sizeof(E.message), "Unknown command: %s", cmd);
+	}
+}
+
+void editorPromptKey(int c){
+	// Edit the ':' command line, Enter runs it and Esc drops it
+	int len = strlen(E.prompt);
+	if (c == '\r'){
+		E.prompting = 0;
+		editorRunCommand(E.prompt);
+	} else if (c == '\x1b'){
+		E.prompting = 0;
+	} else if (c == 127 || c == CTRL_KEY('h')){
+		if (len > 0)
+			E.prompt[len - 1] = '\0';
+	} else if (c >= ' ' && c < 127 && len < PROMPT_MAX - 1){
+		E.prompt[len] = c;
+		E.prompt[len + 1] = '\0';
+	}
+}
+
+void editorProcessKeypress(int c){
+	if (c == NO_KEY)
+		return;
+	E.dirty |= DIRTY_SCREEN;
+	if (E.prompting){
+		editorPromptKey(c);
+		return;
+	}
+	E.message[0] = '\0';
 	switch(c){
 		case QUIT:
 		case CTRL_KEY('q'):
@@ -303,6 +799,10 @@ void editorProcessKeypress(){
 		case ERASE:
       emptyRoot();
 			break;
+		case PROMPT:
+			E.prompting = 1;
+			E.prompt[0] = '\0';
+			break;
 		case ARROW_LEFT:
 		case ARROW_RIGHT:
 		case ARROW_UP:
@@ -333,108 +833,63 @@ void editorProcessKeypress(){
 		case PLAY:
 			gridPlay();
 			break;
-	}
-}
 
-Node *readPattern(char* filename){
-	FILE *fp;
-	char line[10000];
-	fp = fopen(filename, "r");
-	Node *root;
-	int indlen = 10;
-	int inode = 1;
-	Node **ind = (Node **)calloc(indlen, sizeof(Node *)); 
-	ind[0] = get_zero(2) ; /* allow zeros to work right */
-	while (fgets(line, 10000, fp) != NULL){
-		if(line[0] == '#' | line[0] == '[' | strlen(line) <=1) // Skip the Header and rule line
-			continue;
+		case FOCUS:
+			gridFocus();
+			break;
 
-		if (inode > indlen - 1) {
-			indlen += 10;
-			ind = (Node **)realloc(ind, sizeof(Node*) * indlen) ;
-		}
+		case JUMP:
+			gridJump();
+			break;
 
-		log_info("Proecss line:%s", line);
-		if (line[0] == '.' || line[0] == '*' || line[0] == '$') {
-			// Each line represent an 8x8 node
-			// "." representing an empty cell
-			// "*" representing a live cell
-			// "$" representing the end of line
-			int cellnums = 0, x = 0, y = 0;
-			int points[64][2];
-			char *c = 0;
-			int ipos = 0;
-			for (c=line; *c > ' '; c++) {
-				switch (*c){
-					case '*':
-						if (x > 7 || y < 0) {
-							fprintf(stderr, "Illegal coordinates (%d,%d)\n", x, y) ;
-							exit(10) ;
-						}
-						// in case the constructs output a 4x4 node, we need to know which position of this 4x4 is in 8x8
-						// ipos keep track of it
-						if (x < 4){
-							if (y< 4)
-								ipos = 1; // a
-							else
-								ipos = 3; // c
-						}else{
-							if (y< 4)
-								ipos = 2; // b
-							else
-								ipos = 4; // d
-						}
-						points[cellnums][0] = x;
-						points[cellnums][1] = y;
-						log_info("Get new cell x:%d, y:%d", x, y);
-						x++;
-						cellnums++;
-						break;
-					case '.':
-						x++;
-						break;
-					case '$':
-						y++;
-						x=0;
-						break;
-					default:       
-						fprintf(stderr, "Illegal char %c\n", *c) ;
-						exit(10) ;
-				}
-			}
-			root = construct(points, cellnums);
-			while(root->k < 3){
-				root = join(
-						ipos == 1 ? root : get_zero(root->k),
-						ipos == 2 ? root : get_zero(root->k),
-						ipos == 3 ? root : get_zero(root->k),
-						ipos == 4 ? root : get_zero(root->k)
-						);
-				log_info("Expanding constructed to depth :%d ipos:%d", root->k, ipos);
-			}
-			ind[inode++] = root;
-			//return root;
-		} else {
-			//Level 4 and above nodes are represented by five numbers: lev a b c d
-			//where lev is the level and a, b, c d are for index quaters of the node 
-			int n, ia, ib, ic, id, depth;
-			n = sscanf(line, "%d %d %d %d %d", &depth, &ia, &ib, &ic, &id);
-			if (n < 4) {
-				fprintf(stderr, "Parse error; line is \"%s\"\n", line) ;
-				exit(10) ;
-			}
-			ind[0] = get_zero(depth-1) ; /* allow zeros to work right */
-			Node *p = find_node(ind[ia], ind[ib], ind[ic], ind[id]) ;
-			if (p==NULL)
-				p = join(ind[ia], ind[ib], ind[ic], ind[id]);
-			root = ind[inode++] = p;
-		}
+		case BACK:
+			gridScrub(-1);
+			break;
+
+		case FORWARD:
+			gridScrub(1);
+			break;
+
+		case FAST_BACK:
+			gridScrub(-10);
+			break;
+
+		case FAST_FORWARD:
+			gridScrub(10);
+			break;
+
+		case UNDO:
+			gridUndo(0);
+			break;
+
+		case SELECT:
+			gridSelect();
+			break;
+
+		case '\x1b':
+			E.selecting = 0;
+			break;
+
+		case COPY:
+			gridCopy(0);
+			break;
+
+		case CUT:
+			gridCopy(1);
+			break;
 
+		case PASTE:
+			gridPaste();
+			break;
+
+		case STAMP:
+			gridStamp();
+			break;
+
+		case REDO:
+			gridUndo(1);
+			break;
 	}
-	fclose(fp);
-	if (ind)
-		free(ind);
-	return root;
 }
 
 /*** output ***/
@@ -454,26 +909,57 @@ void editorDrawWelcomeMsg(struct abuf *ab){
 
 void editorDrawStatusBar(struct abuf *ab) {
 	abAppend(ab, "\x1b[7m", 4);// switch to inverted color
-	char status[120], rstatus[120];
+	char status[160], rstatus[200], cycle[80] = "", sel[80] = "";
 
-	int len = snprintf(status, sizeof(status), "press q to quit --- wasd|hjkl|ARROWS to navigate (upper case to move faster) --- x|space to mark --- u|n to update");
-	int rlen = snprintf(rstatus, sizeof(rstatus), "Step: 2^%d | %d-%d",E.basestep, E.cx,  E.cy);
-	if (len > E.screencols) len = E.screencols;
+	int len;
+	if (E.prompting)
+		len = snprintf(status, sizeof(status), ":%s", E.prompt);
+	else if (E.message[0])
+		len = snprintf(status, sizeof(status), "%s", E.message);
+	else
+		len = snprintf(status, sizeof(status), "press q to quit --- wasd|hjkl|ARROWS to navigate (upper case to move faster) --- x|space to mark --- u|n to update --- : for commands");
+	if (E.cycle.found)
+		snprintf(cycle, sizeof(cycle), "Period %lld (%lld,%lld) e to jump | ",
+				(long long)E.cycle.period, (long long)E.cycle.dx, (long long)E.cycle.dy);
+	if (E.selecting){
+		int64_t x, y, w, h;
+		selectionRect(&x, &y, &w, &h);
+		snprintf(sel, sizeof(sel), "Select %lldx%lld | ", (long long)w, (long long)h);
+	} else if (E.clip)
+		snprintf(sel, sizeof(sel), "Clip %lldx%lld | ", (long long)E.clipw, (long long)E.cliph);
+	int rlen = snprintf(rstatus, sizeof(rstatus), "%s%s%sPop: %u | Gen: %lld | Hist: %d/%d | Step: 2^%d | %d-%d",
+			E.playing ? "PLAYING | " : "", cycle, sel, E.root->n, (long long)E.gen, E.history.pos + 1,
+			E.history.len, E.basestep, E.cx,  E.cy);
+	if (rlen > E.screencols) rlen = E.screencols;
+	// population sparkline left of the right side, its characters are 3 bytes but 1 column
+	char spark[STATS_SPARK_WIDTH * 3 + 1];
+	int swidth = E.stats.len > 1 ? stats_sparkline(&E.stats, spark, sizeof(spark), STATS_SPARK_WIDTH) : 0;
+	if (swidth + 1 > E.screencols - rlen) swidth = 0;
+	int right = rlen + (swidth ? swidth + 1 : 0);
+	if (len > E.screencols - right) len = E.screencols - right; // the right side matters more
 	abAppend(ab, status, len);
-	while (len < E.screencols) {
-		if (E.screencols - len == rlen) {
-			abAppend(ab, rstatus, rlen);
-			break;
-		} else {
-			abAppend(ab, " ", 1);
-			len++;
-		}
+	while (len < E.screencols - right) {
+		abAppend(ab, " ", 1);
+		len++;
+	}
+	if (swidth) {
+		abAppend(ab, spark, swidth * 3);
+		abAppend(ab, " ", 1);
 	}
+	abAppend(ab, rstatus, rlen);
 	abAppend(ab, "\x1b[m", 3);// switch back to normal color
 }
 
 
 void editorDrawGrid(struct abuf *ab) {
+	// selection in grid coordinates, empty if there is none
+	int64_t sx = 0, sy = 0, sw = 0, sh = 0;
+	if (E.selecting){
+		selectionRect(&sx, &sy, &sw, &sh);
+		sx += E.screencols/2/2 + E.offx;
+		sy += E.screenrows/2 + E.offy;
+	}
+
 	for (int row = 0; row < E.gridrows; row++){
 		for (int col = 0; col < E.gridcols; col++){
 			if (E.grid[row][col] == 1){
@@ -481,6 +967,11 @@ void editorDrawGrid(struct abuf *ab) {
 				abAppend(ab, "  ", 2);
 				abAppend(ab, "\x1b[m", 3);// switch back to normal color
 			}
+			else if (col >= sx && col < sx + sw && row >= sy && row < sy + sh){
+				abAppend(ab, "\x1b[100m", 6);// grey background for the selection
+				abAppend(ab, "  ", 2);
+				abAppend(ab, "\x1b[m", 3);
+			}
 			else
 				abAppend(ab, "  ", 2);
 		}
@@ -489,39 +980,67 @@ void editorDrawGrid(struct abuf *ab) {
 }
 
 
+void editorDrawScreen(struct abuf *ab) {
+	// Everything on screen from the top left, without cursor handling
+	PROFILE_START(gridstart);
+	editorDrawGrid(ab);
+	PROFILE_SPAN("draw grid", -1, gridstart);
+	PROFILE_START(statusstart);
+	editorDrawStatusBar(ab);
+	PROFILE_SPAN("draw status bar", -1, statusstart);
+}
+
 void editorRefreshScreen() {
 	struct abuf ab = ABUF_INIT;
+	PROFILE_START(start);
 
 	abAppend(&ab, "\x1b[?25l", 6); // Turn off cursor before refresh 
 	abAppend(&ab, "\x1b[H", 3); // clear screen
 
-	editorDrawGrid(&ab);
-	editorDrawStatusBar(&ab);
+	int body = ab.len;
+	editorDrawScreen(&ab);
+	if (E.recorder){
+		PROFILE_START(recordstart);
+		record_frame(E.recorder, -1, ab.b + body, ab.len - body, E.cx, E.cy, E.screencols, E.screenrows);
+		PROFILE_SPAN("record frame", -1, recordstart);
+	}
 	char buf[32];
 	snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.cy + 1, E.cx + 1);
 	abAppend(&ab, buf, strlen(buf)); // position cursor at user current position
 
 	abAppend(&ab, "\x1b[?25h", 6); // Turn on cursor
 
+	PROFILE_START(writestart);
 	write(STDOUT_FILENO, ab.b, ab.len);
+	PROFILE_SPAN("write screen", -1, writestart);
 	abFree(&ab);
+	PROFILE_SPAN("editorRefreshScreen", -1, start);
 }
 
 
 
 /*** init ***/
+void editorMarkRoot(void *udata){
+	(void)udata;
+	gc_mark(E.root);
+	gc_mark(E.clip);
+}
+
+
 void initEditor(int argc, char *argv[]){
-	if (getWindowSize(&E.screenrows, &E.screencols) == -1 ) die("WindowSize");
+	// --record sets the size itself, there may be no terminal
+	if (E.screenrows == 0 && getWindowSize(&E.screenrows, &E.screencols) == -1 ) die("WindowSize");
 	E.cx = 0; E.cy = 0;
 	E.offx = 0; E.offy = 0;
 	E.gridrows = E.screenrows - 1; // status bar
 	E.gridcols = E.screencols / 2;
 	E.basestep= 0;
+	E.playing = 0;
+	E.rule = RULE_LIFE;
+	E.dirty = DIRTY_GRID | DIRTY_SCREEN;
 	
   // Init the grid to display
-	E.grid = calloc( E.gridrows, sizeof(int *) );
-	for ( int i = 0; i < E.gridrows; i++ )
-		E.grid[i] = calloc( E.gridcols, sizeof(int) );
+	gridAlloc();
 
 	init_hashtab();
 	int n = 4;
@@ -529,23 +1048,96 @@ void initEditor(int argc, char *argv[]){
 	//Node *root = construct(points, n);
   //E.root = root;
   if (argc == 2){
-		E.root = readPattern(argv[1]);
-    gridUpdateOrigin();
-    //E.offx = -E.ox;
-    //E.offy = -E.oy;
-    // TODO : auto reallocate the pattern to the center
-    
+		E.root = readPattern(argv[1], &E.rule);
+		if (E.root == NULL){
+			clearScreen();
+			fprintf(stderr, "Unable to read pattern %s\n", argv[1]);
+			exit(1);
+		}
+		gridFocus();
   }
 	else
 		E.root = get_zero(1);
+
+	E.gen = 0;
+	cycle_init(&E.cycle, 1);
+	cycle_record(&E.cycle, E.root, E.gen);
+	history_init(&E.history);
+	history_push(&E.history, E.root, E.gen);
+	undo_init(&E.undo, UNDO_BUDGET);
+	stats_init(&E.stats);
+	if (getenv("STATS") && stats_open_csv(&E.stats, getenv("STATS")) < 0)
+		die("STATS");
+	stats_record(&E.stats, E.root, E.gen, 0, 0);
+	E.selecting = 0;
+	E.clip = NULL;
+
+	gc_add_root(editorMarkRoot, NULL);
+	gc_add_root(history_mark, &E.history);
+	gc_add_root(undo_mark, &E.undo);
 	gridRender();
 
 	log_warn("Universe Created: (%d x %d), Depth: %d, Population: %d, E.ox:%d, E.oy:%d, E.offx:%d, E.offy:%d", 
       1 << E.root->k, 1 << E.root->k, E.root->k, E.root->n, E.ox, E.oy, E.offx, E.offy);
 }
 
+int parseSize(const char *s, size_t *bytes){
+	// A byte count with an optional K, M or G suffix, -1 if it isn't one
+	char *end;
+	double n = strtod(s, &end);
+	const char *suffixes = "KMG", *suffix = *end ? strchr(suffixes, toupper((unsigned char)*end)) : NULL;
+	int shift = suffix ? 10 * (int)(suffix - suffixes + 1) : 0;
+	if (n <= 0 || (*end && (suffix == NULL || end[1] != '\0')))
+		return -1;
+	*bytes = (size_t)(n * ((size_t)1 << shift));
+	return 0;
+}
+
+void editorStopRecording(){
+	record_close(E.recorder);
+	E.recorder = NULL;
+}
+
+int recordHeadless(const char *path, int64_t frames, const char *out, int basestep){
+	// Play pattern path for frames frames of 2^basestep generations into the
+	// asciicast out, FRAME_INTERVAL_MS apart as if played live. The screen is the
+	// terminal's if there is one, RECORD_COLS x RECORD_ROWS otherwise
+	if (!isatty(STDOUT_FILENO) || getWindowSize(&E.screenrows, &E.screencols) == -1){
+		E.screenrows = RECORD_ROWS;
+		E.screencols = RECORD_COLS;
+	}
+	char *argv[] = {"lifeterm", (char *)path};
+	initEditor(2, argv);
+	E.basestep = basestep;
+	E.recorder = record_open(out, E.screencols, E.screenrows);
+	if (E.recorder == NULL){
+		fprintf(stderr, "Unable to record to %s\n", out);
+		return -1;
+	}
+	for (int64_t i = 0; i < frames; i++){
+		if (i > 0){
+			gridUpdate();
+			gridRender();
+		}
+		struct abuf ab = ABUF_INIT;
+		editorDrawScreen(&ab);
+		record_frame(E.recorder, i * FRAME_INTERVAL_MS / 1000.0, ab.b, ab.len, E.cx, E.cy,
+				E.screencols, E.screenrows);
+		abFree(&ab);
+	}
+	int64_t written = E.recorder->frames;
+	uint64_t bytes = E.recorder->bytes;
+	editorStopRecording();
+	printf("%lld frames (%lld changed, %llu bytes of output) to %s, generation %lld\n", (long long)frames,
+			(long long)written, (unsigned long long)bytes, out, (long long)E.gen);
+	return 0;
+}
+
 int main(int argc, char *argv[] ){
   log_set_quiet(true);
+#ifdef PROFILE
+	atexit(profile_dump);
+#endif
   if (getenv("DEBUG")){
     FILE *fp = fopen("lifeterm.log", "a+");
     if (fp==NULL){
@@ -553,15 +1145,83 @@ int main(int argc, char *argv[] ){
       return 0;
     }
     log_add_fp(fp, 3); // 3 is warn, 0 is trace
+    log_set_async(true); // written by a background thread, hot paths only pay for the copy
     log_info("Start");
     log_info("-------------------------------------------------------");
   } 	
+	size_t bytes;
+	if (getenv("MEMORY")){
+		if (parseSize(getenv("MEMORY"), &bytes) < 0){
+			fprintf(stderr, "MEMORY should be a size like 512M or 2G\n");
+			return 1;
+		}
+		gc_set_budget(bytes);
+	}
+	if (getenv("HUGEPAGES") || getenv("PREFAULT")){
+		// node arena backing, before init_hashtab() maps anything
+		const char *huge = getenv("HUGEPAGES");
+		int mode = huge == NULL ? ARENA_PAGES : strcmp(huge, "reserved") == 0 ? ARENA_HUGETLB : ARENA_THP;
+		bytes = 0;
+		if (getenv("PREFAULT") && parseSize(getenv("PREFAULT"), &bytes) < 0){
+			fprintf(stderr, "PREFAULT should be a size like 512M or 2G\n");
+			return 1;
+		}
+		arena_configure(mode, bytes);
+	}
+	if (argc == 3 && strcmp(argv[1], "--serve") == 0){
+		// no terminal, only the engine behind a socket
+		init_hashtab();
+		return server_run(argv[2]) == 0 ? 0 : 1;
+	}
+
+	if ((argc == 5 || argc == 6) && strcmp(argv[1], "--record") == 0){
+		// no terminal, play a pattern into an asciicast
+		int64_t frames = atoll(argv[3]);
+		int basestep = argc == 6 ? atoi(argv[5]) : 0;
+		if (frames <= 0 || basestep < 0 || basestep >= MAX_LEVEL){
+			fprintf(stderr, "usage: %s --record {pattern} {frames} {file.cast} [log2 step]\n", argv[0]);
+			return 1;
+		}
+		return recordHeadless(argv[2], frames, argv[4], basestep) == 0 ? 0 : 1;
+	}
+
+	if ((argc >= 4 && argc <= 6) && strcmp(argv[1], "--soup") == 0){
+		// no terminal, run random soups and census what they leave
+		SoupOptions opt = {.count = atoll(argv[2]), .seed = argc >= 5 ? strtoull(argv[4], NULL, 0) : 0, .rule = RULE_LIFE};
+		if (opt.count <= 0 || (argc == 6 && rule_parse(argv[5], &opt.rule) != 0)){
+			fprintf(stderr, "usage: %s --soup {count} {census.txt} [seed] [rule]\n", argv[0]);
+			return 1;
+		}
+		init_hashtab();
+		if (soup_search(&opt, argv[3]) != 0){
+			fprintf(stderr, "Unable to write the census to %s\n", argv[3]);
+			return 1;
+		}
+		return 0;
+	}
+
 	enableRawMode();
 	initEditor(argc, argv);
+	if (getenv("RECORD")){
+		E.recorder = record_open(getenv("RECORD"), E.screencols, E.screenrows);
+		if (E.recorder == NULL)
+			die("RECORD");
+		atexit(editorStopRecording); // write out the rest on quit
+	}
+
+	initEventLoop();
 
 	while(1){
-		editorRefreshScreen();
-		editorProcessKeypress();
+		if (E.dirty & DIRTY_GRID)
+			gridRender();
+		if (E.dirty)
+			editorRefreshScreen();
+		E.dirty = 0;
+
+		editorPollEvents();
+		int c;
+		while ((c = editorReadKey()) != -1)
+			editorProcessKeypress(c);
 	}
 
 	return 0;
@@ -8,10 +8,24 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <sys/ioctl.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
 #include <string.h>
 #include <math.h>
 #include "hashlife.h"
+#include "cycle.h"
+#include "history.h"
+#include "undo.h"
+#include "server.h"
+#include "pattern.h"
 #include "log.h"
+#include "profile.h"
+#include "record.h"
+#include "stats.h"
+#include "arena.h"
+#include "soup.h"
 
 
 /*** defines ***/
@@ -19,6 +33,19 @@
 
 #define CTRL_KEY(k) ((k) & 0x1f) // & in this line is bitwise-AND operator
 
+#define INPUT_BUFSIZE 256
+#define ESC_TIMEOUT_MS 10 // how long a lone Esc waits for the rest of its sequence
+#define FRAME_INTERVAL_MS 50 // time between two steps while playing
+#define JUMP_GENERATIONS (1LL << 20) // how far 'e' skips once a cycle is known
+#define PROMPT_MAX 64 // ':' command line
+#define UNTIL_MAX_GENERATIONS (1LL << 48) // how far ahead a ':' condition is searched
+#define STABLE_PERIOD 120 // ':stable' holds once the population repeats with a period dividing this
+#define STABLE_REPEATS 4
+
+// What needs to be redrawn before the next poll
+#define DIRTY_SCREEN 1
+#define DIRTY_GRID 2
+
 
 /*** structs ***/
 
@@ -35,9 +62,24 @@ enum editorKey {
 	DEC_BASE,
 	STEP,
 	PLAY,
+	FOCUS,
+	JUMP,
+	BACK,
+	FORWARD,
+	FAST_BACK,
+	FAST_FORWARD,
+	UNDO,
+	REDO,
+	SELECT,
+	COPY,
+	CUT,
+	PASTE,
+	STAMP,
 	MARK,
 	ERASE,
-	QUIT
+	PROMPT,
+	QUIT,
+	NO_KEY // an escape sequence that means nothing here
 };
 
 struct abuf {
@@ -56,9 +98,25 @@ struct editorConfig {
 	int gridrows;
 	int gridcols;
 	int playing;
+	unsigned rule; // RULE_LIFE unless a pattern says otherwise
+	long long nextframe; // monotonic time (ms) of the next step while playing
+	int dirty;
 	int **grid;
 	struct Node *root;
+	int64_t gen; // generation of root
+	Cycle cycle;
+	History history; // recent generations, registered as a GC root
+	Undo undo; // universes before each edit, registered as a GC root
+	Stats stats; // a sample per step, streamed to STATS if set
+	int prompting; // keys go to the ':' command line
+	char prompt[PROMPT_MAX];
+	char message[80]; // outcome of the last command, in place of the help until the next key
+	int selecting;
+	int64_t selx, sely; // selection anchor, relative to the centre of the universe
+	struct Node *clip; // clipboard, upper left at (0, 0)
+	int64_t clipw, cliph;
 	struct termios orig_termios;
+	Recorder *recorder; // NULL unless RECORD is set or --record
 };
 
 /*** terminal ***/
@@ -76,38 +134,72 @@ void abFree(struct abuf *ab);
 
 
 /*** grid operations ***/
+void gridAlloc();
+void gridFree();
+void editorResize();
 void pushRoot();
 void emptyRoot();
+void gridFocus();
+void gridEdited();
+void gridJump();
+void gridGoto(Node *root, int64_t gen, uint64_t probes, uint64_t hits);
+void gridGeneration(int64_t gen);
+void gridUntil(UntilFn cond, void *udata, int monotone, const char *what);
+void gridScrub(int delta);
+void undoPush(struct Node *before);
+void gridUndo(int redo);
+void cursorCell(int64_t *x, int64_t *y);
+void selectionRect(int64_t *x, int64_t *y, int64_t *w, int64_t *h);
+void gridFit(int64_t x, int64_t y, int64_t w, int64_t h);
+void gridSelect();
+void gridCopy(int cut);
+void gridPlace(struct Node *p, int64_t x, int64_t y);
+void gridPaste();
+void gridStamp();
 void gridMark();
 void gridErase();
 void gridUpdateOrigin();
 void gridUpdate();
+void gridStepped(int last_k, uint64_t probes, uint64_t hits);
 void gridRender();
 void gridPlay();
 void changeBasestep(int order);
 
 
+/*** event loop ***/
+void initEventLoop();
+void editorWake();
+int editorFillInput(int timeout);
+void editorPollEvents();
+
+
 /*** input ***/
 int editorReadKey();
 void editorMoveCursor(int key);
-void editorProcessKeypress();
-struct Node *readPattern(char *filename);
+void editorProcessKeypress(int c);
+void editorPromptKey(int c);
+void editorRunCommand(const char *cmd);
 
 
 /*** output ***/
 void editorDrawWelcomeMsg(struct abuf *ab);
 void editorDrawStatusBar(struct abuf *ab);
 void editorDrawGrid(struct abuf *ab);
+void editorDrawScreen(struct abuf *ab);
 void editorRefreshScreen();
 
 
 /*** init ***/
+void editorMarkRoot(void *udata);
 void initEditor(int argc, char *argv[]);
+int parseSize(const char *s, size_t *bytes);
+void editorStopRecording();
+int recordHeadless(const char *path, int64_t frames, const char *out, int basestep);
 
 
 /*** Global ***/
 // acts as constructor for the abuf type
 #define ABUF_INIT {NULL, 0}
-struct editorConfig E;
+extern struct editorConfig E;
 
 #endif
@@ -21,8 +21,13 @@
  */
 
 #include "log.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
 
 #define MAX_CALLBACKS 32
+#define WRITER_IDLE_NS 5000000 /* how long the async writer sleeps on an empty ring */
 
 typedef struct {
   log_LogFn fn;
@@ -38,6 +43,29 @@ static struct {
   Callback callbacks[MAX_CALLBACKS];
 } L;
 
+typedef struct {
+  size_t seq; /* which turn of the ring this slot is ready for, see log_log() */
+  int level;
+  int line;
+  const char *file;
+  time_t time;
+  char msg[LOG_MSG_MAX];
+} Record;
+
+/* Bounded multi-producer ring: log_log() claims a slot with one CAS and the
+ * writer thread, its only consumer, formats records out in order */
+static struct {
+  Record slots[LOG_RING_SIZE];
+  size_t head; /* next slot to claim */
+  size_t tail; /* next slot to write, touched by the writer only */
+  size_t dropped;
+  int inflight; /* log_log() calls that saw running and may still enqueue */
+  bool running, stop;
+  pthread_t writer;
+} R;
+
+int log_threshold = LOG_TRACE;
+
 
 static const char *level_strings[] = {
   "TRACE", "DEBUG", "INFO", "WARN", "ERROR", "FATAL"
@@ -102,13 +130,24 @@ void log_set_lock(log_LockFn fn, void *udata) {
 }
 
 
+static void update_threshold(void) {
+  int level = L.quiet ? INT_MAX : L.level;
+  for (int i = 0; i < MAX_CALLBACKS && L.callbacks[i].fn; i++) {
+    if (L.callbacks[i].level < level) { level = L.callbacks[i].level; }
+  }
+  log_threshold = level;
+}
+
+
 void log_set_level(int level) {
   L.level = level;
+  update_threshold();
 }
 
 
 void log_set_quiet(bool enable) {
   L.quiet = enable;
+  update_threshold();
 }
 
 
@@ -116,6 +155,7 @@ int log_add_callback(log_LogFn fn, void *udata, int level) {
   for (int i = 0; i < MAX_CALLBACKS; i++) {
     if (!L.callbacks[i].fn) {
       L.callbacks[i] = (Callback) { fn, udata, level };
+      update_threshold();
       return 0;
     }
   }
@@ -128,16 +168,9 @@ int log_add_fp(FILE *fp, int level) {
 }
 
 
-static void init_event(log_Event *ev, void *udata) {
-  if (!ev->time) {
-    time_t t = time(NULL);
-    ev->time = localtime(&t);
-  }
-  ev->udata = udata;
-}
-
-
-void log_log(int level, const char *file, int line, const char *fmt, ...) {
+static void emit(int level, const char *file, int line, time_t t, const char *fmt, va_list ap) {
+  /* Hand one message to stderr and every callback that takes its level */
+  struct tm *tm = NULL;
   log_Event ev = {
     .fmt   = fmt,
     .file  = file,
@@ -145,11 +178,10 @@ void log_log(int level, const char *file, int line, const char *fmt, ...) {
     .level = level,
   };
 
-  lock();
-
   if (!L.quiet && level >= L.level) {
-    init_event(&ev, stderr);
-    va_start(ev.ap, fmt);
+    ev.time = tm = localtime(&t);
+    ev.udata = stderr;
+    va_copy(ev.ap, ap);
     stdout_callback(&ev);
     va_end(ev.ap);
   }
@@ -157,12 +189,129 @@ void log_log(int level, const char *file, int line, const char *fmt, ...) {
   for (int i = 0; i < MAX_CALLBACKS && L.callbacks[i].fn; i++) {
     Callback *cb = &L.callbacks[i];
     if (level >= cb->level) {
-      init_event(&ev, cb->udata);
-      va_start(ev.ap, fmt);
+      if (!tm) { tm = localtime(&t); }
+      ev.time = tm;
+      ev.udata = cb->udata;
+      va_copy(ev.ap, ap);
       cb->fn(&ev);
       va_end(ev.ap);
     }
   }
+}
+
+
+static void emitf(int level, const char *file, int line, time_t t, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  emit(level, file, line, t, fmt, ap);
+  va_end(ap);
+}
+
+
+static bool drain(void) {
+  /* Write out every record that is ready, false if there were none */
+  bool any = false;
+  for (;;) {
+    Record *r = &R.slots[R.tail & (LOG_RING_SIZE - 1)];
+    if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != R.tail + 1) { break; }
+    lock();
+    emitf(r->level, r->file, r->line, r->time, "%s", r->msg);
+    unlock();
+    __atomic_store_n(&r->seq, R.tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+    R.tail++;
+    any = true;
+  }
+  size_t dropped = __atomic_exchange_n(&R.dropped, 0, __ATOMIC_RELAXED);
+  if (dropped) {
+    lock();
+    emitf(LOG_WARN, __FILE__, __LINE__, time(NULL), "Log ring full, dropped %zu messages", dropped);
+    unlock();
+  }
+  return any;
+}
+
+
+static void *writer(void *arg) {
+  (void)arg;
+  struct timespec idle = { 0, WRITER_IDLE_NS };
+  while (!__atomic_load_n(&R.stop, __ATOMIC_ACQUIRE)) {
+    if (!drain()) { nanosleep(&idle, NULL); }
+  }
+  drain();
+  return NULL;
+}
+
+
+static void flush_at_exit(void) {
+  log_set_async(false);
+}
+
+
+int log_set_async(bool enable) {
+  /* Queue messages for a background writer instead of writing them in the
+   * caller. Turning it off writes out whatever is still queued */
+  static bool registered;
+  if (enable == R.running) { return 0; }
+  if (!enable) {
+    /* New messages go straight out from here, wait for the ones already on their
+     * way into the ring, then let the writer drain it and stop */
+    struct timespec spin = { 0, 100000 };
+    __atomic_store_n(&R.running, false, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&R.inflight, __ATOMIC_SEQ_CST) > 0) { nanosleep(&spin, NULL); }
+    __atomic_store_n(&R.stop, true, __ATOMIC_RELEASE);
+    pthread_join(R.writer, NULL);
+    return 0;
+  }
+  for (size_t i = 0; i < LOG_RING_SIZE; i++) { R.slots[i].seq = i; }
+  R.head = R.tail = 0;
+  R.stop = false;
+  if (pthread_create(&R.writer, NULL, writer, NULL) != 0) { return -1; }
+  __atomic_store_n(&R.running, true, __ATOMIC_SEQ_CST);
+  if (!registered) { registered = atexit(flush_at_exit) == 0; }
+  return 0;
+}
+
+
+static void enqueue(int level, const char *file, int line, const char *fmt, va_list ap) {
+  /* Claim the slot at head once the writer is done with its last turn, a full
+   * ring drops the message rather than wait */
+  size_t pos = __atomic_load_n(&R.head, __ATOMIC_RELAXED);
+  Record *r;
+  for (;;) {
+    r = &R.slots[pos & (LOG_RING_SIZE - 1)];
+    size_t seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+    if (seq == pos) {
+      if (__atomic_compare_exchange_n(&R.head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) { break; }
+    } else if ((intptr_t)(seq - pos) < 0) {
+      __atomic_fetch_add(&R.dropped, 1, __ATOMIC_RELAXED);
+      return;
+    } else {
+      pos = __atomic_load_n(&R.head, __ATOMIC_RELAXED);
+    }
+  }
+  r->level = level;
+  r->file = file;
+  r->line = line;
+  r->time = time(NULL);
+  vsnprintf(r->msg, sizeof(r->msg), fmt, ap);
+  __atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
 
+void log_log(int level, const char *file, int line, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  if (__atomic_load_n(&R.running, __ATOMIC_ACQUIRE)) {
+    /* Announce ourselves before checking again, so log_set_async(false) either
+     * waits for this message or we see it has stopped and write it ourselves */
+    __atomic_add_fetch(&R.inflight, 1, __ATOMIC_SEQ_CST);
+    bool queued = __atomic_load_n(&R.running, __ATOMIC_SEQ_CST);
+    if (queued) { enqueue(level, file, line, fmt, ap); }
+    __atomic_sub_fetch(&R.inflight, 1, __ATOMIC_SEQ_CST);
+    if (queued) { va_end(ap); return; }
+  }
+  lock();
+  emit(level, file, line, time(NULL), fmt, ap);
   unlock();
+  va_end(ap);
 }
@@ -0,0 +1,205 @@
+#include "pattern.h"
+#include "profile.h"
+
+
+/*** Macrocell ***/
+Node *readPattern(char* filename, unsigned *rule){
+	// Returns NULL if the file can't be read or isn't valid Macrocell. rule is set
+	// from the #R line and left alone if there is none
+	FILE *fp;
+	char line[10000];
+	fp = fopen(filename, "r");
+	if (fp == NULL)
+		return NULL;
+	PROFILE_START(start);
+	Node *root = NULL;
+	int indlen = 10;
+	int inode = 1;
+	Node **ind = (Node **)calloc(indlen, sizeof(Node *)); 
+	ind[0] = get_zero(2) ; /* allow zeros to work right */
+	while (fgets(line, 10000, fp) != NULL){
+		if (strncmp(line, "#R", 2) == 0 && rule_parse(line + 2, rule) != 0)
+			log_warn("Unsupported rule %s, keeping B3/S23", line + 2);
+		if(line[0] == '#' | line[0] == '[' | strlen(line) <=1) // Skip the Header and rule line
+			continue;
+
+		if (inode > indlen - 1) {
+			indlen += 10;
+			ind = (Node **)realloc(ind, sizeof(Node*) * indlen) ;
+		}
+
+		log_trace("Process line:%s", line);
+		if (line[0] == '.' || line[0] == '*' || line[0] == '$') {
+			// Each line represent an 8x8 node
+			// "." representing an empty cell
+			// "*" representing a live cell
+			// "$" representing the end of line
+			PROFILE_START(leafstart);
+			int x = 0, y = 0;
+			char *c = 0;
+			root = get_zero(3);
+			for (c=line; *c > ' '; c++) {
+				switch (*c){
+					case '*':
+						if (x > 7 || y > 7) {
+							log_error("Illegal coordinates (%d,%d)", x, y);
+							goto fail;
+						}
+						root = mark(root, x, y); // each cell once, so this only turns cells on
+						x++;
+						break;
+					case '.':
+						x++;
+						break;
+					case '$':
+						y++;
+						x=0;
+						break;
+					default:       
+						log_error("Illegal char %c", *c);
+						goto fail;
+				}
+			}
+			ind[inode++] = root;
+			PROFILE_SPAN("readPattern leaf", 3, leafstart);
+		} else {
+			//Level 4 and above nodes are represented by five numbers: lev a b c d
+			//where lev is the level and a, b, c d are for index quaters of the node 
+			PROFILE_START(nodestart);
+			int n, ia, ib, ic, id, depth;
+			n = sscanf(line, "%d %d %d %d %d", &depth, &ia, &ib, &ic, &id);
+			if (n < 5 || depth < 4 || depth > MAX_LEVEL || ia < 0 || ib < 0 || ic < 0 || id < 0 ||
+					ia >= inode || ib >= inode || ic >= inode || id >= inode) {
+				log_error("Parse error; line is \"%s\"", line);
+				goto fail;
+			}
+			ind[0] = get_zero(depth-1) ; /* allow zeros to work right */
+			if (ind[ia]->k != depth-1 || ind[ib]->k != depth-1 || ind[ic]->k != depth-1 || ind[id]->k != depth-1) {
+				log_error("Children of \"%s\" are not at level %d", line, depth-1);
+				goto fail;
+			}
+			Node *p = find_node(ind[ia], ind[ib], ind[ic], ind[id]) ;
+			if (p==NULL)
+				p = join(ind[ia], ind[ib], ind[ic], ind[id]);
+			root = ind[inode++] = p;
+			PROFILE_SPAN("readPattern node", depth, nodestart);
+		}
+
+	}
+	fclose(fp);
+	if (ind)
+		free(ind);
+	PROFILE_SPAN("readPattern", -1, start);
+	return root;
+
+fail:
+	fclose(fp);
+	free(ind);
+	return NULL;
+}
+
+static int writeRows(FILE *fp, const uint64_t *rows, int x, int y, int k, int *next){
+	// The level k square at (x, y) of a packed node, written like writeNode() but
+	// without looking for repeats. Returns its line number, 0 if empty
+	uint64_t cols = (((uint64_t)1 << (1 << k)) - 1) << x, any = 0;
+	for (int i = y; i < y + (1 << k); i++)
+		any |= rows[i] & cols;
+	if (!any)
+		return 0;
+	if (k == 3){
+		int height = 8;
+		while ((rows[y + height - 1] & cols) == 0)
+			height--;
+		for (int i = y; i < y + height; i++){
+			unsigned line = rows[i] >> x & 0xff;
+			for (int j = 0; line >> j; j++)
+				fputc(line >> j & 1 ? '*' : '.', fp);
+			fputc('$', fp);
+		}
+		fputc('\n', fp);
+	} else {
+		int half = 1 << (k - 1);
+		int a = writeRows(fp, rows, x, y, k - 1, next);
+		int b = writeRows(fp, rows, x + half, y, k - 1, next);
+		int c = writeRows(fp, rows, x, y + half, k - 1, next);
+		int d = writeRows(fp, rows, x + half, y + half, k - 1, next);
+		fprintf(fp, "%d %d %d %d %d\n", k, a, b, c, d);
+	}
+	return (*next)++;
+}
+
+static int writeNode(FILE *fp, Node *p, Node **seen, int *ids, int cap, int *next){
+	// Write p's children then p, once per distinct node. Returns p's line number, 0 if empty
+	if (p->n == 0)
+		return 0;
+	size_t h = ((uintptr_t)p >> 4) % cap;
+	while (seen[h] != NULL && seen[h] != p)
+		h = (h + 1) % cap;
+	if (seen[h] == p)
+		return ids[h];
+
+	if (p->k == 3){
+		// 8x8 leaf, trailing dead cells and rows are left out
+		for (int y = 0; y < 8; y++){
+			int last = -1;
+			for (int x = 0; x < 8; x++)
+				if (population(p, x, y, 1, 1))
+					last = x;
+			for (int x = 0; x <= last; x++)
+				fputc(population(p, x, y, 1, 1) ? '*' : '.', fp);
+			if (population(p, 0, y + 1, 8, 8))
+				fputc('$', fp);
+		}
+		fputc('$', fp);
+		fputc('\n', fp);
+	} else if (p->packed){
+		int half = PACK_SIZE / 2;
+		int a = writeRows(fp, leaf_bits(p), 0, 0, PACK_LEVEL - 1, next);
+		int b = writeRows(fp, leaf_bits(p), half, 0, PACK_LEVEL - 1, next);
+		int c = writeRows(fp, leaf_bits(p), 0, half, PACK_LEVEL - 1, next);
+		int d = writeRows(fp, leaf_bits(p), half, half, PACK_LEVEL - 1, next);
+		fprintf(fp, "%d %d %d %d %d\n", p->k, a, b, c, d);
+	} else {
+		int a = writeNode(fp, p->a, seen, ids, cap, next);
+		int b = writeNode(fp, p->b, seen, ids, cap, next);
+		int c = writeNode(fp, p->c, seen, ids, cap, next);
+		int d = writeNode(fp, p->d, seen, ids, cap, next);
+		fprintf(fp, "%d %d %d %d %d\n", p->k, a, b, c, d);
+	}
+	seen[h] = p;
+	ids[h] = (*next)++;
+	return ids[h];
+}
+
+int writePattern(Node *root, unsigned rule, char *filename){
+	// Save root in Macrocell format, readPattern() gives back the same node. -1 on failure
+	while (root->k < 3)
+		root = centre(root);
+
+	FILE *fp = fopen(filename, "w");
+	if (fp == NULL)
+		return -1;
+	char rulestr[32];
+	rule_format(rule, rulestr, sizeof(rulestr));
+	fprintf(fp, "[M2] (lifeterm)\n#R %s\n", rulestr);
+
+	if (root->n == 0){
+		// an empty universe still needs a node to be read back
+		fprintf(fp, "$\n");
+	} else {
+		int cap = 2 * node_count(root, NULL) + 1;
+		Node **seen = calloc(cap, sizeof(Node *));
+		int *ids = calloc(cap, sizeof(int));
+		if (seen == NULL || ids == NULL){
+			free(seen);
+			free(ids);
+			fclose(fp);
+			return -1;
+		}
+		int next = 1;
+		writeNode(fp, root, seen, ids, cap, &next);
+		free(seen);
+		free(ids);
+	}
+	return fclose(fp) == 0 ? 0 : -1;
+}
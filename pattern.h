@@ -0,0 +1,9 @@
+#ifndef PATTERN_H
+#define PATTERN_H
+#include "hashlife.h"
+
+/*** Macrocell ***/
+Node *readPattern(char *filename, unsigned *rule);
+int writePattern(Node *root, unsigned rule, char *filename);
+
+#endif
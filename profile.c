@@ -0,0 +1,170 @@
+#include "profile.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*** Structs ***/
+typedef struct {
+	const char *name;
+	int level; // -1 when the span isn't about a node level
+	int tid;
+	uint64_t start, dur; // ns
+} Event;
+
+typedef struct {
+	uint64_t count, total, max; // ns
+	uint64_t buckets[PROFILE_BUCKETS];
+} Stat;
+
+static Event *events; // PROFILE_MAX_EVENTS of them, allocated with the first span
+static uint64_t nevents; // claimed so far, may run past PROFILE_MAX_EVENTS
+static pthread_once_t eventsonce = PTHREAD_ONCE_INIT;
+
+static Stat levels[PROFILE_LEVELS]; // successor() by level
+static uint64_t joins[PROFILE_LEVELS][2]; // join() misses and hits by level
+static struct {
+	const char *name;
+	Stat stat;
+} names[PROFILE_MAX_NAMES]; // every other span by name
+static int nnames;
+static pthread_mutex_t nameslock = PTHREAD_MUTEX_INITIALIZER;
+
+static int lastid;
+static __thread int tid; // 0 until this thread's first span
+
+
+/*** Recording ***/
+uint64_t profile_now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void events_alloc(void){
+	events = malloc(PROFILE_MAX_EVENTS * sizeof(Event)); // NULL only loses the trace
+}
+
+static void stat_add(Stat *s, uint64_t dur){
+	int bucket = 63 - __builtin_clzll(dur | 1);
+	if (bucket >= PROFILE_BUCKETS)
+		bucket = PROFILE_BUCKETS - 1;
+	__atomic_fetch_add(&s->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->total, dur, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->buckets[bucket], 1, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&s->max, __ATOMIC_RELAXED);
+	while (dur > max && !__atomic_compare_exchange_n(&s->max, &max, dur, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static void record(const char *name, int level, uint64_t start, uint64_t dur){
+	pthread_once(&eventsonce, events_alloc);
+	if (tid == 0)
+		tid = __atomic_add_fetch(&lastid, 1, __ATOMIC_RELAXED);
+	uint64_t i = __atomic_fetch_add(&nevents, 1, __ATOMIC_RELAXED);
+	if (events != NULL && i < PROFILE_MAX_EVENTS)
+		events[i] = (Event){.name = name, .level = level, .tid = tid, .start = start, .dur = dur};
+}
+
+void profile_span(const char *name, int level, uint64_t start){
+	// End a span started at start, summed by name. level is -1 if it has none
+	uint64_t dur = profile_now() - start;
+	pthread_mutex_lock(&nameslock);
+	int i = 0;
+	while (i < nnames && strcmp(names[i].name, name) != 0)
+		i++;
+	if (i == nnames && nnames < PROFILE_MAX_NAMES)
+		names[nnames++].name = name;
+	pthread_mutex_unlock(&nameslock);
+	if (i < PROFILE_MAX_NAMES)
+		stat_add(&names[i].stat, dur);
+	record(name, level, start, dur);
+}
+
+void profile_successor(int level, uint64_t start){
+	// End a successor() frame started at start, summed by level. Only frames of
+	// PROFILE_EVENT_LEVEL and up make trace events, the rest would crowd them out
+	uint64_t dur = profile_now() - start;
+	stat_add(&levels[level < PROFILE_LEVELS ? level : PROFILE_LEVELS - 1], dur);
+	if (level >= PROFILE_EVENT_LEVEL)
+		record("successor", level, start, dur);
+}
+
+void profile_join(int level, int hit){
+	__atomic_fetch_add(&joins[level < PROFILE_LEVELS ? level : PROFILE_LEVELS - 1][hit != 0], 1, __ATOMIC_RELAXED);
+}
+
+
+/*** Output ***/
+int profile_write_trace(const char *path){
+	// Chrome trace event JSON, complete ("X") events in microseconds. -1 if path can't be written
+	FILE *fp = fopen(path, "w");
+	if (fp == NULL)
+		return -1;
+	uint64_t n = __atomic_load_n(&nevents, __ATOMIC_RELAXED);
+	if (events == NULL || n > PROFILE_MAX_EVENTS)
+		n = events == NULL ? 0 : PROFILE_MAX_EVENTS;
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for (uint64_t i = 0; i < n; i++){
+		Event *e = &events[i];
+		fprintf(fp, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+				e->name, e->tid, e->start / 1e3, e->dur / 1e3);
+		if (e->level >= 0)
+			fprintf(fp, ",\"args\":{\"level\":%d}", e->level);
+		fprintf(fp, "}%s\n", i + 1 < n ? "," : "");
+	}
+	fprintf(fp, "]}\n");
+	return fclose(fp) == 0 ? 0 : -1;
+}
+
+static void print_histogram(FILE *fp, const Stat *s){
+	// The non-empty duration buckets, each labelled with its lower bound
+	static const char *units[] = {"ns", "us", "ms", "s"};
+	for (int i = 0; i < PROFILE_BUCKETS; i++){
+		if (s->buckets[i] == 0)
+			continue;
+		int unit = i / 10 < 3 ? i / 10 : 3;
+		fprintf(fp, " %llu%s:%llu", (unsigned long long)((uint64_t)1 << i) >> (10 * unit),
+				units[unit], (unsigned long long)s->buckets[i]);
+	}
+	fprintf(fp, "\n");
+}
+
+void profile_summary(FILE *fp){
+	// Spans by name, then successor() time and join() hits by level. A frame's time
+	// includes its children's. Histogram buckets are powers of 2, with 1024 standing
+	// in for 1000 in the labels
+	fprintf(fp, "%-20s %10s %12s %10s  histogram\n", "span", "count", "total ms", "max ms");
+	for (int i = 0; i < nnames; i++){
+		Stat *s = &names[i].stat;
+		fprintf(fp, "%-20s %10llu %12.3f %10.3f ", names[i].name, (unsigned long long)s->count,
+				s->total / 1e6, s->max / 1e6);
+		print_histogram(fp, s);
+	}
+
+	fprintf(fp, "\n%-5s %12s %12s %10s %12s %8s  histogram\n",
+			"level", "successors", "total ms", "mean us", "joins", "hit %");
+	for (int k = 0; k < PROFILE_LEVELS; k++){
+		Stat *s = &levels[k];
+		uint64_t j = joins[k][0] + joins[k][1];
+		if (s->count == 0 && j == 0)
+			continue;
+		fprintf(fp, "%-5d %12llu %12.3f %10.3f %12llu %8.1f ", k, (unsigned long long)s->count,
+				s->total / 1e6, s->count ? s->total / 1e3 / s->count : 0.0,
+				(unsigned long long)j, j ? 100.0 * joins[k][1] / j : 0.0);
+		print_histogram(fp, s);
+	}
+	uint64_t n = __atomic_load_n(&nevents, __ATOMIC_RELAXED);
+	if (n > PROFILE_MAX_EVENTS)
+		fprintf(fp, "\nTrace kept the first %d of %llu events\n", PROFILE_MAX_EVENTS, (unsigned long long)n);
+}
+
+void profile_dump(void){
+	// Write PROFILE_TRACE_PATH and PROFILE_SUMMARY_PATH, meant for atexit()
+	profile_write_trace(PROFILE_TRACE_PATH);
+	FILE *fp = fopen(PROFILE_SUMMARY_PATH, "w");
+	if (fp == NULL)
+		return;
+	profile_summary(fp);
+	fclose(fp);
+}
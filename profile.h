@@ -0,0 +1,43 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Built-in profiler, compiled out unless built with -DPROFILE (`make profile`).
+ * Spans are timed sections: successor() frames by level, GC pauses, pattern loads
+ * and renders. They are kept as Chrome trace events (chrome://tracing, Perfetto)
+ * and summed per name and per level, along with join() hits and misses
+ */
+
+/*** Defines ***/
+#define PROFILE_MAX_EVENTS (1 << 20) // trace events kept, later ones only count in the summary
+#define PROFILE_EVENT_LEVEL 8 // successor() frames below this level only go to the summary
+#define PROFILE_LEVELS 65 // node levels 0 to MAX_ITER_LEVEL
+#define PROFILE_BUCKETS 32 // duration histogram, bucket i holds [2^i, 2^(i+1)) ns
+#define PROFILE_MAX_NAMES 64
+#define PROFILE_TRACE_PATH "lifeterm.trace.json"
+#define PROFILE_SUMMARY_PATH "lifeterm.profile.txt"
+
+#ifdef PROFILE
+#define PROFILE_START(t) uint64_t t = profile_now()
+#define PROFILE_SPAN(name, level, t) profile_span(name, level, t)
+#define PROFILE_SUCCESSOR(level, t) profile_successor(level, t)
+#define PROFILE_JOIN(level, hit) profile_join(level, hit)
+#else
+#define PROFILE_START(t)
+#define PROFILE_SPAN(name, level, t)
+#define PROFILE_SUCCESSOR(level, t)
+#define PROFILE_JOIN(level, hit)
+#endif
+
+/*** Profiler ***/
+uint64_t profile_now(void);
+void profile_span(const char *name, int level, uint64_t start);
+void profile_successor(int level, uint64_t start);
+void profile_join(int level, int hit);
+int profile_write_trace(const char *path);
+void profile_summary(FILE *fp);
+void profile_dump(void);
+
+#endif
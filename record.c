@@ -0,0 +1,351 @@
+#include "record.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*** Buffers ***/
+static int64_t now_ms(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int buf_append(RecordBuf *buf, const char *s, size_t len){
+	if (buf->len + len > buf->cap){
+		size_t cap = buf->cap ? buf->cap : RECORD_CHUNK;
+		while (cap < buf->len + len)
+			cap *= 2;
+		char *b = realloc(buf->b, cap);
+		if (b == NULL)
+			return -1;
+		buf->b = b;
+		buf->cap = cap;
+	}
+	memcpy(buf->b + buf->len, s, len);
+	buf->len += len;
+	return 0;
+}
+
+static void buf_free(RecordBuf *buf){
+	free(buf->b);
+	free(buf);
+}
+
+static void hand_over(Recorder *r){
+	// Queue the current buffer for the writer and start a new one
+	if (r->cur->len == 0)
+		return;
+	RecordBuf *fresh = calloc(1, sizeof(RecordBuf));
+	if (fresh == NULL)
+		return; // keep filling cur, it goes out on the next try
+	pthread_mutex_lock(&r->lock);
+	if (r->tail != NULL)
+		r->tail->next = r->cur;
+	else
+		r->queue = r->cur;
+	r->tail = r->cur;
+	pthread_cond_signal(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+	r->cur = fresh;
+	r->flushms = now_ms();
+}
+
+static void *writer_loop(void *arg){
+	Recorder *r = arg;
+	pthread_mutex_lock(&r->lock);
+	for (;;){
+		while (r->queue == NULL && !r->closing)
+			pthread_cond_wait(&r->cond, &r->lock);
+		RecordBuf *buf = r->queue;
+		if (buf == NULL)
+			break;
+		r->queue = buf->next;
+		if (r->queue == NULL)
+			r->tail = NULL;
+		pthread_mutex_unlock(&r->lock);
+		fwrite(buf->b, 1, buf->len, r->fp);
+		buf_free(buf);
+		pthread_mutex_lock(&r->lock);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+
+/*** Screen ***/
+static int screen_alloc(Recorder *r, int cols, int rows){
+	// (Re)size both screens, blank. -1 if out of memory
+	size_t n = (size_t)cols * rows;
+	RecordCell *screen = malloc(n * sizeof(RecordCell));
+	RecordCell *next = malloc(n * sizeof(RecordCell));
+	if (screen == NULL || next == NULL){
+		free(screen);
+		free(next);
+		return -1;
+	}
+	for (size_t i = 0; i < n; i++)
+		screen[i] = (RecordCell){.ch = " ", .attr = 0};
+	free(r->screen);
+	free(r->next);
+	r->screen = screen;
+	r->next = next;
+	r->cols = cols;
+	r->rows = rows;
+	return 0;
+}
+
+static int intern_attr(Recorder *r, const char *sgr, size_t len){
+	// State index for the SGR sequences sgr, -1 if the table or the entry is full
+	if (len >= RECORD_ATTR_LEN)
+		return -1;
+	for (int i = 1; i < r->nattrs; i++)
+		if (strlen(r->attrs[i]) == len && memcmp(r->attrs[i], sgr, len) == 0)
+			return i;
+	if (r->nattrs == RECORD_MAX_ATTRS)
+		return -1;
+	memcpy(r->attrs[r->nattrs], sgr, len);
+	r->attrs[r->nattrs][len] = '\0';
+	return r->nattrs++;
+}
+
+static int parse_frame(Recorder *r, const char *frame, int len){
+	// Lay frame out on r->next. It may hold text, "\r\n" and SGR sequences (ESC [ ... m),
+	// SGR 0 resets and anything else adds to the state. -1 for anything else
+	RecordCell *next = r->next;
+	for (int i = 0; i < r->cols * r->rows; i++)
+		next[i] = (RecordCell){.ch = " ", .attr = 0};
+	int x = 0, y = 0, attr = 0;
+	for (int i = 0; i < len; i++){
+		char c = frame[i];
+		if (c == '\r'){
+			x = 0;
+		} else if (c == '\n'){
+			y++;
+		} else if (c == '\x1b'){
+			int j = i + 1;
+			if (j >= len || frame[j] != '[')
+				return -1;
+			while (++j < len && ((frame[j] >= '0' && frame[j] <= '9') || frame[j] == ';'))
+				;
+			if (j >= len || frame[j] != 'm')
+				return -1;
+			if (j == i + 2 || (j == i + 3 && frame[i + 2] == '0')){
+				attr = 0;
+			} else {
+				char sgr[RECORD_ATTR_LEN];
+				size_t base = attr ? strlen(r->attrs[attr]) : 0, n = j + 1 - i;
+				if (base + n >= RECORD_ATTR_LEN)
+					return -1;
+				memcpy(sgr, r->attrs[attr], base);
+				memcpy(sgr + base, frame + i, n);
+				if ((attr = intern_attr(r, sgr, base + n)) < 0)
+					return -1;
+			}
+			i = j;
+		} else if ((unsigned char)c < ' '){
+			return -1;
+		} else if ((c & 0xc0) == 0x80){
+			// UTF-8 continuation, part of the character left of x
+			if (x == 0 || x > r->cols || y >= r->rows)
+				continue;
+			RecordCell *cell = &next[y * r->cols + x - 1];
+			size_t n = strnlen(cell->ch, sizeof(cell->ch));
+			if (n < sizeof(cell->ch))
+				cell->ch[n] = c;
+		} else {
+			if (x < r->cols && y < r->rows)
+				next[y * r->cols + x] = (RecordCell){.ch = {c}, .attr = attr};
+			x++;
+		}
+	}
+	return 0;
+}
+
+static int same(RecordCell a, RecordCell b){
+	return memcmp(a.ch, b.ch, sizeof(a.ch)) == 0 && a.attr == b.attr;
+}
+
+static int emit_diff(Recorder *r, RecordBuf *out){
+	// Terminal output taking r->screen to r->next, one cursor move per changed span
+	// of a row. Spans closer than RECORD_SPAN_GAP are merged
+	char seq[32];
+	for (int y = 0; y < r->rows; y++){
+		RecordCell *old = r->screen + y * r->cols, *new = r->next + y * r->cols;
+		int x = 0;
+		while (x < r->cols){
+			while (x < r->cols && same(old[x], new[x]))
+				x++;
+			if (x == r->cols)
+				break;
+			int end = x + 1, gap = 0;
+			for (int i = end; i < r->cols && gap < RECORD_SPAN_GAP; i++){
+				if (same(old[i], new[i])){
+					gap++;
+				} else {
+					end = i + 1;
+					gap = 0;
+				}
+			}
+			int n = snprintf(seq, sizeof(seq), "\x1b[%d;%dH", y + 1, x + 1);
+			if (buf_append(out, seq, n) < 0)
+				return -1;
+			int attr = 0;
+			for (; x < end; x++){
+				if (new[x].attr != attr){
+					if (attr != 0 && buf_append(out, "\x1b[m", 3) < 0)
+						return -1;
+					attr = new[x].attr;
+					if (attr != 0 && buf_append(out, r->attrs[attr], strlen(r->attrs[attr])) < 0)
+						return -1;
+				}
+				if (buf_append(out, new[x].ch, strnlen(new[x].ch, sizeof(new[x].ch))) < 0)
+					return -1;
+			}
+			if (attr != 0 && buf_append(out, "\x1b[m", 3) < 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+
+/*** Events ***/
+static int append_json(RecordBuf *buf, const char *s, size_t len){
+	// s as the inside of a JSON string
+	char esc[8];
+	for (size_t i = 0; i < len; i++){
+		unsigned char c = s[i];
+		int n;
+		if (c == '"' || c == '\\'){
+			esc[0] = '\\';
+			esc[1] = c;
+			n = 2;
+		} else if (c < ' '){
+			n = snprintf(esc, sizeof(esc), "\\u%04x", c);
+		} else {
+			esc[0] = c;
+			n = 1;
+		}
+		if (buf_append(buf, esc, n) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int append_event(Recorder *r, double t, char type, const char *data, size_t len){
+	char head[48];
+	int n = snprintf(head, sizeof(head), "[%.3f, \"%c\", \"", t, type);
+	size_t mark = r->cur->len;
+	if (buf_append(r->cur, head, n) < 0 || append_json(r->cur, data, len) < 0
+			|| buf_append(r->cur, "\"]\n", 3) < 0){
+		r->cur->len = mark; // drop a half written event
+		return -1;
+	}
+	return 0;
+}
+
+
+/*** Recording ***/
+Recorder *record_open(const char *path, int cols, int rows){
+	// Start an asciicast v2 file of a cols x rows screen. NULL if path can't be
+	// written or the writer can't start
+	Recorder *r = calloc(1, sizeof(Recorder));
+	if (r == NULL)
+		return NULL;
+	r->cur = calloc(1, sizeof(RecordBuf));
+	if (r->cur == NULL || screen_alloc(r, cols, rows) < 0 || (r->fp = fopen(path, "w")) == NULL)
+		goto fail;
+	r->nattrs = 1; // attrs[0] is plain
+	r->startms = r->flushms = now_ms();
+	fprintf(r->fp, "{\"version\": 2, \"width\": %d, \"height\": %d, \"timestamp\": %lld, "
+			"\"env\": {\"TERM\": \"xterm-256color\"}}\n", cols, rows, (long long)time(NULL));
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	if (pthread_create(&r->writer, NULL, writer_loop, r) != 0){
+		fclose(r->fp);
+		pthread_mutex_destroy(&r->lock);
+		pthread_cond_destroy(&r->cond);
+		r->fp = NULL;
+		goto fail;
+	}
+	return r;
+fail:
+	if (r->fp != NULL)
+		fclose(r->fp);
+	if (r->cur != NULL)
+		free(r->cur);
+	free(r->screen);
+	free(r->next);
+	free(r);
+	return NULL;
+}
+
+void record_frame(Recorder *r, double t, const char *frame, int len, int cx, int cy, int cols, int rows){
+	// Record what a full redraw of frame shows, the cursor at (cx, cy) 0-based on a
+	// cols x rows screen. t is seconds since the start, negative for the clock.
+	// Nothing goes out if the frame looks like the last one
+	if (r == NULL)
+		return;
+	if (t < 0)
+		t = (now_ms() - r->startms) / 1000.0;
+	RecordBuf out = {0};
+	char seq[32];
+	int n;
+	if (cols != r->cols || rows != r->rows){
+		if (screen_alloc(r, cols, rows) < 0)
+			return;
+		n = snprintf(seq, sizeof(seq), "%dx%d", cols, rows);
+		append_event(r, t, 'r', seq, n);
+		r->started = 0;
+	}
+	if (!r->started)
+		buf_append(&out, "\x1b[H\x1b[2J", 7);
+
+	if (parse_frame(r, frame, len) == 0){
+		if (emit_diff(r, &out) < 0)
+			goto done;
+		RecordCell *swap = r->screen;
+		r->screen = r->next;
+		r->next = swap;
+	} else {
+		// Not a screen this can model, send it whole and forget what is shown
+		if (r->started)
+			buf_append(&out, "\x1b[H\x1b[2J", 7);
+		buf_append(&out, frame, len);
+		for (int i = 0; i < r->cols * r->rows; i++)
+			r->screen[i] = (RecordCell){.ch = "", .attr = 0};
+	}
+	if (out.len > 0 || cx != r->cx || cy != r->cy || !r->started){
+		n = snprintf(seq, sizeof(seq), "\x1b[%d;%dH", cy + 1, cx + 1);
+		if (buf_append(&out, seq, n) == 0 && append_event(r, t, 'o', out.b, out.len) == 0){
+			r->cx = cx;
+			r->cy = cy;
+			r->started = 1;
+			r->frames++;
+			r->bytes += out.len;
+		}
+	}
+	if (r->cur->len >= RECORD_CHUNK || now_ms() - r->flushms >= RECORD_FLUSH_MS)
+		hand_over(r);
+done:
+	free(out.b);
+}
+
+void record_close(Recorder *r){
+	// Write out what is left, stop the writer and close the file
+	if (r == NULL)
+		return;
+	hand_over(r);
+	pthread_mutex_lock(&r->lock);
+	r->closing = 1;
+	pthread_cond_signal(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+	pthread_join(r->writer, NULL);
+	fclose(r->fp);
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->cond);
+	buf_free(r->cur);
+	free(r->screen);
+	free(r->next);
+	free(r);
+}
@@ -0,0 +1,63 @@
+#ifndef RECORD_H
+#define RECORD_H
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Session recording to an asciicast v2 file (asciinema play/upload).
+ * Frames are diffed cell by cell against the previous one and only the changed
+ * spans of each row go into the file, so long runs stay small. Events collect
+ * in memory and a background thread writes them out, a frame costs the
+ * editor its diff and never waits on the disk.
+ */
+
+/*** Defines ***/
+#define RECORD_CHUNK (64 * 1024) // bytes of events handed to the writer at once
+#define RECORD_FLUSH_MS 1000 // or this long after the last hand-over
+#define RECORD_MAX_ATTRS 16 // distinct SGR states in one screen
+#define RECORD_ATTR_LEN 32
+#define RECORD_SPAN_GAP 8 // unchanged cells worth rewriting rather than moving the cursor
+#define RECORD_COLS 80 // headless recordings when there is no terminal to measure
+#define RECORD_ROWS 24
+
+/*** Structs ***/
+typedef struct RecordBuf RecordBuf;
+struct RecordBuf {
+	char *b;
+	size_t len, cap;
+	RecordBuf *next;
+};
+
+typedef struct {
+	char ch[4]; // one UTF-8 character, NUL padded
+	unsigned char attr; // index into Recorder.attrs, 0 is plain
+} RecordCell;
+
+typedef struct {
+	FILE *fp;
+	int cols, rows;
+	RecordCell *screen; // what the player shows after the last frame
+	RecordCell *next; // the frame being diffed
+	int cx, cy;
+	int started; // a frame was recorded
+	char attrs[RECORD_MAX_ATTRS][RECORD_ATTR_LEN]; // SGR sequences that lead to each state
+	int nattrs;
+	int64_t startms, flushms;
+	int64_t frames;
+	uint64_t bytes;
+
+	RecordBuf *cur; // being filled by record_frame()
+	RecordBuf *queue, *tail; // full buffers for the writer thread
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int closing;
+	pthread_t writer;
+} Recorder;
+
+/*** Recording ***/
+Recorder *record_open(const char *path, int cols, int rows);
+void record_frame(Recorder *r, double t, const char *frame, int len, int cx, int cy, int cols, int rows);
+void record_close(Recorder *r);
+
+#endif
@@ -0,0 +1,341 @@
+#include "server.h"
+#include "hashlife.h"
+#include "pattern.h"
+#include "export.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*** Structs ***/
+typedef struct {
+	int fd;
+	Universe *u;
+	unsigned char *in; // bytes received, the start of the next request first
+	size_t inlen, incap;
+	unsigned char *out; // responses not written yet, from outpos
+	size_t outlen, outcap, outpos;
+} Client;
+
+static Client clients[SERVER_MAX_CLIENTS];
+static int nclients = 0;
+
+
+/*** Buffers ***/
+static int reserve(unsigned char **buf, size_t *cap, size_t need){
+	if (need <= *cap)
+		return 0;
+	size_t newcap = *cap ? *cap : 4096;
+	while (newcap < need)
+		newcap *= 2;
+	unsigned char *new = realloc(*buf, newcap);
+	if (new == NULL)
+		return -1;
+	*buf = new;
+	*cap = newcap;
+	return 0;
+}
+
+static void put64(unsigned char *p, uint64_t v){
+	memcpy(p, &v, sizeof(v));
+}
+
+static uint64_t get64(const unsigned char *p){
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static unsigned char *reply(Client *c, uint8_t status, size_t len){
+	// Queue a response header and return where its len bytes of payload go, NULL if out of memory
+	if (len > UINT32_MAX - 1 || reserve(&c->out, &c->outcap, c->outlen + 5 + len) != 0)
+		return NULL;
+	uint32_t framelen = (uint32_t)(len + 1);
+	unsigned char *p = c->out + c->outlen;
+	memcpy(p, &framelen, sizeof(framelen));
+	p[4] = status;
+	c->outlen += 5 + len;
+	return p + 5;
+}
+
+static void reply_error(Client *c, const char *msg){
+	unsigned char *p = reply(c, SERVER_ERROR, strlen(msg));
+	if (p != NULL)
+		memcpy(p, msg, strlen(msg));
+}
+
+
+/*** Requests ***/
+static void handle_region(Client *c, const unsigned char *req){
+	int64_t x = (int64_t)get64(req), y = (int64_t)get64(req + 8);
+	int64_t w = (int64_t)get64(req + 16), h = (int64_t)get64(req + 24);
+	if (w < 0 || h < 0 || (w > 0 && h > SERVER_MAX_REGION / w)){
+		reply_error(c, "region too large");
+		return;
+	}
+
+	size_t rowbytes = (size_t)(w + 7) / 8;
+	unsigned char *p = reply(c, SERVER_OK, 8 + rowbytes * (size_t)h);
+	if (p == NULL){
+		reply_error(c, "out of memory");
+		return;
+	}
+	memset(p + 8, 0, rowbytes * (size_t)h);
+
+	// Walk only the live cells of the rectangle, dead space costs nothing
+	Node *root = universe_root(c->u);
+	int64_t half = (int64_t)1 << (root->k - 1);
+	CellIter it;
+	int64_t cx, cy;
+	uint64_t count = 0;
+	cell_iter_init(&it, root, x + half, y + half, w, h);
+	while (cell_iter_next(&it, &cx, &cy)){
+		int64_t rx = cx - half - x, ry = cy - half - y;
+		p[8 + (size_t)ry * rowbytes + (size_t)rx / 8] |= 1 << (rx % 8);
+		count++;
+	}
+	put64(p, count);
+}
+
+static void handle_export(Client *c, const unsigned char *req, size_t len){
+	char path[SERVER_MAX_REQUEST + 1];
+	ExportOptions opt = {
+		.x = (int64_t)get64(req), .y = (int64_t)get64(req + 8),
+		.w = (int64_t)get64(req + 16), .h = (int64_t)get64(req + 24),
+		.scale = req[32], .format = req[33],
+	};
+	int64_t w, h;
+	if (export_size(&opt, &w, &h) != 0){
+		reply_error(c, "bad export region, scale or format");
+		return;
+	}
+	memcpy(path, req + 34, len - 34);
+	path[len - 34] = '\0';
+	if (export_image(universe_root(c->u), &opt, path) != 0){
+		reply_error(c, "unable to write image");
+		return;
+	}
+	unsigned char *p = reply(c, SERVER_OK, 16);
+	if (p != NULL){
+		put64(p, (uint64_t)w);
+		put64(p + 8, (uint64_t)h);
+	}
+}
+
+static void handle(Client *c, uint8_t op, const unsigned char *req, size_t len){
+	char path[SERVER_MAX_REQUEST + 1];
+	unsigned char *p;
+	BBox box;
+	Universe *u = c->u;
+
+	switch (op){
+		case OP_LOAD: {
+			memcpy(path, req, len);
+			path[len] = '\0';
+			unsigned rule = RULE_LIFE;
+			Node *root = readPattern(path, &rule);
+			if (root == NULL){
+				reply_error(c, "unable to read pattern");
+				break;
+			}
+			universe_set(u, root);
+			u->rule = rule;
+			if ((p = reply(c, SERVER_OK, 8)) != NULL)
+				put64(p, universe_population(u));
+			break;
+		}
+		case OP_ADVANCE: {
+			int64_t n = len == 8 ? (int64_t)get64(req) : -1;
+			if (n < 0){
+				reply_error(c, "bad generation count");
+				break;
+			}
+			if (n > INT64_MAX - u->gen){
+				reply_error(c, "generation count overflows");
+				break;
+			}
+			universe_advance(u, n);
+			if ((p = reply(c, SERVER_OK, 16)) != NULL){
+				put64(p, (uint64_t)u->gen);
+				put64(p + 8, universe_population(u));
+			}
+			break;
+		}
+		case OP_POPULATION:
+			if ((p = reply(c, SERVER_OK, 8)) != NULL)
+				put64(p, universe_population(u));
+			break;
+		case OP_BBOX: {
+			int found = universe_bbox(u, &box);
+			if ((p = reply(c, SERVER_OK, 33)) == NULL)
+				break;
+			if (!found)
+				box = (BBox){0, 0, 0, 0};
+			p[0] = (unsigned char)found;
+			put64(p + 1, (uint64_t)box.x0);
+			put64(p + 9, (uint64_t)box.y0);
+			put64(p + 17, (uint64_t)box.x1);
+			put64(p + 25, (uint64_t)box.y1);
+			break;
+		}
+		case OP_REGION:
+			if (len != 32)
+				reply_error(c, "region takes x, y, w, h");
+			else
+				handle_region(c, req);
+			break;
+		case OP_SAVE:
+			memcpy(path, req, len);
+			path[len] = '\0';
+			if (writePattern(universe_root(u), u->rule, path) != 0)
+				reply_error(c, "unable to write pattern");
+			else
+				reply(c, SERVER_OK, 0);
+			break;
+		case OP_HASH: {
+			Hash128 h = universe_hash(u);
+			if ((p = reply(c, SERVER_OK, 16)) != NULL){
+				put64(p, h.lo);
+				put64(p + 8, h.hi);
+			}
+			break;
+		}
+		case OP_ENGINE:
+			if (len != 1 || req[0] > ENGINE_AUTO){
+				reply_error(c, "unknown engine");
+				break;
+			}
+			universe_set_engine(u, req[0]);
+			if ((p = reply(c, SERVER_OK, 1)) != NULL)
+				p[0] = (unsigned char)universe_engine(u);
+			break;
+		case OP_EXPORT:
+			if (len <= 34)
+				reply_error(c, "export takes x, y, w, h, scale, format and a path");
+			else
+				handle_export(c, req, len);
+			break;
+		default:
+			reply_error(c, "unknown op");
+	}
+}
+
+static int process(Client *c){
+	// Answer every complete request in the input buffer. -1 on a malformed frame
+	size_t pos = 0;
+	while (c->inlen - pos >= 4){
+		uint32_t len;
+		memcpy(&len, c->in + pos, sizeof(len));
+		if (len == 0 || len > SERVER_MAX_REQUEST)
+			return -1;
+		if (c->inlen - pos < 4 + (size_t)len)
+			break;
+		handle(c, c->in[pos + 4], c->in + pos + 5, len - 1);
+		pos += 4 + len;
+	}
+	memmove(c->in, c->in + pos, c->inlen - pos);
+	c->inlen -= pos;
+	return 0;
+}
+
+
+/*** Connections ***/
+static void client_drop(int i){
+	Client *c = &clients[i];
+	close(c->fd);
+	universe_free(c->u);
+	free(c->in);
+	free(c->out);
+	clients[i] = clients[--nclients];
+}
+
+static void client_accept(int lfd){
+	int fd = accept(lfd, NULL, NULL);
+	if (fd == -1)
+		return;
+	Universe *u = nclients < SERVER_MAX_CLIENTS ? universe_new(get_zero(3), RULE_LIFE) : NULL;
+	if (u == NULL){
+		close(fd);
+		return;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	clients[nclients++] = (Client){.fd = fd, .u = u};
+	log_info("Client %d connected", fd);
+}
+
+static int client_read(Client *c){
+	// -1 once the client hung up or broke the framing
+	if (reserve(&c->in, &c->incap, c->inlen + 4096) != 0)
+		return -1;
+	ssize_t n = read(c->fd, c->in + c->inlen, c->incap - c->inlen);
+	if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR))
+		return -1;
+	if (n > 0)
+		c->inlen += n;
+	return process(c);
+}
+
+static int client_flush(Client *c){
+	while (c->outpos < c->outlen){
+		ssize_t n = write(c->fd, c->out + c->outpos, c->outlen - c->outpos);
+		if (n == -1)
+			return errno == EAGAIN || errno == EINTR ? 0 : -1;
+		c->outpos += n;
+	}
+	c->outpos = c->outlen = 0;
+	return 0;
+}
+
+int server_run(const char *path){
+	// Serve until killed. Returns -1 if the socket can't be set up
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	if (strlen(path) >= sizeof(addr.sun_path)){
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	signal(SIGPIPE, SIG_IGN); // a client going away shows up as a failed write
+
+	int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(path);
+	if (lfd == -1 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+			listen(lfd, SERVER_MAX_CLIENTS) == -1){
+		perror(path);
+		return -1;
+	}
+	log_info("Serving on %s", path);
+
+	struct pollfd fds[SERVER_MAX_CLIENTS + 1];
+	for (;;){
+		int n = nclients;
+		for (int i = 0; i < n; i++){
+			fds[i].fd = clients[i].fd;
+			fds[i].events = POLLIN | (clients[i].outlen > clients[i].outpos ? POLLOUT : 0);
+		}
+		fds[n].fd = lfd;
+		fds[n].events = POLLIN;
+		if (poll(fds, n + 1, -1) == -1){
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			return -1;
+		}
+
+		// backwards, so dropping a client only moves ones already handled
+		for (int i = n - 1; i >= 0; i--){
+			Client *c = &clients[i];
+			int failed = 0;
+			if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+				failed = client_read(c) != 0;
+			if (!failed)
+				failed = client_flush(c) != 0;
+			if (failed)
+				client_drop(i);
+		}
+		if (fds[n].revents & POLLIN)
+			client_accept(lfd);
+	}
+}
@@ -0,0 +1,54 @@
+#ifndef SERVER_H
+#define SERVER_H
+#include <stdint.h>
+
+/*
+ * Engine server on a Unix-domain socket, one universe per connection.
+ * Every integer is in native byte order, the socket never leaves the machine.
+ *
+ *   request:  u32 len | u8 op | payload      (len counts op and payload)
+ *   response: u32 len | u8 status | payload  (len counts status and payload)
+ *
+ * Requests can be pipelined, responses come back in request order.
+ * An error response carries a message instead of the payload.
+ *
+ *   op              request payload           response payload
+ *   OP_LOAD         path                      u64 population
+ *   OP_ADVANCE      i64 generations           i64 generation, u64 population
+ *   OP_POPULATION   -                         u64 population
+ *   OP_BBOX         -                         u8 found, i64 x0, y0, x1, y1
+ *   OP_REGION       i64 x, y, w, h            u64 live cells, rows of (w + 7) / 8 bytes,
+ *                                             bit x % 8 of byte x / 8 is cell x
+ *   OP_SAVE         path                      -
+ *   OP_HASH         -                         u64 lo, u64 hi of the content hash
+ *   OP_ENGINE       u8 ENGINE_*               u8 engine now stepping the cells,
+ *                                             ENGINE_HASHLIFE or ENGINE_TILE
+ *   OP_EXPORT       i64 x, y, w, h, u8 scale, u64 width, u64 height of the image,
+ *                   u8 EXPORT_*, path         see export.h
+ *
+ * Coordinates are relative to the centre of the universe, like in the editor.
+ * Boxes are upper left inclusive, lower right exclusive.
+ */
+
+/*** Defines ***/
+#define OP_LOAD       1
+#define OP_ADVANCE    2
+#define OP_POPULATION 3
+#define OP_BBOX       4
+#define OP_REGION     5
+#define OP_SAVE       6
+#define OP_HASH       7
+#define OP_ENGINE     8
+#define OP_EXPORT     9
+
+#define SERVER_OK    0
+#define SERVER_ERROR 1
+
+#define SERVER_MAX_CLIENTS 64
+#define SERVER_MAX_REQUEST 4096 // requests are small, only responses carry bulk data
+#define SERVER_MAX_REGION ((int64_t)1 << 30) // cells in one OP_REGION
+
+/*** Server ***/
+int server_run(const char *path);
+
+#endif
@@ -0,0 +1,573 @@
+#include "soup.h"
+#include "cycle.h"
+#include <time.h>
+#include <unistd.h>
+
+/*** Structs ***/
+typedef struct {
+	int64_t x, y;
+} Cell;
+
+typedef struct {
+	Hash128 shape; // content hash of one phase of the object, see normalize()
+	char name[SOUP_NAME_MAX];
+	int64_t count;
+	int64_t soup; // first soup it was found in
+} CensusEntry;
+
+typedef struct {
+	CensusEntry *tab; // open addressing on shape, so each phase is only named once
+	int cap, len;
+} Census;
+
+typedef struct {
+	const SoupOptions *opt;
+	int64_t next; // next soup to run, taken atomically
+} Search;
+
+typedef struct {
+	Search *s;
+	pthread_t tid;
+	Census census;
+	int64_t soups, unsettled, objects;
+	Cell *cells; // live cells of the settled soup
+	int *parent; // union-find over cells at most SOUP_GAP apart
+	int *touch; // and over touching cells
+	int *order; // cells grouped by object
+	int cap;
+} Worker;
+
+
+/*** Soups ***/
+static uint64_t next_random(uint64_t *s){
+	// splitmix64
+	uint64_t z = (*s += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+Node *soup_make(uint64_t seed, int64_t i){
+	// Soup i of a search, a SOUP_SIDE square around the centre of a PACK_LEVEL root.
+	// Caller is inside an engine section
+	uint64_t s = seed * 0x9e3779b97f4a7c15ULL ^ (uint64_t)i;
+	uint64_t rows[PACK_SIZE] = {0};
+	int corner = (PACK_SIZE - SOUP_SIDE) / 2;
+	for (int y = corner; y < corner + SOUP_SIDE; y++)
+		for (int x = corner; x < corner + SOUP_SIDE; x++)
+			if (next_random(&s) % 100 < SOUP_DENSITY)
+				rows[y] |= (uint64_t)1 << x;
+	return leaf_pack(rows);
+}
+
+static Node *settle(Node *p, unsigned rule){
+	// p once its population repeats over SOUP_REPEATS periods of SOUP_PERIOD, so
+	// oscillators and gliders flying off don't keep it going. NULL if that doesn't
+	// happen within SOUP_MAX_GENS
+	int same = 0;
+	for (int64_t gen = 0; gen < SOUP_MAX_GENS; gen += SOUP_PERIOD){
+		Node *q = advance(p, SOUP_PERIOD, rule);
+		same = q->n == p->n ? same + 1 : 0;
+		p = q;
+		if (same == SOUP_REPEATS)
+			return p;
+	}
+	return NULL;
+}
+
+
+/*** Objects ***/
+static void wechsler(const Cell *cells, int n, int orient, char *out){
+	// Extended Wechsler encoding of the cells flipped and transposed by orient: strips
+	// of 5 rows, one character per column, runs of empty columns shortened and the
+	// strips separated by 'z'. Cells span at most SOUP_MAX_SIDE on either side, so a
+	// run never outgrows 'y'
+	static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+	unsigned char grid[SOUP_MAX_SIDE][SOUP_MAX_SIDE] = {{0}};
+	int64_t x0 = INT64_MAX, y0 = INT64_MAX, w = 0, h = 0;
+	for (int pass = 0; pass < 2; pass++)
+		for (int i = 0; i < n; i++){
+			int64_t x = orient & 4 ? cells[i].y : cells[i].x;
+			int64_t y = orient & 4 ? cells[i].x : cells[i].y;
+			x = orient & 1 ? -x : x;
+			y = orient & 2 ? -y : y;
+			if (pass == 0){
+				x0 = min(x0, x);
+				y0 = min(y0, y);
+			} else {
+				grid[y - y0][x - x0] = 1;
+				w = max(w, x - x0 + 1);
+				h = max(h, y - y0 + 1);
+			}
+		}
+
+	int len = 0;
+	for (int strip = 0; strip < h; strip += 5){
+		if (strip > 0)
+			out[len++] = 'z';
+		int zeros = 0;
+		for (int x = 0; x < w; x++){
+			int v = 0;
+			for (int y = strip; y < strip + 5 && y < h; y++)
+				v |= grid[y][x] << (y - strip);
+			if (v == 0){
+				zeros++;
+				continue;
+			}
+			if (zeros == 1)
+				out[len++] = '0';
+			else if (zeros == 2)
+				out[len++] = 'w';
+			else if (zeros == 3)
+				out[len++] = 'x';
+			else if (zeros > 3){
+				out[len++] = 'y';
+				out[len++] = digits[zeros - 4];
+			}
+			zeros = 0;
+			out[len++] = digits[v];
+		}
+	}
+	out[len] = '\0';
+}
+
+static int phase_cells(Node *shape, const BBox *box, Cell *cells){
+	// Live cells of a normalize()d object, returns how many
+	CellIter it;
+	int n = 0;
+	cell_iter_init(&it, shape, 0, 0, box->x1 - box->x0, box->y1 - box->y0);
+	while (cell_iter_next(&it, &cells[n].x, &cells[n].y))
+		n++;
+	return n;
+}
+
+static int period_of(Node *p, unsigned rule, int *moves){
+	// Generations until the shape of p comes back, 0 if not within SOUP_MAX_PERIOD.
+	// moves is set if it comes back elsewhere
+	BBox box0, box;
+	Node *shape = normalize(p, &box0);
+	int64_t x0 = box0.x0 - ((int64_t)1 << (p->k - 1)), y0 = box0.y0 - ((int64_t)1 << (p->k - 1));
+	Node *q = p;
+	for (int t = 1; t <= SOUP_MAX_PERIOD && q->n > 0; t++){
+		q = advance(q, 1, rule);
+		if (normalize(q, &box) == shape){
+			*moves = box.x0 - ((int64_t)1 << (q->k - 1)) != x0 || box.y0 - ((int64_t)1 << (q->k - 1)) != y0;
+			return t;
+		}
+	}
+	return 0;
+}
+
+static void classify(Node *p, unsigned rule, char *name){
+	// The apgcode of an isolated object: its period and displacement from stepping it
+	// until its shape comes back, then the shortest, first in ASCII order, Wechsler
+	// encoding over its phases and 8 orientations
+	BBox box;
+	Node *shape = NULL;
+	int moves = 0, period = period_of(p, rule, &moves);
+	if (period == 0){
+		strcpy(name, SOUP_UNCLASSIFIED);
+		return;
+	}
+
+	char best[SOUP_CODE_MAX] = "", code[SOUP_CODE_MAX];
+	Cell *cells = NULL, *more;
+	for (int t = 0; t < period; t++){
+		if (t > 0)
+			p = advance(p, 1, rule);
+		shape = normalize(p, &box);
+		if (box.x1 - box.x0 > SOUP_MAX_SIDE || box.y1 - box.y0 > SOUP_MAX_SIDE || !(more = realloc(cells, p->n * sizeof(Cell)))){
+			strcpy(best, "#"); // too big to encode
+			break;
+		}
+		cells = more;
+		int n = phase_cells(shape, &box, cells);
+		for (int orient = 0; orient < 8; orient++){
+			wechsler(cells, n, orient, code);
+			size_t a = strlen(code), b = strlen(best);
+			if (b == 0 || a < b || (a == b && strcmp(code, best) < 0))
+				strcpy(best, code);
+		}
+	}
+	free(cells);
+	snprintf(name, SOUP_NAME_MAX, "x%c%u_%s", period == 1 ? 's' : moves ? 'q' : 'p',
+			period == 1 ? shape->n : (unsigned)period, best);
+}
+
+static int small_object(const Cell *cells, const int *idx, int n, Cell *corner){
+	// Whether cells idx[0..n) fit in a PACK_LEVEL node, with their upper left in corner
+	int64_t x1 = INT64_MIN, y1 = INT64_MIN;
+	corner->x = corner->y = INT64_MAX;
+	for (int i = 0; i < n; i++){
+		corner->x = min(corner->x, cells[idx[i]].x);
+		corner->y = min(corner->y, cells[idx[i]].y);
+		x1 = max(x1, cells[idx[i]].x);
+		y1 = max(y1, cells[idx[i]].y);
+	}
+	return x1 - corner->x < PACK_SIZE && y1 - corner->y < PACK_SIZE;
+}
+
+static Node *object_node(const Cell *cells, const int *idx, int n){
+	// The object made of cells idx[0..n), in a node of its own
+	Cell corner;
+	if (small_object(cells, idx, n, &corner)){ // nearly always
+		uint64_t rows[PACK_SIZE] = {0};
+		for (int i = 0; i < n; i++)
+			rows[cells[idx[i]].y - corner.y] |= (uint64_t)1 << (cells[idx[i]].x - corner.x);
+		return leaf_pack(rows);
+	}
+	int (*points)[2] = malloc(n * sizeof(*points));
+	if (points == NULL)
+		return NULL;
+	for (int i = 0; i < n; i++){
+		points[i][0] = (int)(cells[idx[i]].x - corner.x);
+		points[i][1] = (int)(cells[idx[i]].y - corner.y);
+	}
+	Node *p = construct(points, n);
+	free(points);
+	return p;
+}
+
+
+/*** Census ***/
+static CensusEntry *census_find(Census *c, Hash128 shape){
+	// The entry of shape, or the empty slot where it goes
+	size_t mask = c->cap - 1;
+	for (size_t i = shape.lo & mask;; i = (i + 1) & mask)
+		if (c->tab[i].count == 0 || hash_equal(c->tab[i].shape, shape))
+			return &c->tab[i];
+}
+
+static int census_grow(Census *c){
+	Census bigger = {.cap = c->cap ? 2 * c->cap : 256, .len = c->len};
+	bigger.tab = calloc(bigger.cap, sizeof(CensusEntry));
+	if (bigger.tab == NULL)
+		return -1;
+	for (int i = 0; i < c->cap; i++)
+		if (c->tab[i].count > 0)
+			*census_find(&bigger, c->tab[i].shape) = c->tab[i];
+	free(c->tab);
+	*c = bigger;
+	return 0;
+}
+
+static void census_add(Worker *w, Node *p, int64_t soup){
+	BBox box;
+	Node *shape = normalize(p, &box);
+	if (2 * (w->census.len + 1) > w->census.cap && census_grow(&w->census) != 0)
+		return;
+	CensusEntry *e = census_find(&w->census, shape->hash);
+	if (e->count == 0){
+		e->shape = shape->hash;
+		e->soup = soup;
+		classify(p, w->s->opt->rule, e->name);
+		w->census.len++;
+	}
+	e->count++;
+	e->soup = min(e->soup, soup);
+	w->objects++;
+}
+
+static int compare_cells(const void *a, const void *b){
+	const Cell *p = a, *q = b;
+	if (p->y != q->y)
+		return p->y < q->y ? -1 : 1;
+	return p->x < q->x ? -1 : p->x > q->x;
+}
+
+static int find(int *parent, int i){
+	while (parent[i] != i)
+		i = parent[i] = parent[parent[i]];
+	return i;
+}
+
+static int same_cells(Node *a, Node *b){
+	// Whether two nodes centred on the same point hold the same cells
+	while (a->k < b->k)
+		a = centre(a);
+	while (b->k < a->k)
+		b = centre(b);
+	return hash_equal(a->hash, b->hash);
+}
+
+static int independent(Node *const *parts, int n, Node *whole, int period, unsigned rule){
+	// Whether n parts centred like whole, together making it, run over period
+	// generations the same alone as they do together
+	Node *now[SOUP_MAX_PARTS];
+	memcpy(now, parts, n * sizeof(Node *));
+	for (int t = 1; t <= period; t++){
+		whole = advance(whole, 1, rule);
+		Node *all = now[0] = advance(now[0], 1, rule);
+		for (int i = 1; i < n; i++)
+			all = union_centred(all, now[i] = advance(now[i], 1, rule));
+		if (!same_cells(all, whole))
+			return 0;
+	}
+	return 1;
+}
+
+static int census_group(Worker *w, const int *idx, int n, int64_t soup){
+	// Census the cells idx[0..n), a group of split(). Its parts, the sets of touching
+	// cells, are objects of their own if they run alone over a period of the group as
+	// they do together, otherwise the parts that interact are merged, pair by pair
+	unsigned rule = w->s->opt->rule;
+	Cell corner;
+	if (!small_object(w->cells, idx, n, &corner)){
+		Node *obj = object_node(w->cells, idx, n);
+		if (obj == NULL)
+			return -1;
+		census_add(w, obj, soup);
+		return 0;
+	}
+
+	// Parts in PACK_LEVEL nodes with the same corner, so all of them are centred alike
+	uint64_t rows[SOUP_MAX_PARTS + 1][PACK_SIZE] = {{0}}; // and the whole group last
+	int roots[SOUP_MAX_PARTS], parts = 0;
+	for (int i = 0; i < n; i++){
+		const Cell *c = &w->cells[idx[i]];
+		int r = find(w->touch, idx[i]), j = 0;
+		while (j < parts && roots[j] != r)
+			j++;
+		if (j == parts && parts < SOUP_MAX_PARTS)
+			roots[parts++] = r;
+		j = min(j, SOUP_MAX_PARTS - 1); // too many parts, the rest go with the last
+		rows[j][c->y - corner.y] |= (uint64_t)1 << (c->x - corner.x);
+		rows[SOUP_MAX_PARTS][c->y - corner.y] |= (uint64_t)1 << (c->x - corner.x);
+	}
+	Node *whole = leaf_pack(rows[SOUP_MAX_PARTS]), *part[SOUP_MAX_PARTS];
+	for (int j = 0; j < parts; j++)
+		part[j] = leaf_pack(rows[j]);
+
+	int moves, period = parts > 1 ? period_of(whole, rule, &moves) : 0;
+	if (period > 0 && !independent(part, parts, whole, period, rule)){
+		// Merge the pairs that interact, then the groups they make must be independent
+		int group[SOUP_MAX_PARTS];
+		for (int j = 0; j < parts; j++)
+			group[j] = j;
+		for (int a = 0; a < parts; a++)
+			for (int b = a + 1; b < parts; b++){
+				if (find(group, a) == find(group, b))
+					continue;
+				Node *pair[2] = {part[a], part[b]}, *both = node_or(part[a], part[b]);
+				int t = period_of(both, rule, &moves);
+				if (t == 0 || !independent(pair, 2, both, t, rule))
+					group[find(group, a)] = find(group, b);
+			}
+		int merged = 0;
+		for (int j = 0; j < parts; j++)
+			if (find(group, j) != j)
+				part[find(group, j)] = node_or(part[find(group, j)], part[j]);
+		for (int j = 0; j < parts; j++)
+			if (find(group, j) == j)
+				part[merged++] = part[j];
+		parts = merged;
+		if (!independent(part, parts, whole, period, rule))
+			parts = 0;
+	}
+	if (period == 0 || parts == 0){
+		part[0] = whole;
+		parts = 1;
+	}
+	for (int j = 0; j < parts; j++)
+		census_add(w, part[j], soup);
+	return 0;
+}
+
+static int split(Worker *w, Node *p, int64_t soup){
+	// Census every object of a settled soup. Groups of live cells at most SOUP_GAP
+	// apart can't touch each other, so each runs the same on its own, then groups are
+	// split further where their parts do too, see census_group(). Returns -1 if the
+	// soup is too big or memory runs out
+	BBox box;
+	if (!bbox(p, &box))
+		return 0;
+	if (p->n > SOUP_MAX_CELLS)
+		return -1;
+	int n = p->n;
+	if (n > w->cap){
+		free(w->cells);
+		free(w->parent);
+		free(w->touch);
+		free(w->order);
+		w->cells = malloc(n * sizeof(Cell));
+		w->parent = malloc(2 * n * sizeof(int));
+		w->touch = malloc(n * sizeof(int));
+		w->order = malloc(n * sizeof(int));
+		w->cap = w->cells && w->parent && w->touch && w->order ? n : 0;
+		if (w->cap == 0)
+			return -1;
+	}
+	CellIter it;
+	int len = 0;
+	cell_iter_init(&it, p, box.x0, box.y0, box.x1 - box.x0, box.y1 - box.y0);
+	while (len < n && cell_iter_next(&it, &w->cells[len].x, &w->cells[len].y))
+		len++;
+	qsort(w->cells, len, sizeof(Cell), compare_cells);
+
+	int *parent = w->parent, *touch = w->touch;
+	for (int i = 0; i < len; i++)
+		parent[i] = touch[i] = i;
+	for (int i = 0; i < len; i++)
+		for (int dy = 0; dy <= SOUP_GAP; dy++)
+			for (int dx = -SOUP_GAP; dx <= SOUP_GAP; dx++){
+				if (dy == 0 && dx <= 0)
+					continue; // the other cell looks this way
+				Cell key = {.x = w->cells[i].x + dx, .y = w->cells[i].y + dy};
+				Cell *c = bsearch(&key, w->cells, len, sizeof(Cell), compare_cells);
+				if (c == NULL)
+					continue;
+				parent[find(parent, i)] = find(parent, c - w->cells);
+				if (dy <= 1 && dx >= -1 && dx <= 1)
+					touch[find(touch, i)] = find(touch, c - w->cells);
+			}
+
+	// Counting sort of the cells by object
+	int *start = parent + len, objects = 0;
+	for (int i = 0; i < len; i++)
+		start[i] = 0;
+	for (int i = 0; i < len; i++)
+		start[find(parent, i)]++;
+	for (int i = 0, sum = 0; i < len; i++){
+		int count = start[i];
+		start[i] = sum;
+		sum += count;
+		objects += count > 0;
+	}
+	for (int i = 0; i < len; i++)
+		w->order[start[find(parent, i)]++] = i;
+	for (int i = 0, first = 0; i < len; i++)
+		if (i == len - 1 || find(parent, w->order[i + 1]) != find(parent, w->order[i])){
+			if (census_group(w, w->order + first, i + 1 - first, soup) != 0)
+				return -1;
+			first = i + 1;
+		}
+	log_debug("Soup %lld settled with %d cells in %d objects", (long long)soup, len, objects);
+	return 0;
+}
+
+int soup_objects(Node *p, unsigned rule, SoupObject *objs, int max){
+	// The objects a settled pattern splits into, counted as a census would, up to max
+	// distinct ones. Returns how many, -1 if p is too big. Caller is inside an engine section
+	SoupOptions opt = {.rule = rule};
+	Search s = {.opt = &opt};
+	Worker w = {.s = &s};
+	int n = split(&w, p, 0) == 0 ? 0 : -1;
+	for (int i = 0; n >= 0 && i < w.census.cap; i++)
+		if (w.census.tab[i].count > 0 && n < max){
+			strcpy(objs[n].name, w.census.tab[i].name);
+			objs[n++].count = w.census.tab[i].count;
+		}
+	free(w.census.tab);
+	free(w.cells);
+	free(w.parent);
+	free(w.touch);
+	free(w.order);
+	return n;
+}
+
+static void *search_thread(void *arg){
+	Worker *w = arg;
+	const SoupOptions *opt = w->s->opt;
+	for (;;){
+		int64_t i = __atomic_fetch_add(&w->s->next, 1, __ATOMIC_RELAXED);
+		if (i >= opt->count)
+			break;
+		engine_enter();
+		Node *p = settle(soup_make(opt->seed, i), opt->rule);
+		if (p == NULL || split(w, p, i) != 0)
+			w->unsettled++;
+		engine_leave();
+		w->soups++;
+		gc_maybe();
+	}
+	return NULL;
+}
+
+static int compare_names(const void *a, const void *b){
+	return strcmp(((const CensusEntry *)a)->name, ((const CensusEntry *)b)->name);
+}
+
+static int compare_counts(const void *a, const void *b){
+	const CensusEntry *p = a, *q = b;
+	if (p->count != q->count)
+		return p->count > q->count ? -1 : 1;
+	return strcmp(p->name, q->name);
+}
+
+int soup_search(const SoupOptions *opt, const char *path){
+	// Run opt->count soups and write their census to path, most common objects first,
+	// one "apgcode count first-soup" line each. Returns -1 if the file can't be written
+	if (opt->count < 0)
+		return -1;
+	FILE *fp = fopen(path, "w");
+	if (fp == NULL)
+		return -1;
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	Search s = {.opt = opt};
+	int threads = opt->threads > 0 ? opt->threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+	threads = max(1, min(threads, SOUP_MAX_THREADS));
+	Worker *workers = calloc(threads, sizeof(Worker));
+	int started = 0;
+	while (workers && started < threads){
+		workers[started].s = &s;
+		if (pthread_create(&workers[started].tid, NULL, search_thread, &workers[started]) != 0)
+			break;
+		started++;
+	}
+	for (int i = 0; i < started; i++)
+		pthread_join(workers[i].tid, NULL);
+
+	// The threads named the same object from different phases, merge them by name
+	int64_t soups = 0, unsettled = 0, objects = 0;
+	int len = 0;
+	for (int i = 0; i < started; i++)
+		len += workers[i].census.len;
+	CensusEntry *all = malloc((len + 1) * sizeof(CensusEntry));
+	int n = 0;
+	for (int i = 0; i < started; i++){
+		Worker *w = &workers[i];
+		soups += w->soups;
+		unsettled += w->unsettled;
+		objects += w->objects;
+		for (int j = 0; all && j < w->census.cap; j++)
+			if (w->census.tab[j].count > 0)
+				all[n++] = w->census.tab[j];
+		free(w->census.tab);
+		free(w->cells);
+		free(w->parent);
+		free(w->touch);
+		free(w->order);
+	}
+	free(workers);
+	int distinct = 0;
+	if (all){
+		qsort(all, n, sizeof(CensusEntry), compare_names);
+		for (int i = 0; i < n; i++){
+			if (distinct > 0 && strcmp(all[distinct - 1].name, all[i].name) == 0){
+				all[distinct - 1].count += all[i].count;
+				all[distinct - 1].soup = min(all[distinct - 1].soup, all[i].soup);
+			} else
+				all[distinct++] = all[i];
+		}
+		qsort(all, distinct, sizeof(CensusEntry), compare_counts);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	char rule[24];
+	rule_format(opt->rule, rule, sizeof(rule));
+	int failed = all == NULL || soups < opt->count;
+	fprintf(fp, "# %lld soups of %dx%d at %d%%, rule %s, seed %llu\n", (long long)soups,
+			SOUP_SIDE, SOUP_SIDE, SOUP_DENSITY, rule, (unsigned long long)opt->seed);
+	fprintf(fp, "# %lld unsettled, %lld objects, %d distinct, %.0f ms on %d threads\n",
+			(long long)unsettled, (long long)objects, distinct,
+			(t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6, started);
+	if (unsettled > 0)
+		fprintf(fp, "%s %lld -\n", SOUP_UNSETTLED, (long long)unsettled);
+	for (int i = 0; i < distinct; i++)
+		fprintf(fp, "%s %lld %lld\n", all[i].name, (long long)all[i].count, (long long)all[i].soup);
+	free(all);
+	failed |= fclose(fp) != 0;
+	return failed ? -1 : 0;
+}
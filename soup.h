@@ -0,0 +1,51 @@
+#ifndef SOUP_H
+#define SOUP_H
+#include "hashlife.h"
+
+/*
+ * Soup search: random square fields run until they settle, then the debris is
+ * split into objects and counted into a census. Worker threads each take the
+ * next soup and run it through the shared node store and memo, so the blocks,
+ * blinkers and gliders every soup leaves behind are only ever computed once.
+ * Soup i of a search depends only on the seed and i, whatever the thread count.
+ * Objects are named with apgcodes: xs<population> still lifes, xp<period>
+ * oscillators and xq<period> spaceships, followed by the extended Wechsler
+ * encoding of their smallest phase and orientation (xs4_33 is the block).
+ */
+
+/*** Defines ***/
+#define SOUP_SIDE 16 // cells on a side of a soup
+#define SOUP_DENSITY 50 // percent of cells alive
+#define SOUP_PERIOD 120 // a soup is settled once its population repeats with a period dividing this
+#define SOUP_REPEATS 4 // over this many periods in a row
+#define SOUP_MAX_GENS (1 << 16) // soups still changing by then are counted as unsettled
+#define SOUP_MAX_CELLS (1 << 16) // settled soups with more cells aren't split into objects
+#define SOUP_MAX_PERIOD SOUP_PERIOD // objects that don't repeat within this are unclassified
+#define SOUP_GAP 2 // live cells this close (in both directions) are in the same group, see census_group()
+#define SOUP_MAX_PARTS 16 // touching parts of a group that are told apart, more go with the last
+#define SOUP_MAX_SIDE 40 // objects wider or higher than this aren't encoded, their apgcode ends in '#'
+#define SOUP_CODE_MAX ((SOUP_MAX_SIDE + 4) / 5 * (SOUP_MAX_SIDE + 1) + 1) // Wechsler code: a character per column of each 5 row strip, 'z' between strips, NUL
+#define SOUP_NAME_MAX 512 // "x", the kind, period or population and '_' ahead of the code
+#define SOUP_MAX_THREADS 64
+#define SOUP_UNSETTLED "unsettled" // census name of soups that didn't settle
+#define SOUP_UNCLASSIFIED "unclassified" // and of objects that didn't repeat
+
+/*** Structs ***/
+typedef struct {
+	int64_t count; // soups to run
+	uint64_t seed;
+	unsigned rule;
+	int threads; // 0 for one per core
+} SoupOptions;
+
+typedef struct {
+	char name[SOUP_NAME_MAX]; // apgcode
+	int64_t count;
+} SoupObject;
+
+/*** Soup search ***/
+Node *soup_make(uint64_t seed, int64_t i);
+int soup_search(const SoupOptions *opt, const char *path);
+int soup_objects(Node *p, unsigned rule, SoupObject *objs, int max);
+
+#endif
@@ -0,0 +1,97 @@
+#include "stats.h"
+#include "arena.h"
+
+static const char *spark[] = {"▁", "▂", "▃", "▄", "▅", "▆", "▇", "█"}; // 3 bytes each in UTF-8
+
+void stats_init(Stats *s){
+	s->head = 0;
+	s->len = 0;
+	s->csv = NULL;
+}
+
+int stats_open_csv(Stats *s, const char *path){
+	// Stream every later sample to path as CSV, -1 if it can't be written
+	FILE *fp = fopen(path, "w");
+	if (fp == NULL)
+		return -1;
+	stats_close_csv(s);
+	s->csv = fp;
+	fprintf(fp, "gen,population,x0,y0,x1,y1,nodes,memo_probes,memo_hits,arena_bytes,huge_bytes\n");
+	return 0;
+}
+
+void stats_close_csv(Stats *s){
+	if (s->csv != NULL)
+		fclose(s->csv);
+	s->csv = NULL;
+}
+
+Sample *stats_at(Stats *s, int i){
+	// i-th sample kept, 0 is the oldest
+	return &s->samples[(s->head + i) % STATS_SIZE];
+}
+
+void stats_record(Stats *s, Node *root, int64_t gen, uint64_t probes, uint64_t hits){
+	// Sample root at gen. Kept samples from gen on are dropped first, after an edit or
+	// a jump back they describe a different timeline
+	while (s->len > 0 && stats_at(s, s->len - 1)->gen >= gen)
+		s->len--;
+	if (s->len == STATS_SIZE){
+		s->head = (s->head + 1) % STATS_SIZE;
+		s->len--;
+	}
+
+	Sample *x = stats_at(s, s->len++);
+	*x = (Sample){.gen = gen, .pop = root->n, .nodes = __atomic_load_n(&nodecount, __ATOMIC_RELAXED),
+		.probes = probes, .hits = hits};
+	ArenaStats arena;
+	arena_stats(&arena);
+	x->arena = arena.mapped + arena.tables;
+	x->huge = arena.huge;
+	if (bbox(root, &x->box)){
+		int64_t half = (int64_t)1 << (root->k - 1);
+		x->box.x0 -= half;
+		x->box.x1 -= half;
+		x->box.y0 -= half;
+		x->box.y1 -= half;
+	}
+
+	if (s->csv == NULL)
+		return;
+	fprintf(s->csv, "%lld,%llu,", (long long)x->gen, (unsigned long long)x->pop);
+	if (x->box.x0 != x->box.x1)
+		fprintf(s->csv, "%lld,%lld,%lld,%lld,", (long long)x->box.x0, (long long)x->box.y0,
+				(long long)x->box.x1, (long long)x->box.y1);
+	else
+		fprintf(s->csv, ",,,,");
+	fprintf(s->csv, "%d,%llu,%llu,%zu,%zu\n", x->nodes, (unsigned long long)x->probes,
+			(unsigned long long)x->hits, x->arena, x->huge);
+}
+
+int stats_sparkline(Stats *s, char *buf, size_t len, int width){
+	// Population of the last width samples as block characters, scaled between their
+	// minimum and maximum. Returns the number of characters (not bytes) written
+	int n = s->len < width ? s->len : width;
+	if ((size_t)n * 3 + 1 > len)
+		n = len > 0 ? (int)((len - 1) / 3) : 0;
+	if (n <= 0){
+		if (len > 0)
+			buf[0] = '\0';
+		return 0;
+	}
+	uint64_t lo = UINT64_MAX, hi = 0;
+	for (int i = s->len - n; i < s->len; i++){
+		uint64_t pop = stats_at(s, i)->pop;
+		lo = pop < lo ? pop : lo;
+		hi = pop > hi ? pop : hi;
+	}
+	char *out = buf;
+	for (int i = s->len - n; i < s->len; i++){
+		uint64_t pop = stats_at(s, i)->pop;
+		int level = hi == lo ? 0 : (int)((pop - lo) * 7 / (hi - lo));
+		memcpy(out, spark[level], 3);
+		out += 3;
+	}
+	*out = '\0';
+	return n;
+}
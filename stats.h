@@ -0,0 +1,38 @@
+#ifndef STATS_H
+#define STATS_H
+#include <stdio.h>
+#include "hashlife.h"
+
+/*** Defines ***/
+#define STATS_SIZE 4096 // samples kept in memory, the CSV has all of them
+#define STATS_SPARK_WIDTH 24 // status bar sparkline, in samples
+
+/*** Structs ***/
+// One sample per step, taken from what advance() leaves behind: the root's population,
+// a bounding box found along its edges, the table sizes, the memo counters and the arena
+typedef struct {
+	int64_t gen;
+	uint64_t pop;
+	BBox box; // relative to the centre, x0 == x1 if the universe is empty
+	int nodes; // nodes in the hash table
+	uint64_t probes, hits; // memo lookups of the step that led here, 0 if nothing was computed
+	size_t arena; // bytes the node arena and hash table have mapped
+	size_t huge; // bytes on huge pages, see ArenaStats
+} Sample;
+
+typedef struct {
+	Sample samples[STATS_SIZE]; // ring, oldest at head
+	int head;
+	int len;
+	FILE *csv; // every sample is appended here too, NULL for none
+} Stats;
+
+/*** Stats ***/
+void stats_init(Stats *s);
+int stats_open_csv(Stats *s, const char *path);
+void stats_close_csv(Stats *s);
+void stats_record(Stats *s, Node *root, int64_t gen, uint64_t probes, uint64_t hits);
+Sample *stats_at(Stats *s, int i);
+int stats_sparkline(Stats *s, char *buf, size_t len, int width);
+
+#endif
@@ -1,57 +1,372 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <limits.h>
-#define MAX_NODES 7919
-unsigned int node_hash1(int *a, int *b, int *c, int *d) { 
-	// die after ~ 600 iters at size = 7919. But fluctuate between 500 -> 1500
-	unsigned int h = (unsigned int) a;
-	h *= 37;
-	h += (unsigned int) b;
-	h *= 37;
-	h += (unsigned int) c;
-	h *= 37;
-	h += (unsigned int) d;
-	return h % MAX_NODES;
-}
-
-
-unsigned int node_hash2(int *a, int *b, int *c, int *d) {
-	// Consistent at around 800
-	unsigned int h = ((unsigned int)d) + 3*( 
-			((unsigned int)c) + 3*( 
-				((unsigned int)b) + 3*((unsigned int)a) + 3 
-				));
-	return h % MAX_NODES;
-}
-
-unsigned int node_hash3(a,b,c,d) {
-	// Fluctuate between 500-1500 but more consistent at 750
-	unsigned int h = 65537*(unsigned int)(d)+257*(unsigned int)(c)+17*(unsigned int)(b)+5*(unsigned int)(a);
-	return h % MAX_NODES;
-}
-int main(){
-	int *table;
-	table = (int *)calloc(MAX_NODES, sizeof(int));
-	printf("Allocated %d int\n", MAX_NODES);
-	//for (int i=0; i< MAX_NODES; i++){
-	//	table[i] = 1;
-	//}
-	for (int i=0; i< 10000000; i++){
-		int *a = (int *)malloc(sizeof(int));
-		int *b = (int *)malloc(sizeof(int));
-		int *c = (int *)malloc(sizeof(int));
-		int *d = (int *)malloc(sizeof(int));
-		int h = node_hash2(a, b, c, d);
-		printf("Iter: %d - hash:%d\n", i, h);
-		if (table[h] != NULL){
-			printf("Hash collision at iter:%d with hash: %d\n", i, h);
-			printf("Value is: %d\n", table[h]);
-			exit(0);
-		}else{
-			table[h] = 2;
+// Hash benchmark: records the join() keys of real runs over Macrocell patterns and
+// replays them against candidate hash functions and table designs, reporting probe
+// lengths, time and cache misses (perf counters, when the kernel lets us) per join.
+// The time of the recorded advance() itself is printed too, for engine changes.
+//
+//   make test_hash && ./test_hash.o [-g generations] [-n max joins] [-s initial buckets] patterns/*.mc
+#include "hashlife.h"
+#include "pattern.h"
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#define PROBE_BUCKETS 7 // 0, 1, 2, 3, 4, 5-8, more
+#define USAGE "usage: %s [-g generations] [-n max joins] [-s initial buckets] pattern.mc...\n"
+
+/*** Structs ***/
+typedef struct {
+	Node *a, *b, *c, *d;
+} Key;
+
+typedef struct Entry Entry;
+struct Entry {
+	Key key;
+	uint64_t h; // kept for rehashing
+	Entry *next;
+};
+
+typedef uint64_t (*HashFn)(const Key *k);
+
+typedef struct {
+	Entry **slots;
+	size_t size, count;
+	Entry *pool; // entries come from here, one per distinct key
+	size_t used;
+} Table;
+
+// returns the number of entries compared to find or insert k
+typedef int (*FindFn)(Table *t, const Key *k, uint64_t h);
+
+typedef struct {
+	uint64_t probes[PROBE_BUCKETS];
+	uint64_t total, max;
+	double ns;
+	long long misses; // -1 without perf counters
+} Stats;
+
+/*** Key stream ***/
+static Key *keys;
+static size_t nkeys = 0, maxkeys = (size_t)1 << 22;
+
+static void record(Node *a, Node *b, Node *c, Node *d){
+	if (nkeys < maxkeys)
+		keys[nkeys++] = (Key){a, b, c, d};
+}
+
+
+/*** Hash functions ***/
+static uint64_t mix64(uint64_t x){
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+static uint64_t hash_linear(const Key *k){
+	// node_hash() as the engine uses it
+	return node_hash(k->a, k->b, k->c, k->d);
+}
+
+static uint64_t hash_horner37(const Key *k){
+	uint64_t h = (uintptr_t)k->a;
+	h = h * 37 + (uintptr_t)k->b;
+	h = h * 37 + (uintptr_t)k->c;
+	h = h * 37 + (uintptr_t)k->d;
+	return h;
+}
+
+static uint64_t hash_horner3(const Key *k){
+	return (uintptr_t)k->d + 3 * ((uintptr_t)k->c + 3 * ((uintptr_t)k->b + 3 * (uintptr_t)k->a + 3));
+}
+
+static uint64_t hash_mix(const Key *k){
+	// Pointers are 16 byte aligned, drop the dead bits and mix the rest
+	uint64_t h = mix64((uintptr_t)k->a >> 4);
+	h = mix64(h ^ ((uintptr_t)k->b >> 4));
+	h = mix64(h ^ ((uintptr_t)k->c >> 4));
+	return mix64(h ^ ((uintptr_t)k->d >> 4));
+}
+
+static uint64_t hash_content(const Key *k){
+	// content_hash() of the children, costs a read of each child
+	return content_hash(k->a, k->b, k->c, k->d).lo;
+}
+
+static struct {
+	const char *name;
+	HashFn fn;
+} hashes[] = {
+	{"linear", hash_linear},
+	{"horner37", hash_horner37},
+	{"horner3", hash_horner3},
+	{"mix64", hash_mix},
+	{"content", hash_content},
+};
+
+
+/*** Tables ***/
+static int same(const Key *x, const Key *y){
+	return x->a == y->a && x->b == y->b && x->c == y->c && x->d == y->d;
+}
+
+static Entry *new_entry(Table *t, const Key *k, uint64_t h){
+	Entry *e = &t->pool[t->used++];
+	*e = (Entry){.key = *k, .h = h, .next = NULL};
+	t->count++;
+	return e;
+}
+
+static void rehash_chains(Table *t, size_t newsize, int prime){
+	Entry **slots = calloc(newsize, sizeof(Entry *));
+	for (size_t i = 0; i < t->size; i++){
+		Entry *e = t->slots[i];
+		while (e){
+			Entry *next = e->next;
+			size_t j = prime ? e->h % newsize : e->h & (newsize - 1);
+			e->next = slots[j];
+			slots[j] = e;
+			e = next;
 		}
 	}
-	printf("Done");
-	return 0;
+	free(t->slots);
+	t->slots = slots;
+	t->size = newsize;
+}
+
+static int find_chain(Table *t, const Key *k, uint64_t h, int prime){
+	size_t i = prime ? h % t->size : h & (t->size - 1);
+	int probes = 0;
+	for (Entry *e = t->slots[i]; e; e = e->next){
+		probes++;
+		if (same(&e->key, k))
+			return probes;
+	}
+	Entry *e = new_entry(t, k, h);
+	e->next = t->slots[i];
+	t->slots[i] = e;
+	if (t->count >= t->size) // same growth rule as resize()
+		rehash_chains(t, prime ? (size_t)next_prime((int)(t->size * 2)) : t->size * 2, prime);
+	return probes;
+}
+
+static int find_chain_prime(Table *t, const Key *k, uint64_t h){
+	return find_chain(t, k, h, 1);
+}
+
+static int find_chain_pow2(Table *t, const Key *k, uint64_t h){
+	return find_chain(t, k, h, 0);
+}
+
+static int find_linear(Table *t, const Key *k, uint64_t h){
+	// Open addressing with linear probing, kept at most half full
+	size_t mask = t->size - 1, i = h & mask;
+	int probes = 0;
+	for (; t->slots[i]; i = (i + 1) & mask){
+		probes++;
+		if (same(&t->slots[i]->key, k))
+			return probes;
+	}
+	t->slots[i] = new_entry(t, k, h);
+	if (t->count * 2 >= t->size){
+		Entry **old = t->slots;
+		size_t oldsize = t->size;
+		t->size *= 2;
+		t->slots = calloc(t->size, sizeof(Entry *));
+		for (size_t j = 0; j < oldsize; j++){
+			if (!old[j])
+				continue;
+			size_t s = old[j]->h & (t->size - 1);
+			while (t->slots[s])
+				s = (s + 1) & (t->size - 1);
+			t->slots[s] = old[j];
+		}
+		free(old);
+	}
+	return probes;
+}
+
+static struct {
+	const char *name;
+	FindFn find;
+	int prime; // bucket count is a prime rather than a power of 2
+} tables[] = {
+	{"chain-prime", find_chain_prime, 1},
+	{"chain-pow2", find_chain_pow2, 0},
+	{"linear-pow2", find_linear, 0},
+};
+
+
+/*** Perf counters ***/
+static int perf_open(){
+	// Cache misses of this thread, -1 if perf events aren't available
+#ifdef __linux__
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+	return -1;
+#endif
+}
+
+static void perf_start(int fd){
+#ifdef __linux__
+	if (fd >= 0){
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+#else
+	(void)fd;
+#endif
+}
+
+static long long perf_stop(int fd){
+	long long count = -1;
+#ifdef __linux__
+	if (fd >= 0){
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fd, &count, sizeof(count)) != sizeof(count))
+			count = -1;
+	}
+#else
+	(void)fd;
+#endif
+	return count;
+}
+
+
+/*** Replay ***/
+static double now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static Stats replay(HashFn hash, FindFn find, int prime, size_t initsize, int perf){
+	Stats s;
+	memset(&s, 0, sizeof(s));
+	Table t = {.size = prime ? (size_t)next_prime((int)initsize) : initsize};
+	t.slots = calloc(t.size, sizeof(Entry *));
+	t.pool = malloc(nkeys * sizeof(Entry));
+	if (t.slots == NULL || t.pool == NULL){
+		fprintf(stderr, "Out of memory for %zu joins\n", nkeys);
+		exit(1);
+	}
+
+	static const int limits[PROBE_BUCKETS - 1] = {0, 1, 2, 3, 4, 8};
+	double start = now_ns();
+	perf_start(perf);
+	for (size_t i = 0; i < nkeys; i++){
+		int probes = find(&t, &keys[i], hash(&keys[i]));
+		int b = 0;
+		while (b < PROBE_BUCKETS - 1 && probes > limits[b])
+			b++;
+		s.probes[b]++;
+		s.total += probes;
+		if ((uint64_t)probes > s.max)
+			s.max = probes;
+	}
+	s.misses = perf_stop(perf);
+	s.ns = now_ns() - start;
+
+	free(t.slots);
+	free(t.pool);
+	return s;
+}
+
+static void report(const char *hash, const char *table, Stats *s){
+	printf("%-9s %-12s %6.2f", hash, table, (double)s->total / nkeys);
+	for (int b = 0; b < PROBE_BUCKETS; b++)
+		printf(" %5.1f", 100.0 * s->probes[b] / nkeys);
+	printf(" %5llu %8.1f", (unsigned long long)s->max, s->ns / nkeys);
+	if (s->misses >= 0)
+		printf(" %8.2f\n", (double)s->misses / nkeys);
+	else
+		printf("      n/a\n");
+}
+
+static size_t distinct(){
+	// One chained replay just to count the nodes the run creates
+	Table t = {.size = (size_t)next_prime(HASH_INIT_SIZE)};
+	t.slots = calloc(t.size, sizeof(Entry *));
+	t.pool = malloc(nkeys * sizeof(Entry));
+	for (size_t i = 0; i < nkeys; i++)
+		find_chain_prime(&t, &keys[i], hash_mix(&keys[i]));
+	free(t.slots);
+	free(t.pool);
+	return t.count;
 }
 
+
+int main(int argc, char *argv[]){
+	int gens = 1 << 16;
+	size_t initsize = HASH_INIT_SIZE;
+	int opt;
+	while ((opt = getopt(argc, argv, "g:n:s:")) != -1){
+		switch (opt){
+			case 'g': gens = atoi(optarg); break;
+			case 'n': maxkeys = (size_t)atoll(optarg); break;
+			case 's': initsize = (size_t)atoll(optarg); break;
+			default:
+				fprintf(stderr, USAGE, argv[0]);
+				return 1;
+		}
+	}
+	if (optind == argc){ // nothing to replay
+		fprintf(stderr, USAGE, argv[0]);
+		return 1;
+	}
+	if (initsize & (initsize - 1)){
+		fprintf(stderr, "initial buckets must be a power of 2\n");
+		return 1;
+	}
+
+	log_set_quiet(true);
+	init_hashtab();
+	keys = malloc(maxkeys * sizeof(Key));
+	int perf = perf_open();
+	if (keys == NULL){
+		fprintf(stderr, "Out of memory for %zu joins\n", maxkeys);
+		return 1;
+	}
+
+	for (int i = optind; i < argc; i++){
+		unsigned rule = RULE_LIFE;
+		Node *p = readPattern(argv[i], &rule);
+		if (p == NULL){
+			fprintf(stderr, "Unable to read %s\n", argv[i]);
+			continue;
+		}
+
+		// The keys of one real advance(), nodes stay alive so the content hash can read them
+		nkeys = 0;
+		join_trace = record;
+		double start = now_ns();
+		advance(p, gens, rule);
+		double ms = (now_ns() - start) / 1e6;
+		join_trace = NULL;
+
+		printf("\n%s: %d generations in %.1f ms, %zu joins%s, %zu distinct\n", argv[i], gens, ms, nkeys,
+				nkeys == maxkeys ? " (capped)" : "", distinct());
+		replay(hash_linear, find_chain_prime, 1, initsize, -1); // warm up caches and the allocator
+		printf("%-9s %-12s %6s %5s %5s %5s %5s %5s %5s %5s %5s %8s %8s\n", "hash", "table", "probes",
+				"0%", "1%", "2%", "3%", "4%", "5-8%", ">8%", "max", "ns/join", "miss/join");
+		for (size_t h = 0; h < sizeof(hashes) / sizeof(*hashes); h++)
+			for (size_t t = 0; t < sizeof(tables) / sizeof(*tables); t++){
+				Stats s = replay(hashes[h].fn, tables[t].find, tables[t].prime, initsize, perf);
+				report(hashes[h].name, tables[t].name, &s);
+			}
+	}
+	return 0;
+}
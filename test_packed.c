@@ -0,0 +1,188 @@
+// Checks of packed leaves: dense PACK_LEVEL nodes stored as rows of bits must
+// answer joins, steps and queries like the subtrees they stand for, at their own
+// level and in nodes above and below it, before and after the hash table grows
+#include <stdio.h>
+#include <string.h>
+#include "hashlife.h"
+#include "log.h"
+
+static int fails = 0;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { fails++; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } \
+} while (0)
+
+#define GRID 256 // side of the naive grid, the leaf sits in its middle
+#define STEPS 24 // generations checked against it
+
+static uint64_t state = 1;
+
+static uint64_t next_random(){
+	state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+	return state >> 11;
+}
+
+static void random_rows(uint64_t *rows){
+	// A soup filling the whole leaf, dense enough to be packed
+	for (int y = 0; y < PACK_SIZE; y++)
+		rows[y] = next_random() << 32 ^ next_random();
+}
+
+static int cell(const uint64_t *rows, int64_t x, int64_t y){
+	return x >= 0 && x < PACK_SIZE && y >= 0 && y < PACK_SIZE && (rows[y] >> x & 1);
+}
+
+/*** Naive stepper ***/
+static unsigned char grid[GRID][GRID], next[GRID][GRID];
+
+static void naive_step(unsigned rule){
+	for (int y = 1; y < GRID - 1; y++)
+		for (int x = 1; x < GRID - 1; x++){
+			int count = grid[y - 1][x - 1] + grid[y - 1][x] + grid[y - 1][x + 1]
+				+ grid[y][x - 1] + grid[y][x + 1]
+				+ grid[y + 1][x - 1] + grid[y + 1][x] + grid[y + 1][x + 1];
+			next[y][x] = (rule >> (grid[y][x] ? RULE_SURVIVE + count : count)) & 1;
+		}
+	memcpy(grid, next, sizeof(grid));
+}
+
+static int same_as_grid(Node *p){
+	// Whether the cells of p, around its centre, are those of the grid around its middle
+	int64_t half = (int64_t)1 << (p->k - 1), x, y;
+	uint64_t n = 0, want = 0;
+	for (int i = 0; i < GRID; i++)
+		for (int j = 0; j < GRID; j++)
+			want += grid[i][j];
+	BBox box;
+	if (bbox(p, &box)){
+		CellIter it;
+		cell_iter_init(&it, p, box.x0, box.y0, box.x1 - box.x0, box.y1 - box.y0);
+		while (cell_iter_next(&it, &x, &y)){
+			x += GRID / 2 - half;
+			y += GRID / 2 - half;
+			if (x < 0 || x >= GRID || y < 0 || y >= GRID || !grid[y][x])
+				return 0;
+			n++;
+		}
+	}
+	return n == want && p->n == want;
+}
+
+/*** Tests ***/
+static void test_join(const uint64_t *rows, Node *p){
+	// The children of a packed leaf join back into the same node, and four packed
+	// leaves make a node above them with every cell in place
+	Node *q[4];
+	node_quads(p, q);
+	CHECK(join(q[0], q[1], q[2], q[3]) == p, "quads of a packed leaf join into another node");
+	unsigned n = 0;
+	for (int i = 0; i < 4; i++)
+		n += q[i]->n;
+	CHECK(n == p->n, "quads hold %u cells, the leaf %u", n, p->n);
+
+	Node *big = join(p, p, p, p);
+	CHECK(big->k == PACK_LEVEL + 1 && big->n == 4 * p->n, "join of four leaves: level %d population %u", big->k, big->n);
+	CHECK(population(big, PACK_SIZE, PACK_SIZE, PACK_SIZE, PACK_SIZE) == p->n, "population of the last quadrant");
+	CHECK(population(big, 1, 2, 1, 1) == (uint64_t)cell(rows, 1, 2), "single cell of the first quadrant");
+	CHECK(population(big, PACK_SIZE + 5, 7, 1, 1) == (uint64_t)cell(rows, 5, 7), "single cell of the second quadrant");
+}
+
+static void test_queries(const uint64_t *rows, Node *p){
+	// population() and cell_iter over random rectangles, some reaching outside the leaf
+	for (int t = 0; t < 500; t++){
+		int64_t x = (int64_t)(next_random() % (PACK_SIZE + 16)) - 8, y = (int64_t)(next_random() % (PACK_SIZE + 16)) - 8;
+		int64_t w = next_random() % (PACK_SIZE + 8), h = next_random() % (PACK_SIZE + 8);
+		uint64_t want = 0;
+		for (int64_t j = y; j < y + h; j++)
+			for (int64_t i = x; i < x + w; i++)
+				want += cell(rows, i, j);
+		uint64_t n = population(p, x, y, w, h);
+		CHECK(n == want, "population of %lldx%lld at %lld,%lld: %llu, want %llu", (long long)w, (long long)h,
+				(long long)x, (long long)y, (unsigned long long)n, (unsigned long long)want);
+
+		CellIter it;
+		int64_t cx, cy;
+		uint64_t m = 0;
+		int bad = 0;
+		cell_iter_init(&it, p, x, y, w, h);
+		while (cell_iter_next(&it, &cx, &cy)){
+			bad += cx < x || cx >= x + w || cy < y || cy >= y + h || !cell(rows, cx, cy);
+			m++;
+		}
+		CHECK(m == want && bad == 0, "cell_iter of %lldx%lld at %lld,%lld: %llu cells, %d wrong", (long long)w, (long long)h,
+				(long long)x, (long long)y, (unsigned long long)m, bad);
+	}
+	BBox box;
+	CHECK(bbox(p, &box) && box.x1 - box.x0 <= PACK_SIZE && box.y1 - box.y0 <= PACK_SIZE, "bbox of a packed leaf");
+}
+
+static void test_successor(const uint64_t *rows, Node *p){
+	// A packed leaf stepped one generation at a time and in jumps, against the naive grid
+	static const int64_t jumps[] = {1, 2, 3, 8, 10};
+	memset(grid, 0, sizeof(grid));
+	for (int y = 0; y < PACK_SIZE; y++)
+		for (int x = 0; x < PACK_SIZE; x++)
+			grid[GRID / 2 - PACK_SIZE / 2 + y][GRID / 2 - PACK_SIZE / 2 + x] = cell(rows, x, y);
+	int64_t gen = 0;
+	Node *q = p;
+	for (size_t i = 0; i < sizeof(jumps) / sizeof(jumps[0]) && gen + jumps[i] <= STEPS; i++){
+		for (int64_t t = 0; t < jumps[i]; t++)
+			naive_step(RULE_LIFE);
+		gen += jumps[i];
+		q = advance(q, jumps[i], RULE_LIFE);
+		CHECK(same_as_grid(q), "packed leaf differs from the grid at generation %lld", (long long)gen);
+		CHECK(advance(p, gen, RULE_LIFE) == q, "one jump of %lld differs from several", (long long)gen);
+	}
+}
+
+static void test_levels(Node *p){
+	// Growing a packed leaf into bigger nodes and shrinking it back gives the leaf again
+	Node *up = centre(p);
+	CHECK(up->k == PACK_LEVEL + 1 && up->n == p->n, "centre of a packed leaf: level %d", up->k);
+	CHECK(inner(up) == p, "inner of the centred leaf isn't the leaf");
+	CHECK(inner(inner(centre(up))) == p, "two levels up and down");
+	Node *padded = pad(p);
+	CHECK(padded->k > PACK_LEVEL && padded->n == p->n, "pad of a packed leaf");
+	Node *cropped = crop(padded);
+	CHECK(cropped->n == p->n, "crop of the padded leaf keeps %u of %u cells", cropped->n, p->n);
+	while (cropped->k > PACK_LEVEL)
+		cropped = inner(cropped);
+	CHECK(cropped == p, "crop lost the leaf");
+}
+
+static void test_resize(const uint64_t *rows, Node *p){
+	// Packed leaves are found again once the hash table has grown under them
+	uint64_t sparse[PACK_SIZE];
+	int buckets = hashsize;
+	while (hashsize == buckets){
+		memset(sparse, 0, sizeof(sparse));
+		for (int y = 0; y < 8; y++)
+			sparse[y] = next_random() >> 45; // one 8x8 block, never packed
+		leaf_pack(sparse);
+	}
+	CHECK(leaf_pack(rows) == p, "packed leaf not found after the table grew to %d buckets", hashsize);
+	Node *q[4];
+	node_quads(p, q);
+	CHECK(join(q[0], q[1], q[2], q[3]) == p, "joined leaf not found after the table grew");
+}
+
+int main(){
+	log_set_quiet(true);
+	init_hashtab();
+	uint64_t rows[PACK_SIZE];
+	engine_enter();
+	for (int t = 0; t < 8; t++){
+		random_rows(rows);
+		Node *p = leaf_pack(rows);
+		CHECK(p->packed && p->k == PACK_LEVEL, "random leaf %d: packed %d level %d", t, p->packed, p->k);
+		test_join(rows, p);
+		test_queries(rows, p);
+		test_successor(rows, p);
+		test_levels(p);
+	}
+	random_rows(rows);
+	test_resize(rows, leaf_pack(rows));
+	engine_leave();
+	printf("%s\n", fails ? "test_packed FAILED" : "test_packed passed");
+	return fails ? 1 : 0;
+}
@@ -0,0 +1,419 @@
+// End to end check of ./lifeterm.o --serve: starts a server, pipelines requests
+// over the socket and checks the answers against what the glider must do
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "server.h"
+#include "hashlife.h"
+#include "export.h"
+
+static int fails = 0;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { fails++; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } \
+} while (0)
+
+/*** Framing ***/
+static unsigned char out[1 << 16];
+static size_t outlen = 0;
+
+static void request(uint8_t op, const void *payload, uint32_t len){
+	uint32_t framelen = len + 1;
+	memcpy(out + outlen, &framelen, 4);
+	out[outlen + 4] = op;
+	memcpy(out + outlen + 5, payload, len);
+	outlen += 5 + len;
+}
+
+static void request64(uint8_t op, const int64_t *args, int n){
+	request(op, args, n * sizeof(int64_t));
+}
+
+static void send_all(int fd){
+	for (size_t pos = 0; pos < outlen; ){
+		ssize_t n = write(fd, out + pos, outlen - pos);
+		if (n <= 0){
+			perror("write");
+			exit(1);
+		}
+		pos += n;
+	}
+	outlen = 0;
+}
+
+static void read_full(int fd, void *buf, size_t len){
+	for (size_t pos = 0; pos < len; ){
+		ssize_t n = read(fd, (char *)buf + pos, len - pos);
+		if (n <= 0){
+			fprintf(stderr, "server closed the connection\n");
+			exit(1);
+		}
+		pos += n;
+	}
+}
+
+static unsigned char *response(int fd, uint8_t *status, uint32_t *len){
+	// Next response, caller frees the payload
+	uint32_t framelen;
+	read_full(fd, &framelen, 4);
+	read_full(fd, status, 1);
+	*len = framelen - 1;
+	unsigned char *p = malloc(*len + 1);
+	read_full(fd, p, *len);
+	return p;
+}
+
+static int64_t at64(const unsigned char *p){
+	int64_t v;
+	memcpy(&v, p, 8);
+	return v;
+}
+
+/*** Server ***/
+static pid_t start_server(const char *path){
+	pid_t pid = fork();
+	if (pid == 0){
+		execl("./lifeterm.o", "./lifeterm.o", "--serve", path, (char *)NULL);
+		perror("exec ./lifeterm.o");
+		_exit(1);
+	}
+	return pid;
+}
+
+static int connect_server(const char *path){
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	strcpy(addr.sun_path, path);
+	for (int tries = 0; tries < 100; tries++){
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+			return fd;
+		close(fd);
+		usleep(20000);
+	}
+	fprintf(stderr, "unable to connect to %s\n", path);
+	exit(1);
+}
+
+/*** Tests ***/
+static void test_glider(int fd, const char *savepath){
+	// Everything in one write, the server has to split the frames itself
+	const char *glider = "patterns/glider.mc";
+	int64_t four = 4;
+	request(OP_LOAD, glider, strlen(glider));
+	request(OP_POPULATION, NULL, 0);
+	request(OP_BBOX, NULL, 0);
+	request64(OP_ADVANCE, &four, 1);
+	request(OP_BBOX, NULL, 0);
+	request(OP_SAVE, savepath, strlen(savepath));
+	request(OP_LOAD, savepath, strlen(savepath));
+	request(OP_BBOX, NULL, 0);
+	send_all(fd);
+
+	uint8_t status;
+	uint32_t len;
+	unsigned char *p;
+
+	p = response(fd, &status, &len);
+	CHECK(status == SERVER_OK && len == 8 && at64(p) == 5, "load: status %d population %ld", status, (long)at64(p));
+	free(p);
+
+	p = response(fd, &status, &len);
+	CHECK(status == SERVER_OK && at64(p) == 5, "population %ld", (long)at64(p));
+	free(p);
+
+	int64_t box[4];
+	p = response(fd, &status, &len);
+	CHECK(status == SERVER_OK && len == 33 && p[0] == 1, "bbox: status %d found %d", status, p[0]);
+	memcpy(box, p + 1, sizeof(box));
+	CHECK(box[2] - box[0] == 3 && box[3] - box[1] == 3, "glider box is %ldx%ld", (long)(box[2] - box[0]), (long)(box[3] - box[1]));
+	free(p);
+
+	p = response(fd, &status, &len);
+	CHECK(status == SERVER_OK && at64(p) == 4 && at64(p + 8) == 5, "advance: gen %ld population %ld", (long)at64(p), (long)at64(p + 8));
+	free(p);
+
+	// a glider moves one cell diagonally every 4 generations
+	int64_t moved[4];
+	p = response(fd, &status, &len);
+	memcpy(moved, p + 1, sizeof(moved));
+	int64_t dx = moved[0] - box[0], dy = moved[1] - box[1];
+	CHECK((dx == 1 || dx == -1) && (dy == 1 || dy == -1) && moved[2] - moved[0] == 3,
+			"glider moved by (%ld, %ld)", (long)dx, (long)dy);
+	free(p);
+
+	p = response(fd, &status, &len);
+	CHECK(status == SERVER_OK && len == 0, "save: status %d", status);
+	free(p);
+
+	p = response(fd, &status, &len);
+	CHECK(status == SERVER_OK && at64(p) == 5, "reload: status %d population %ld", status, (long)at64(p));
+	free(p);
+
+	int64_t reloaded[4];
+	p = response(fd, &status, &len);
+	memcpy(reloaded, p + 1, sizeof(reloaded));
+	CHECK(reloaded[2] - reloaded[0] == 3 && reloaded[3] - reloaded[1] == 3, "saved glider came back as %ldx%ld",
+			(long)(reloaded[2] - reloaded[0]), (long)(reloaded[3] - reloaded[1]));
+	free(p);
+
+	// The region around the glider holds its five cells, one cell further out holds nothing
+	int64_t region[4] = {reloaded[0] - 1, reloaded[1] - 1, 5, 5};
+	int64_t empty[4] = {reloaded[2], reloaded[1], 2, 3};
+	request64(OP_REGION, region, 4);
+	request64(OP_REGION, empty, 4);
+	send_all(fd);
+
+	p = response(fd, &status, &len);
+	CHECK(status == SERVER_OK && len == 8 + 5 && at64(p) == 5, "region: status %d len %u count %ld", status, len, (long)at64(p));
+	int bits = 0;
+	for (uint32_t i = 8; i < len; i++)
+		bits += __builtin_popcount(p[i]);
+	CHECK(bits == 5, "region bitmap has %d cells", bits);
+	CHECK((p[8] & 1) == 0 && (p[8 + 4] & 0x10) == 0, "region border should be dead");
+	free(p);
+
+	p = response(fd, &status, &len);
+	CHECK(status == SERVER_OK && at64(p) == 0, "empty region: count %ld", (long)at64(p));
+	free(p);
+}
+
+static void test_errors(int fd){
+	const char *missing = "patterns/does-not-exist.mc";
+	int64_t negative = -1;
+	int64_t huge[4] = {0, 0, (int64_t)1 << 20, (int64_t)1 << 20};
+	request(OP_LOAD, missing, strlen(missing));
+	request64(OP_ADVANCE, &negative, 1);
+	request64(OP_REGION, huge, 4);
+	request(99, NULL, 0);
+	request(OP_POPULATION, NULL, 0);
+	send_all(fd);
+
+	const char *what[] = {"missing file", "negative advance", "huge region", "unknown op"};
+	uint8_t status;
+	uint32_t len;
+	for (int i = 0; i < 4; i++){
+		unsigned char *p = response(fd, &status, &len);
+		CHECK(status == SERVER_ERROR, "%s should fail", what[i]);
+		free(p);
+	}
+
+	// errors leave the connection usable
+	unsigned char *p = response(fd, &status, &len);
+	CHECK(status == SERVER_OK, "population after errors");
+	free(p);
+}
+
+static void test_bad_frame(const char *path, int fd){
+	// A broken frame costs the sender its connection and nobody else
+	int bad = connect_server(path);
+	uint32_t framelen = SERVER_MAX_REQUEST + 1;
+	char c;
+	CHECK(write(bad, &framelen, 4) == 4, "write bad frame");
+	CHECK(read(bad, &c, 1) == 0, "bad frame should close the connection");
+	close(bad);
+
+	request(OP_POPULATION, NULL, 0);
+	send_all(fd);
+	uint8_t status;
+	uint32_t len;
+	unsigned char *p = response(fd, &status, &len);
+	CHECK(status == SERVER_OK && at64(p) == 5, "other connection after a bad frame");
+	free(p);
+}
+
+static void test_hash(int fd, int other){
+	// Same cells give the same content hash whichever connection built them,
+	// and the glider is back to its own shape, moved, after 4 generations
+	const char *glider = "patterns/glider.mc";
+	int64_t four = 4;
+	request(OP_LOAD, glider, strlen(glider));
+	request(OP_HASH, NULL, 0);
+	send_all(other);
+	request(OP_LOAD, glider, strlen(glider));
+	request(OP_HASH, NULL, 0);
+	request64(OP_ADVANCE, &four, 1);
+	request(OP_HASH, NULL, 0);
+	send_all(fd);
+
+	uint8_t status;
+	uint32_t len;
+	unsigned char h[3][16];
+	free(response(other, &status, &len));
+	unsigned char *p = response(other, &status, &len);
+	CHECK(status == SERVER_OK && len == 16, "hash: status %d len %u", status, len);
+	memcpy(h[0], p, 16);
+	free(p);
+
+	free(response(fd, &status, &len)); // load
+	p = response(fd, &status, &len);
+	memcpy(h[1], p, 16);
+	free(p);
+	free(response(fd, &status, &len)); // advance
+	p = response(fd, &status, &len);
+	memcpy(h[2], p, 16);
+	free(p);
+	CHECK(memcmp(h[0], h[1], 16) == 0, "same pattern on two connections hashes differently");
+	CHECK(memcmp(h[1], h[2], 16) != 0, "moved glider kept its hash");
+}
+
+static void test_engine(int fd, int other){
+	// The tile engine and hashlife agree on where a messy pattern ends up
+	const char *roth = "patterns/roth.mc";
+	int64_t gens = 300;
+	uint8_t tile = ENGINE_TILE, autoengine = ENGINE_AUTO, bogus = 7;
+	request(OP_LOAD, roth, strlen(roth));
+	request64(OP_ADVANCE, &gens, 1);
+	request(OP_HASH, NULL, 0);
+	send_all(other);
+	request(OP_ENGINE, &tile, 1);
+	request(OP_LOAD, roth, strlen(roth));
+	request64(OP_ADVANCE, &gens, 1);
+	request(OP_HASH, NULL, 0);
+	request(OP_ENGINE, &autoengine, 1);
+	request(OP_ENGINE, &bogus, 1);
+	send_all(fd);
+
+	uint8_t status;
+	uint32_t len;
+	unsigned char want[16], *p;
+	free(response(other, &status, &len)); // load
+	free(response(other, &status, &len)); // advance
+	p = response(other, &status, &len);
+	memcpy(want, p, 16);
+	free(p);
+
+	p = response(fd, &status, &len);
+	CHECK(status == SERVER_OK && len == 1 && p[0] == ENGINE_TILE, "engine: status %d engine %d", status, p[0]);
+	free(p);
+	free(response(fd, &status, &len)); // load
+	p = response(fd, &status, &len);
+	CHECK(status == SERVER_OK && at64(p) == 300, "tile advance: gen %ld", (long)at64(p));
+	free(p);
+	p = response(fd, &status, &len);
+	CHECK(status == SERVER_OK && memcmp(p, want, 16) == 0, "tiles and hashlife disagree after 300 generations");
+	free(p);
+	p = response(fd, &status, &len);
+	CHECK(status == SERVER_OK && len == 1, "auto engine: status %d", status);
+	free(p);
+	p = response(fd, &status, &len);
+	CHECK(status == SERVER_ERROR, "engine 7 should fail");
+	free(p);
+}
+
+static void export_request(int64_t x, int64_t y, int64_t w, int64_t h, uint8_t scale, uint8_t format, const char *path){
+	unsigned char req[34 + 64];
+	int64_t box[4] = {x, y, w, h};
+	memcpy(req, box, 32);
+	req[32] = scale;
+	req[33] = format;
+	memcpy(req + 34, path, strlen(path));
+	request(OP_EXPORT, req, 34 + strlen(path));
+}
+
+static void test_export(int fd, const char *imgpath){
+	// A PBM at one cell per pixel has the same cells as OP_REGION, MSB first
+	const char *glider = "patterns/glider.mc";
+	int64_t box[4] = {-5, -3, 13, 9};
+	request(OP_LOAD, glider, strlen(glider));
+	request64(OP_REGION, box, 4);
+	export_request(box[0], box[1], box[2], box[3], 0, EXPORT_PBM, imgpath);
+	export_request(box[0], box[1], box[2], box[3], 0, 9, imgpath);
+	send_all(fd);
+
+	uint8_t status;
+	uint32_t len;
+	free(response(fd, &status, &len)); // load
+	unsigned char *region = response(fd, &status, &len);
+	unsigned char *p = response(fd, &status, &len);
+	CHECK(status == SERVER_OK && len == 16 && at64(p) == 13 && at64(p + 8) == 9,
+			"export: status %d size %ldx%ld", status, (long)at64(p), (long)at64(p + 8));
+	free(p);
+
+	char head[16];
+	unsigned char bits[2 * 9];
+	FILE *fp = fopen(imgpath, "rb");
+	int ok = fp && fread(head, 1, 8, fp) == 8 && memcmp(head, "P4\n13 9\n", 8) == 0 &&
+		fread(bits, 1, sizeof(bits), fp) == sizeof(bits);
+	for (int i = 0; ok && i < 13 * 9; i++){
+		int x = i % 13, y = i / 13;
+		ok = !(region[8 + y * 2 + x / 8] >> (x % 8) & 1) == !(bits[y * 2 + x / 8] & 0x80 >> (x % 8));
+	}
+	CHECK(ok, "exported PBM differs from the region");
+	if (fp)
+		fclose(fp);
+	free(region);
+
+	p = response(fd, &status, &len);
+	CHECK(status == SERVER_ERROR, "export format 9 should fail");
+	free(p);
+}
+
+static void test_far(int fd){
+	// Past what one advance() takes: the glider is stepped in chunks and ends up 2^59
+	// cells away, and a count that would overflow the generation is refused
+	const char *glider = "patterns/glider.mc";
+	int64_t far = (int64_t)1 << 61, max = INT64_MAX;
+	request(OP_LOAD, glider, strlen(glider));
+	request64(OP_ADVANCE, &far, 1);
+	request(OP_BBOX, NULL, 0);
+	request64(OP_ADVANCE, &max, 1);
+	request(OP_POPULATION, NULL, 0);
+	send_all(fd);
+
+	uint8_t status;
+	uint32_t len;
+	unsigned char *p;
+	free(response(fd, &status, &len)); // load
+	p = response(fd, &status, &len);
+	CHECK(status == SERVER_OK && at64(p) == far && at64(p + 8) == 5, "advance 2^61: status %d gen %lld population %ld",
+			status, (long long)at64(p), (long)at64(p + 8));
+	free(p);
+	p = response(fd, &status, &len);
+	int64_t x0 = at64(p + 1), y0 = at64(p + 9);
+	CHECK(status == SERVER_OK && p[0] == 1 && (x0 < 0 ? -x0 : x0) >> 58 == 2 && (y0 < 0 ? -y0 : y0) >> 58 == 2,
+			"glider after 2^61 generations at %lld, %lld", (long long)x0, (long long)y0);
+	free(p);
+	p = response(fd, &status, &len);
+	CHECK(status == SERVER_ERROR, "advance past INT64_MAX should fail");
+	free(p);
+	p = response(fd, &status, &len);
+	CHECK(status == SERVER_OK && at64(p) == 5, "population after a refused advance %ld", (long)at64(p));
+	free(p);
+}
+
+int main(){
+	char path[64], savepath[64], imgpath[64];
+	snprintf(path, sizeof(path), "/tmp/lifeterm-test-%d.sock", (int)getpid());
+	snprintf(savepath, sizeof(savepath), "/tmp/lifeterm-test-%d.mc", (int)getpid());
+	snprintf(imgpath, sizeof(imgpath), "/tmp/lifeterm-test-%d.pbm", (int)getpid());
+
+	pid_t pid = start_server(path);
+	int fd = connect_server(path);
+	int other = connect_server(path); // every connection has its own universe
+
+	test_glider(fd, savepath);
+	test_errors(other);
+	test_bad_frame(path, fd);
+	test_hash(fd, other);
+	test_engine(fd, other);
+	test_export(fd, imgpath);
+	test_far(fd);
+	test_far(other);
+
+	close(fd);
+	close(other);
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	unlink(path);
+	unlink(savepath);
+	unlink(imgpath);
+
+	printf("%s\n", fails ? "test_server FAILED" : "test_server passed");
+	return fails ? 1 : 0;
+}
@@ -0,0 +1,103 @@
+// Checks of the soup census: settled debris is split into the objects apgsearch
+// would count, with their apgcodes, and the census doesn't depend on the threads
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "soup.h"
+#include "log.h"
+
+static int fails = 0;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { fails++; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } \
+} while (0)
+
+/*** Helpers ***/
+static Node *cells_node(const int (*cells)[2], int n){
+	// The cells, given relative to the middle of a PACK_LEVEL node
+	uint64_t rows[PACK_SIZE] = {0};
+	for (int i = 0; i < n; i++)
+		rows[PACK_SIZE / 2 + cells[i][1]] |= (uint64_t)1 << (PACK_SIZE / 2 + cells[i][0]);
+	return leaf_pack(rows);
+}
+
+static int64_t count_of(const SoupObject *objs, int n, const char *name){
+	for (int i = 0; i < n; i++)
+		if (strcmp(objs[i].name, name) == 0)
+			return objs[i].count;
+	return 0;
+}
+
+static char *census_body(const char *path){
+	// The census lines of a file, without the headers that hold timings. Caller frees
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL)
+		return NULL;
+	char line[SOUP_NAME_MAX + 64], *body = calloc(1, 1);
+	size_t len = 0;
+	while (body && fgets(line, sizeof(line), fp)){
+		if (line[0] == '#')
+			continue;
+		char *more = realloc(body, len + strlen(line) + 1);
+		if (more == NULL){
+			free(body);
+			body = NULL;
+			break;
+		}
+		body = more;
+		strcpy(body + len, line);
+		len += strlen(line);
+	}
+	fclose(fp);
+	return body;
+}
+
+/*** Tests ***/
+static void test_split(){
+	// A block and a blinker two cells apart diagonally run the same alone as together,
+	// so they are counted as two objects, though the gap alone would group them
+	static const int pair[][2] = {{0, 0}, {1, 0}, {0, 1}, {1, 1}, {3, -4}, {3, -3}, {3, -2}};
+	SoupObject objs[8];
+	engine_enter();
+	int n = soup_objects(cells_node(pair, 7), RULE_LIFE, objs, 8);
+	CHECK(n == 2 && count_of(objs, n, "xs4_33") == 1 && count_of(objs, n, "xp2_7") == 1,
+			"block next to a blinker: %d objects, first %s", n, n > 0 ? objs[0].name : "none");
+
+	// Touching cells stay one object
+	static const int beehive[][2] = {{1, 0}, {2, 0}, {0, 1}, {3, 1}, {1, 2}, {2, 2}};
+	n = soup_objects(cells_node(beehive, 6), RULE_LIFE, objs, 8);
+	CHECK(n == 1 && count_of(objs, n, "xs6_696") == 1, "beehive: %d objects, first %s", n, n > 0 ? objs[0].name : "none");
+
+	static const int glider[][2] = {{1, 0}, {2, 1}, {0, 2}, {1, 2}, {2, 2}};
+	n = soup_objects(cells_node(glider, 5), RULE_LIFE, objs, 8);
+	CHECK(n == 1 && count_of(objs, n, "xq4_153") == 1, "glider: %d objects, first %s", n, n > 0 ? objs[0].name : "none");
+	engine_leave();
+}
+
+static void test_threads(){
+	// Soups run on one thread or several, with collections in between, give the same census
+	char path[2][64];
+	char *body[2];
+	for (int i = 0; i < 2; i++){
+		SoupOptions opt = {.count = 40, .seed = 7, .rule = RULE_LIFE, .threads = i == 0 ? 1 : 4};
+		snprintf(path[i], sizeof(path[i]), "/tmp/test_soup_%d_%d.txt", (int)getpid(), i);
+		CHECK(soup_search(&opt, path[i]) == 0, "soup search on %d threads", opt.threads);
+		body[i] = census_body(path[i]);
+		unlink(path[i]);
+	}
+	CHECK(body[0] && body[1] && strlen(body[0]) > 0, "census missing");
+	CHECK(body[0] && body[1] && strcmp(body[0], body[1]) == 0, "census on 4 threads differs from 1:\n%s\nvs\n%s",
+			body[1] ? body[1] : "", body[0] ? body[0] : "");
+	free(body[0]);
+	free(body[1]);
+}
+
+int main(){
+	log_set_quiet(true);
+	gc_set_budget(8 << 20); // small enough to collect while the soups run
+	init_hashtab();
+	test_split();
+	test_threads();
+	printf("%s\n", fails ? "test_soup FAILED" : "test_soup passed");
+	return fails ? 1 : 0;
+}
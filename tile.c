@@ -0,0 +1,355 @@
+#include "tile.h"
+
+// A tile depends only on itself and its 8 neighbours. If none of those changed in
+// the last generation, the next one is the same as this one, so each generation
+// steps the tiles that changed and their neighbours and nothing else.
+
+/*** Table ***/
+static size_t tile_bucket(Tiles *t, int64_t tx, int64_t ty){
+	uint64_t h = (uint64_t)tx * 0x9E3779B97F4A7C15ull ^ (uint64_t)ty * 0xC2B2AE3D27D4EB4Full;
+	return (h ^ (h >> 29)) & (t->size - 1);
+}
+
+static Tile *tile_find(Tiles *t, int64_t tx, int64_t ty){
+	for (Tile *tile = t->buckets[tile_bucket(t, tx, ty)]; tile; tile = tile->chain)
+		if (tile->tx == tx && tile->ty == ty)
+			return tile;
+	return NULL;
+}
+
+static void tiles_grow(Tiles *t){
+	int oldsize = t->size;
+	Tile **old = t->buckets;
+	t->size *= 2;
+	t->buckets = calloc(t->size, sizeof(Tile *));
+	if (t->buckets == NULL){
+		fprintf(stderr, "Out of memory for tiles\n");
+		exit(1);
+	}
+	for (int i = 0; i < oldsize; i++){
+		Tile *tile = old[i];
+		while (tile){
+			Tile *next = tile->chain;
+			size_t b = tile_bucket(t, tile->tx, tile->ty);
+			tile->chain = t->buckets[b];
+			t->buckets[b] = tile;
+			tile = next;
+		}
+	}
+	free(old);
+}
+
+static Tile *tile_get(Tiles *t, int64_t tx, int64_t ty){
+	// The tile at (tx, ty), a new empty one if there was none
+	Tile *tile = tile_find(t, tx, ty);
+	if (tile)
+		return tile;
+	tile = calloc(1, sizeof(Tile));
+	if (tile == NULL){
+		fprintf(stderr, "Out of memory for tiles\n");
+		exit(1);
+	}
+	tile->tx = tx;
+	tile->ty = ty;
+	tile->queued = -1;
+	size_t b = tile_bucket(t, tx, ty);
+	tile->chain = t->buckets[b];
+	t->buckets[b] = tile;
+	if (++t->count > t->size)
+		tiles_grow(t);
+	return tile;
+}
+
+static void tile_remove(Tiles *t, Tile *tile){
+	for (Tile **link = &t->buckets[tile_bucket(t, tile->tx, tile->ty)]; *link; link = &(*link)->chain)
+		if (*link == tile){
+			*link = tile->chain;
+			break;
+		}
+	t->count--;
+	free(tile);
+}
+
+static void push(Tile ***list, int *len, int *cap, Tile *tile){
+	if (*len == *cap){
+		int newcap = *cap ? *cap * 2 : 64;
+		Tile **new = realloc(*list, newcap * sizeof(Tile *));
+		if (new == NULL){
+			fprintf(stderr, "Out of memory for tiles\n");
+			exit(1);
+		}
+		*list = new;
+		*cap = newcap;
+	}
+	(*list)[(*len)++] = tile;
+}
+
+static Tiles *tiles_new(){
+	Tiles *t = calloc(1, sizeof(Tiles));
+	if (t == NULL)
+		return NULL;
+	t->size = TILES_INIT_SIZE;
+	t->buckets = calloc(t->size, sizeof(Tile *));
+	if (t->buckets == NULL){
+		free(t);
+		return NULL;
+	}
+	return t;
+}
+
+void tiles_free(Tiles *t){
+	if (t == NULL)
+		return;
+	for (int i = 0; i < t->size; i++){
+		Tile *tile = t->buckets[i];
+		while (tile){
+			Tile *next = tile->chain;
+			free(tile);
+			tile = next;
+		}
+	}
+	free(t->buckets);
+	free(t->active);
+	free(t->work);
+	free(t);
+}
+
+uint64_t tiles_population(Tiles *t){
+	uint64_t n = 0;
+	for (int i = 0; i < t->size; i++)
+		for (Tile *tile = t->buckets[i]; tile; tile = tile->chain)
+			for (int y = 0; y < TILE_SIZE; y++)
+				n += __builtin_popcountll(tile->rows[y]);
+	return n;
+}
+
+
+/*** Stepping ***/
+static int edge_live(Tile *tile, int dx, int dy){
+	// Any live cell on the side (or corner) of tile facing direction (dx, dy)
+	uint64_t cols = dx < 0 ? 1 : dx > 0 ? (uint64_t)1 << (TILE_SIZE - 1) : ~(uint64_t)0;
+	int y0 = dy > 0 ? TILE_SIZE - 1 : 0, y1 = dy < 0 ? 1 : TILE_SIZE;
+	for (int y = y0; y < y1; y++)
+		if (tile->rows[y] & cols)
+			return 1;
+	return 0;
+}
+
+static void queue(Tiles *t, Tile *tile){
+	if (tile->queued == t->gen)
+		return;
+	tile->queued = t->gen;
+	push(&t->work, &t->worklen, &t->workcap, tile);
+}
+
+static void step_tile(Tiles *t, Tile *tile, const RulePlan *plan){
+	// tile->next = tile->rows one generation on
+	Tile *nb[3][3];
+	for (int dy = -1; dy <= 1; dy++)
+		for (int dx = -1; dx <= 1; dx++)
+			nb[dy + 1][dx + 1] = dx || dy ? tile_find(t, tile->tx + dx, tile->ty + dy) : tile;
+
+	// Rows -1 to TILE_SIZE, with the cell just left and just right of each
+	const int last = TILE_SIZE - 1;
+	uint64_t row[TILE_SIZE + 2], left[TILE_SIZE + 2], right[TILE_SIZE + 2];
+	for (int y = -1; y <= TILE_SIZE; y++){
+		int r = y < 0 ? 0 : y == TILE_SIZE ? 2 : 1; // row of nb to read from
+		int ty = y < 0 ? last : y == TILE_SIZE ? 0 : y;
+		Tile *w = nb[r][0], *m = nb[r][1], *e = nb[r][2];
+		row[y + 1] = m ? m->rows[ty] : 0;
+		left[y + 1] = w ? w->rows[ty] >> last : 0;
+		right[y + 1] = e ? e->rows[ty] & 1 : 0;
+	}
+
+	for (int y = 0; y < TILE_SIZE; y++){
+		if (!(row[y] | row[y + 1] | row[y + 2] | left[y] | left[y + 1] | left[y + 2] |
+				right[y] | right[y + 1] | right[y + 2])){
+			tile->next[y] = 0; // nothing near this row, most of a sparse tile
+			continue;
+		}
+		// Bit i of w/e holds the cell left/right of cell i
+		uint64_t w[3], e[3];
+		for (int i = 0; i < 3; i++){
+			w[i] = row[y + i] << 1 | left[y + i];
+			e[i] = row[y + i] >> 1 | right[y + i] << last;
+		}
+		tile->next[y] = step_row(w, row + y, e, plan);
+	}
+}
+
+static void step(Tiles *t, const RulePlan *plan){
+	// One generation
+	t->gen++;
+	t->worklen = 0;
+	for (int i = 0; i < t->activelen; i++){
+		Tile *tile = t->active[i];
+		queue(t, tile);
+		for (int dy = -1; dy <= 1; dy++)
+			for (int dx = -1; dx <= 1; dx++){
+				if (!dx && !dy)
+					continue;
+				// A missing neighbour only needs to exist if cells can be born in it
+				Tile *n = tile_find(t, tile->tx + dx, tile->ty + dy);
+				if (n == NULL && edge_live(tile, dx, dy))
+					n = tile_get(t, tile->tx + dx, tile->ty + dy);
+				if (n)
+					queue(t, n);
+			}
+	}
+
+	for (int i = 0; i < t->worklen; i++)
+		step_tile(t, t->work[i], plan);
+
+	t->activelen = 0;
+	for (int i = 0; i < t->worklen; i++){
+		Tile *tile = t->work[i];
+		uint64_t changed = 0, live = 0;
+		for (int y = 0; y < TILE_SIZE; y++){
+			changed |= tile->rows[y] ^ tile->next[y];
+			live |= tile->next[y];
+			tile->rows[y] = tile->next[y];
+		}
+		if (changed)
+			push(&t->active, &t->activelen, &t->activecap, tile);
+		else if (!live)
+			tile_remove(t, tile); // empty and staying so, B0 rules aren't allowed
+	}
+}
+
+void tiles_step(Tiles *t, int64_t n, unsigned rule){
+	// n generations on, stopping early once nothing changes
+	RulePlan plan;
+	rule_plan(&plan, rule);
+	for (int64_t i = 0; i < n && t->activelen > 0; i++)
+		step(t, &plan);
+}
+
+
+/*** Conversion ***/
+static void fill_rows(Node *p, uint64_t *rows, int x, int y){
+	// Set the cells of p into rows, with p's corner at (x, y)
+	if (p->n == 0)
+		return;
+	if (p->k == 0){
+		rows[y] |= (uint64_t)1 << x;
+		return;
+	}
+	if (p->packed){
+		memcpy(rows, leaf_bits(p), TILE_SIZE * sizeof(uint64_t)); // a whole tile
+		return;
+	}
+	int half = 1 << (p->k - 1);
+	fill_rows(p->a, rows, x, y);
+	fill_rows(p->b, rows, x + half, y);
+	fill_rows(p->c, rows, x, y + half);
+	fill_rows(p->d, rows, x + half, y + half);
+}
+
+static void fill_tiles(Tiles *t, Node *p, int64_t x, int64_t y){
+	if (p->n == 0)
+		return;
+	if (p->k == TILE_BITS){
+		Tile *tile = tile_get(t, x >> TILE_BITS, y >> TILE_BITS);
+		fill_rows(p, tile->rows, 0, 0);
+		push(&t->active, &t->activelen, &t->activecap, tile);
+		return;
+	}
+	int64_t half = (int64_t)1 << (p->k - 1);
+	fill_tiles(t, p->a, x, y);
+	fill_tiles(t, p->b, x + half, y);
+	fill_tiles(t, p->c, x, y + half);
+	fill_tiles(t, p->d, x + half, y + half);
+}
+
+static int64_t count_tiles(Node *p, int64_t limit){
+	if (p->n == 0)
+		return 0;
+	if (p->k <= TILE_BITS || limit <= 1)
+		return 1;
+	int64_t n = 0;
+	Node *child[4] = {p->a, p->b, p->c, p->d};
+	for (int i = 0; i < 4 && n < limit; i++)
+		n += count_tiles(child[i], limit - n);
+	return n;
+}
+
+int64_t tiles_count(Node *root, int64_t limit){
+	// How many tiles the cells of root take, counting stops once past limit
+	return count_tiles(root, limit);
+}
+
+Tiles *tiles_from_node(Node *root){
+	// The cells of root as tiles, all of them active. NULL if out of memory.
+	// Must be called inside an engine section
+	Tiles *t = tiles_new();
+	if (t == NULL)
+		return NULL;
+	if (root->n == 0)
+		return t;
+	while (root->k <= TILE_BITS) // the corner has to sit on a tile boundary
+		root = centre(root);
+	int64_t half = (int64_t)1 << (root->k - 1);
+	fill_tiles(t, root, -half, -half);
+	return t;
+}
+
+static int split(Tile **list, int n, int vertical, int64_t mid){
+	// Move the tiles before mid (above it when vertical) to the front, return how many
+	int front = 0;
+	for (int i = 0; i < n; i++){
+		int64_t at = (vertical ? list[i]->ty : list[i]->tx) * TILE_SIZE;
+		if (at < mid){
+			Tile *tmp = list[front];
+			list[front++] = list[i];
+			list[i] = tmp;
+		}
+	}
+	return front;
+}
+
+static Node *build(Tile **list, int n, int k, int64_t x, int64_t y, Node **zero){
+	// The level k node with its corner at (x, y) out of the n tiles inside it
+	if (n == 0)
+		return zero[k];
+	if (k == TILE_BITS)
+		return leaf_pack(list[0]->rows);
+	int64_t half = (int64_t)1 << (k - 1);
+	int top = split(list, n, 1, y + half);
+	int a = split(list, top, 0, x + half);
+	int c = split(list + top, n - top, 0, x + half);
+	return join(
+			build(list, a, k - 1, x, y, zero),
+			build(list + a, top - a, k - 1, x + half, y, zero),
+			build(list + top, c, k - 1, x, y + half, zero),
+			build(list + top + c, n - top - c, k - 1, x + half, y + half, zero));
+}
+
+Node *tiles_to_node(Tiles *t){
+	// A root with the cells of the tiles, built bottom up one tile at a time.
+	// Must be called inside an engine section
+	Tile **list = malloc((t->count + 1) * sizeof(Tile *));
+	if (list == NULL){
+		fprintf(stderr, "Out of memory for tiles\n");
+		exit(1);
+	}
+	int n = 0;
+	int64_t reach = TILE_SIZE; // distance from the centre the root has to cover
+	for (int i = 0; i < t->size; i++)
+		for (Tile *tile = t->buckets[i]; tile; tile = tile->chain){
+			list[n++] = tile;
+			reach = max(reach, max(-tile->tx, tile->tx + 1) * TILE_SIZE);
+			reach = max(reach, max(-tile->ty, tile->ty + 1) * TILE_SIZE);
+		}
+	int k = TILE_BITS + 1;
+	while (((int64_t)1 << (k - 1)) < reach)
+		k++;
+
+	Node *zero[64];
+	zero[0] = OFF;
+	for (int i = 1; i <= k; i++)
+		zero[i] = join(zero[i - 1], zero[i - 1], zero[i - 1], zero[i - 1]);
+	int64_t half = (int64_t)1 << (k - 1);
+	Node *root = build(list, n, k, -half, -half, zero);
+	free(list);
+	return root;
+}
@@ -0,0 +1,50 @@
+#ifndef TILE_H
+#define TILE_H
+#include "hashlife.h"
+
+/*
+ * Tile engine: the universe as a sparse set of 64x64 bitboards, stepped one
+ * generation at a time. Only tiles next to a tile that changed in the last
+ * generation are recomputed, the rest are known to stay as they are.
+ * It beats successor() on chaotic patterns whose nodes rarely repeat, see
+ * ENGINE_AUTO in hashlife.h for when a universe switches over.
+ * Coordinates are relative to the centre of the universe, like roots.
+ */
+
+/*** Defines ***/
+#define TILE_BITS 6
+#define TILE_SIZE (1 << TILE_BITS) // cells on a side, one uint64_t per row
+#define TILES_INIT_SIZE 256 // buckets, a power of 2
+#if TILE_BITS != PACK_LEVEL
+#error "a tile is the rows of one packed leaf"
+#endif
+
+/*** Structs ***/
+typedef struct Tile Tile;
+struct Tile {
+	int64_t tx, ty; // cell (x, y) lives in tile (x >> TILE_BITS, y >> TILE_BITS)
+	uint64_t rows[TILE_SIZE]; // bit i of rows[j] is the cell i right and j down of the corner
+	uint64_t next[TILE_SIZE];
+	int64_t queued; // generation it was last queued for stepping
+	Tile *chain; // next tile in the same bucket
+};
+
+struct Tiles {
+	Tile **buckets; // chained on (tx, ty)
+	int size, count;
+	Tile **active; // tiles that changed in the last generation
+	int activelen, activecap;
+	Tile **work; // tiles to step this generation
+	int worklen, workcap;
+	int64_t gen;
+};
+
+/*** Tile engine ***/
+int64_t tiles_count(Node *root, int64_t limit);
+Tiles *tiles_from_node(Node *root);
+Node *tiles_to_node(Tiles *t);
+void tiles_free(Tiles *t);
+void tiles_step(Tiles *t, int64_t n, unsigned rule);
+uint64_t tiles_population(Tiles *t);
+
+#endif
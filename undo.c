@@ -0,0 +1,69 @@
+#include "undo.h"
+
+// Edits rebuild only the path from the changed cell to the root and share
+// everything else, so an entry costs the nodes it alone keeps alive, which
+// is what the budget counts, rather than the number of entries.
+
+void undo_init(Undo *u, size_t budget){
+	memset(u, 0, sizeof(Undo));
+	u->budget = budget;
+}
+
+static void stack_push(UndoStack *s, UndoEntry e){
+	if (s->len == s->cap){
+		s->cap = s->cap ? s->cap * 2 : UNDO_INIT_CAP;
+		s->entries = realloc(s->entries, s->cap * sizeof(UndoEntry));
+		assert(s->entries != NULL);
+	}
+	s->entries[s->len++] = e;
+}
+
+static void undo_trim(Undo *u){
+	// Forget the oldest edits until we are back under budget, always keeping the last one
+	int drop = 0;
+	while (u->bytes > u->budget && drop < u->undo.len - 1)
+		u->bytes -= u->undo.entries[drop++].bytes;
+	if (drop == 0)
+		return;
+	memmove(u->undo.entries, u->undo.entries + drop, (u->undo.len - drop) * sizeof(UndoEntry));
+	u->undo.len -= drop;
+	log_info("Undo over budget, dropped %d oldest edits", drop);
+}
+
+void undo_push(Undo *u, Node *before, int64_t gen, size_t bytes){
+	// Record the universe as it was before an edit. A new edit forgets what could be redone
+	for (int i = 0; i < u->redo.len; i++)
+		u->bytes -= u->redo.entries[i].bytes;
+	u->redo.len = 0;
+
+	stack_push(&u->undo, (UndoEntry){.root = before, .gen = gen, .bytes = bytes});
+	u->bytes += bytes;
+	undo_trim(u);
+}
+
+static int undo_move(UndoStack *from, UndoStack *to, Node **root, int64_t *gen){
+	// Swap the current universe with the top of from, keeping the current one on to
+	if (from->len == 0)
+		return 0;
+	UndoEntry e = from->entries[--from->len];
+	stack_push(to, (UndoEntry){.root = *root, .gen = *gen, .bytes = e.bytes});
+	*root = e.root;
+	*gen = e.gen;
+	return 1;
+}
+
+int undo_undo(Undo *u, Node **root, int64_t *gen){
+	return undo_move(&u->undo, &u->redo, root, gen);
+}
+
+int undo_redo(Undo *u, Node **root, int64_t *gen){
+	return undo_move(&u->redo, &u->undo, root, gen);
+}
+
+void undo_mark(void *udata){
+	Undo *u = udata;
+	for (int i = 0; i < u->undo.len; i++)
+		gc_mark(u->undo.entries[i].root);
+	for (int i = 0; i < u->redo.len; i++)
+		gc_mark(u->redo.entries[i].root);
+}
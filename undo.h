@@ -0,0 +1,36 @@
+#ifndef UNDO_H
+#define UNDO_H
+#include "hashlife.h"
+
+/*** Structs ***/
+typedef struct {
+	Node *root; // the universe before an edit (or after it, on the redo stack)
+	int64_t gen;
+	size_t bytes; // memory only this entry keeps alive
+} UndoEntry;
+
+typedef struct {
+	UndoEntry *entries;
+	int len;
+	int cap;
+} UndoStack;
+
+typedef struct {
+	UndoStack undo;
+	UndoStack redo;
+	size_t bytes; // sum over both stacks
+	size_t budget; // oldest undo entries are dropped past this
+} Undo;
+
+/*** Undo ***/
+void undo_init(Undo *u, size_t budget);
+void undo_push(Undo *u, Node *before, int64_t gen, size_t bytes);
+int undo_undo(Undo *u, Node **root, int64_t *gen);
+int undo_redo(Undo *u, Node **root, int64_t *gen);
+void undo_mark(void *udata);
+
+/*** Defines ***/
+#define UNDO_BUDGET ((size_t)64 << 20) // bytes of nodes kept alive only by undo/redo
+#define UNDO_INIT_CAP 64
+
+#endif